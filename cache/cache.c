@@ -38,6 +38,98 @@ int clean_eviction_count = 0;
 /* TODO: add more globals, structs, macros if necessary */
 uword_t globalLru = 0;
 
+/*
+ * Undo journal. While a journal is active, every change to a line is logged
+ * with the line's old tag/valid/dirty/lru and, when data is about to be
+ * overwritten, the old bytes. cache_journal_undo() replays the log backwards,
+ * so rolling back costs as much as the changes did, not the cache size.
+ */
+typedef struct {
+    cache_line_t *line;
+    cache_line_t old;       /* old.data is not used */
+    size_t offset;          /* first data byte saved */
+    size_t len;             /* number of data bytes saved */
+    size_t saved;           /* where the bytes start in the journal's byte log */
+} journal_entry_t;
+
+typedef struct cache_journal {
+    journal_entry_t *entries;
+    size_t count, capacity;
+    byte_t *bytes;
+    size_t byte_count, byte_capacity;
+    uword_t globalLru;      /* globalLru when the journal started */
+} cache_journal_t;
+
+static cache_journal_t *journal = NULL;
+
+/* Log line's current state, plus len data bytes from offset, before it changes */
+static void journal_line(cache_line_t *line, size_t offset, size_t len)
+{
+    if (journal == NULL)
+        return;
+    if (journal->count == journal->capacity) {
+        journal->capacity = journal->capacity ? 2 * journal->capacity : 8;
+        journal->entries = realloc(journal->entries, journal->capacity * sizeof(journal_entry_t));
+    }
+    if (journal->byte_count + len > journal->byte_capacity) {
+        while (journal->byte_count + len > journal->byte_capacity)
+            journal->byte_capacity = journal->byte_capacity ? 2 * journal->byte_capacity : 64;
+        journal->bytes = realloc(journal->bytes, journal->byte_capacity);
+    }
+    journal_entry_t *e = &journal->entries[journal->count++];
+    e->line = line;
+    e->old = *line;
+    e->offset = offset;
+    e->len = len;
+    e->saved = journal->byte_count;
+    memcpy(&journal->bytes[e->saved], &line->data[offset], len);
+    journal->byte_count += len;
+}
+
+/*
+ * Start logging changes to every cache into a new journal, ending the
+ * previous one. Returns the journal for cache_journal_undo() or
+ * cache_journal_free().
+ */
+cache_journal_t *cache_journal_start()
+{
+    journal = calloc(1, sizeof(cache_journal_t));
+    journal->globalLru = globalLru;
+    return journal;
+}
+
+/* Stop logging; later changes cannot be undone */
+void cache_journal_stop()
+{
+    journal = NULL;
+}
+
+void cache_journal_free(cache_journal_t *j)
+{
+    if (j == journal)
+        journal = NULL;
+    free(j->entries);
+    free(j->bytes);
+    free(j);
+}
+
+/*
+ * Put every line j touched back the way it was when j started, then free j.
+ * Journals have to be undone newest first.
+ */
+void cache_journal_undo(cache_journal_t *j)
+{
+    for (size_t i = j->count; i-- > 0; ) {
+        journal_entry_t *e = &j->entries[i];
+        byte_t *data = e->line->data;
+        *e->line = e->old;
+        e->line->data = data;
+        memcpy(&data[e->offset], &j->bytes[e->saved], e->len);
+    }
+    globalLru = j->globalLru;
+    cache_journal_free(j);
+}
+
 /*
  * Initialize the cache according to specified arguments
  * Called by cache-runner so do not modify the function signature
@@ -84,13 +176,31 @@ cache_t *create_checkpoint(cache_t *cache) {
         for (unsigned int j = 0; j < cache->E; j++) {
             memcpy(&copy_cache->sets[i].lines[j], &cache->sets[i].lines[j], sizeof(cache_line_t));
             copy_cache->sets[i].lines[j].data = calloc(B, sizeof(byte_t));
-            memcpy(copy_cache->sets[i].lines[j].data, cache->sets[i].lines[j].data, sizeof(byte_t));
+            memcpy(copy_cache->sets[i].lines[j].data, cache->sets[i].lines[j].data, B);
         }
     }
     
     return copy_cache;
 }
 
+/*
+ * Copy the lines of a checkpoint back into cache, which must have the same
+ * geometry. The cache keeps its own data buffers.
+ */
+void restore_checkpoint(cache_t *cache, cache_t *checkpoint) {
+    unsigned int S = (unsigned int) pow(2, cache->s);
+    unsigned int B = (unsigned int) pow(2, cache->b);
+    for (unsigned int i = 0; i < S; i++) {
+        for (unsigned int j = 0; j < cache->E; j++) {
+            cache_line_t *line = &cache->sets[i].lines[j];
+            byte_t *data = line->data;
+            *line = checkpoint->sets[i].lines[j];
+            line->data = data;
+            memcpy(data, checkpoint->sets[i].lines[j].data, B);
+        }
+    }
+}
+
 void display_set(cache_t *cache, unsigned int set_index) {
     unsigned int S = (unsigned int) pow(2, cache->s);
     if (set_index < S) {
@@ -138,6 +248,7 @@ cache_line_t *get_line(cache_t *cache, uword_t addr)
         //Going through all lines hopefully
         if (cache -> sets[setIndex].lines[j].tag == ((addr >> (cache -> s + cache -> b)) & ((uword_t)pow(2, ADDRESS_LENGTH - cache -> s - cache -> b) - 1)) && cache -> sets[setIndex].lines[j].valid) {
             //XXX : why the dots and the arrows; all arrows ?
+            journal_line(&cache -> sets[setIndex].lines[j], 0, 0);
             (cache -> sets[setIndex].lines[j]).lru = globalLru;
             globalLru++;
             // hit_count++;
@@ -204,6 +315,7 @@ bool check_hit(cache_t *cache, uword_t addr, operation_t operation)
     } else if(possibleLine -> valid) {
         hit_count++;
         if(operation == WRITE) {
+            journal_line(possibleLine, 0, 0);
             possibleLine -> dirty = 1;
         }
         return true;
@@ -212,30 +324,21 @@ bool check_hit(cache_t *cache, uword_t addr, operation_t operation)
     return false;
 }
 
-/* TODO:
- * Handles Misses, evicting from the cache if necessary.
- * Fill out the evicted_line_t struct with info regarding the evicted line.
+/*
+ * Fill the line for addr, evicting whatever the replacement policy picks.
+ * Unlike handle_miss() this leaves the global counters alone, so caches
+ * other than the one test-cache checks (e.g. an instruction cache) can
+ * keep their own statistics from the returned evicted line.
  */
-evicted_line_t *handle_miss(cache_t *cache, uword_t addr, operation_t operation, byte_t *incoming_data)
+evicted_line_t *install_line(cache_t *cache, uword_t addr, operation_t operation, byte_t *incoming_data)
 {
     size_t B = (size_t)pow(2, cache->b);
     evicted_line_t *evicted_line = malloc(sizeof(evicted_line_t));
     evicted_line->data = (byte_t *) calloc(B, sizeof(byte_t));
-    /* your implementation */
-    
-    // we know its a miss; make it dependent on operation
+
     cache_line_t * selectedLine = (cache_line_t *) select_line(cache, addr);
-    if(selectedLine -> valid && selectedLine -> dirty) {
-        dirty_eviction_count++;
-    } else if(selectedLine -> valid && !(selectedLine -> dirty)) {
-        clean_eviction_count++;
-    }
+    journal_line(selectedLine, 0, incoming_data != NULL ? B : 0);
 
-    //Tis bad
-    //Tis good
-    //Tis really good
-    //TIS REALLY BAD
-    
     //selectedLine -> data = incoming_data;
     if(selectedLine -> data != NULL) {
         memcpy(evicted_line -> data, selectedLine -> data, B);
@@ -264,6 +367,30 @@ evicted_line_t *handle_miss(cache_t *cache, uword_t addr, operation_t operation,
     return evicted_line;
 }
 
+/* TODO:
+ * Handles Misses, evicting from the cache if necessary.
+ * Fill out the evicted_line_t struct with info regarding the evicted line.
+ */
+evicted_line_t *handle_miss(cache_t *cache, uword_t addr, operation_t operation, byte_t *incoming_data)
+{
+    /* your implementation */
+    
+    // we know its a miss; make it dependent on operation
+    evicted_line_t *evicted_line = install_line(cache, addr, operation, incoming_data);
+    if(evicted_line -> valid && evicted_line -> dirty) {
+        dirty_eviction_count++;
+    } else if(evicted_line -> valid && !(evicted_line -> dirty)) {
+        clean_eviction_count++;
+    }
+
+    //Tis bad
+    //Tis good
+    //Tis really good
+    //TIS REALLY BAD
+
+    return evicted_line;
+}
+
 /* TODO:
  * Get a byte from the cache and write it to dest.
  * Preconditon: pos is contained within the cache.
@@ -309,6 +436,7 @@ void set_byte_cache(cache_t *cache, uword_t addr, byte_t val)
     //XXX: NO CHANGE WITH OR WITHOUT????
     size_t offset = addr & ((uword_t)pow(2, cache -> b) - 1);
     cache_line_t * gottenLine = get_line(cache, addr);
+    journal_line(gottenLine, offset, 1);
     memcpy(&(gottenLine -> data[offset]), &val, 1);
 }
 
@@ -334,6 +462,15 @@ void set_word_cache(cache_t *cache, uword_t addr, word_t val)
     }
 }
 
+/*
+ * Mark a line found with get_line() dirty without counting a hit
+ */
+void mark_dirty(cache_line_t *line)
+{
+    journal_line(line, 0, 0);
+    line->dirty = true;
+}
+
 /*
  * Access data at memory address addr
  * If it is already in cache, increast hit_count
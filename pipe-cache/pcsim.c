@@ -12,6 +12,9 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 #include "isa.h"
 #include "cache.h"
@@ -20,6 +23,131 @@
 #include "sim.h"
 
 cache_t* cache;
+cache_t* icache = NULL;     /* L1 instruction cache, only modeled with -I */
+
+/* Fill a line without touching the data cache counters (cache.c) */
+evicted_line_t *install_line(cache_t *cache, uword_t addr, operation_t operation, byte_t *incoming_data);
+void mark_dirty(cache_line_t *line);
+
+/* Undo journal for cache changes, used by the interactive restore points (cache.c) */
+typedef struct cache_journal cache_journal_t;
+cache_journal_t *cache_journal_start();
+void cache_journal_stop();
+void cache_journal_undo(cache_journal_t *j);
+void cache_journal_free(cache_journal_t *j);
+void restore_checkpoint(cache_t *cache, cache_t *checkpoint);
+extern uword_t globalLru;
+
+/*
+ * Miss status holding registers. Each entry tracks one block being filled
+ * from memory, plus the loads that are waiting on it. Loads that miss do not
+ * stall the pipeline: their destination register is marked pending and is
+ * written when the fill completes.
+ */
+#define MSHR_TARGETS 8
+
+typedef struct {
+    reg_id_t dest;          /* register owed the loaded value, REG_NONE once delivered */
+    word_t val;             /* value read at the time of the load */
+    word_t addr;            /* address of the loaded word */
+} mshr_target_t;
+
+typedef struct {
+    bool valid;
+    word_t block_addr;      /* address of the first byte in the block */
+    word_t cycles_left;     /* cycles until the block arrives */
+    bool queued;            /* waiting for a DRAM bank, cycles_left unknown */
+    word_t critical;        /* word index of the access that missed first */
+    operation_t operation;  /* WRITE if any merged access was a store */
+    int target_count;
+    mshr_target_t targets[MSHR_TARGETS];
+} mshr_t;
+
+/*
+ * How a block streams in from memory (-c). FILL_FULL makes the whole block
+ * usable when the last word arrives. With FILL_EARLY the words arrive in
+ * address order and each is usable as soon as it lands; FILL_CWF also starts
+ * with the word that missed and wraps around. Words arrive fill_beat cycles
+ * apart and the last one still lands after the full miss latency.
+ */
+typedef enum { FILL_FULL, FILL_EARLY, FILL_CWF } fill_mode_t;
+fill_mode_t fill_mode = FILL_FULL;
+int fill_beat = 1;
+
+int mshr_count = 4;         /* Number of MSHRs (-m) */
+mshr_t *mshrs;
+bool reg_pending[REG_NONE]; /* registers waiting on an MSHR fill */
+bool dmem_retry = false;    /* memory stage is replaying a stalled access */
+bool dmem_looked_up;        /* the access reached the cache this cycle */
+
+/*
+ * Store buffer between the memory stage and the data cache. Stores update
+ * mem when they leave the memory stage and drain into the cache one per
+ * cycle in the background.
+ */
+typedef struct {
+    word_t addr;
+    word_t val;
+    bool issued;            /* the cache has already seen this store */
+} store_entry_t;
+
+int sb_size = 4;            /* Number of store buffer entries (-w) */
+store_entry_t *store_buf;
+int sb_head = 0;
+int sb_used = 0;
+
+/*
+ * DRAM model behind the MSHRs (-D). Rows are interleaved across banks and
+ * each bank keeps its last row open. Requests wait in a queue that is
+ * scheduled first-ready, first-come-first-served: an idle bank serves the
+ * oldest request hitting its open row, else its oldest request. Without -D
+ * every miss takes the flat -d penalty.
+ */
+#define DRAM_ROW_BITS 10        /* 1 KiB rows */
+#define DRAM_HIST_BUCKETS 12    /* latency buckets 0-1, 2-3, 4-7, ... */
+
+typedef struct {
+    bool row_open;
+    word_t open_row;
+    word_t busy_cycles;     /* cycles until the bank can take a new request */
+} dram_bank_t;
+
+typedef struct {
+    int mshr;               /* index of the MSHR waiting on this request */
+    word_t waited;          /* cycles spent in the queue so far */
+} dram_req_t;
+
+int dram_banks = 0;         /* 0 selects the flat -d latency */
+int dram_tRCD = 0, dram_tCL = 0, dram_tRP = 0;
+dram_bank_t *banks;
+dram_req_t *dram_queue;     /* in arrival order, at most one per MSHR */
+int dram_queued = 0;
+
+/* The single outstanding instruction cache miss */
+bool imiss_valid = false;
+word_t imiss_block = 0;
+word_t imiss_cycles_left = 0;
+/* Blocks of an instruction already seen present, so that an instruction
+   straddling two conflicting blocks cannot evict itself forever */
+word_t ifetch_pc = -1;
+word_t ifetch_checked = 0;
+
+/* MSHR, store buffer and instruction cache statistics */
+word_t mshr_primary = 0;
+word_t mshr_merged = 0;
+word_t mshr_full_stalls = 0;  /* cycles a miss waited for a free MSHR */
+word_t early_words = 0;       /* loads served before their block was complete */
+word_t sb_stores = 0;
+word_t sb_forwards = 0;
+word_t sb_full_stalls = 0;    /* cycles a store waited for a free entry */
+word_t icache_hits = 0;
+word_t icache_misses = 0;
+word_t icache_evictions = 0;
+word_t icache_stalls = 0;     /* cycles fetch inserted a bubble for a miss */
+word_t dram_row_hits = 0;
+word_t dram_row_misses = 0;   /* bank had no open row */
+word_t dram_row_conflicts = 0;
+word_t dram_latency_hist[DRAM_HIST_BUCKETS];
 
 /***************
  * Begin Globals
@@ -32,10 +160,47 @@ char *object_filename;   /* The input object file name. */
 FILE *object_file;       /* Input file handle */
 int verbosity = 2;    /* Verbosity level [TTY only] (-v) */
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
+bool result_resim = false; /* Simulate even if the result cache has the run [TTY only] (-R) */
+static char result_flags[1024]; /* The options, part of the result cache key */
+word_t snapshot_interval = 1000; /* Cycles between snapshots [Interactive only] (-k) */
+size_t history_budget = 64 << 20; /* Bytes of snapshots kept [Interactive only] (-K, in MB) */
 
 /* Log file */
 FILE *dumpfile = NULL;
 
+/*
+ * Trace points. TRACE_LEVEL decides at compile time which ones exist:
+ * 0 none, 1 the per-cycle pipeline state, 2 also stage and memory system
+ * events, 3 also fetch, forwarding and stall decisions. trace_mask picks
+ * categories at run time. Arguments are only evaluated for enabled trace
+ * points with a dumpfile, so -v 0 never formats anything.
+ */
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 2
+#endif
+
+#define TRACE_STATE     0x01
+#define TRACE_FETCH     0x02
+#define TRACE_DECODE    0x04
+#define TRACE_EXECUTE   0x08
+#define TRACE_MEMORY    0x10
+#define TRACE_WRITEBACK 0x20
+#define TRACE_CONTROL   0x40
+#define TRACE_CACHE     0x80    /* MSHRs, store buffer and DRAM */
+#define TRACE_ALL       0xff
+
+static const char *trace_names[] = {
+    "state", "fetch", "decode", "execute", "memory", "writeback", "control", "cache"
+};
+
+int trace_mask = TRACE_ALL; /* Trace categories logged (-T) */
+
+#define TRACE(level, category, ...) \
+    do { \
+        if (TRACE_LEVEL >= (level) && (trace_mask & (category)) && dumpfile) \
+            sim_log(__VA_ARGS__); \
+    } while (0)
+
 /* Performance monitoring */
 /* How many cycles have been simulated? */
 word_t cycles = 0;
@@ -99,8 +264,14 @@ pipe_ptr fetch_state, decode_state, execute_state, memory_state, writeback_state
  ***************************/
 
 word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
+static void frozen_begin();              /* Frozen pipeline fast path */
+static word_t frozen_end(word_t limit);
 static void usage(char *name);           /* Print helpful usage message */
-static void run_tty_sim();               /* Run simulator in TTY mode */
+static bool run_tty_sim();               /* Run simulator in TTY mode */
+static bool simulate_tty();              /* run_tty_sim() without the result cache */
+static int parse_trace_mask(char *list); /* Trace categories named in list */
+static void predecode_flush();           /* Forget all predecoded instructions */
+static void predecode_write(word_t pos, int len); /* Forget those a write overlaps */
 static void sim_interactive();
 
 /*************************
@@ -129,17 +300,21 @@ int sim_main(int argc, char **argv)
     int E = -1;
     int b = -1;
     int d = -1;
+    int is = -1, iE = -1, ib = -1, id = -1;
 
     // TODO: Add support for new command line flags.
 
     /* your implementation */
 
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "htl:v:b:s:E:d:i")) != -1) {
+    while ((c = getopt(argc, argv, "htl:v:b:s:E:d:m:w:c:I:D:k:K:T:iR")) != -1) {
         switch(c) {
         case 'h':
             usage(argv[0]);
             break;
+        case 'R':
+            result_resim = true;
+            break;
         case 'l':
             instr_limit = atoll(optarg);
             break;
@@ -162,9 +337,77 @@ int sim_main(int argc, char **argv)
         case 'd':
             d = atoi(optarg);
             break;
+        case 'm':
+            mshr_count = atoi(optarg);
+            if (mshr_count < 1) {
+                printf("Invalid MSHR count %d\n", mshr_count);
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            sb_size = atoi(optarg);
+            if (sb_size < 1) {
+                printf("Invalid store buffer size %d\n", sb_size);
+                usage(argv[0]);
+            }
+            break;
+        case 'c': {
+            char mode[8];
+            int n = sscanf(optarg, "%7[a-z],%d", mode, &fill_beat);
+            if (n >= 1 && !strcmp(mode, "full"))
+                fill_mode = FILL_FULL;
+            else if (n >= 1 && !strcmp(mode, "early"))
+                fill_mode = FILL_EARLY;
+            else if (n >= 1 && !strcmp(mode, "cwf"))
+                fill_mode = FILL_CWF;
+            else
+                n = 0;
+            if (n == 0 || fill_beat < 1) {
+                printf("Invalid fill mode '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        }
+        case 'I':
+            if (sscanf(optarg, "%d,%d,%d,%d", &is, &iE, &ib, &id) != 4
+                    || is < 0 || iE < 1 || ib < 0 || id < 0) {
+                printf("Invalid I-cache geometry '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'D':
+            if (sscanf(optarg, "%d,%d,%d,%d", &dram_banks, &dram_tRCD, &dram_tCL, &dram_tRP) != 4
+                    || dram_banks < 1 || dram_tRCD < 0 || dram_tCL < 1 || dram_tRP < 0) {
+                printf("Invalid DRAM timing '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
         case 'i':
 	        interactive = true;
 	        break;
+        case 'T':
+            trace_mask = parse_trace_mask(optarg);
+            if (trace_mask < 0) {
+                printf("Invalid trace categories '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            snapshot_interval = atoll(optarg);
+            if (snapshot_interval < 1) {
+                printf("Invalid snapshot interval %lld\n", snapshot_interval);
+                usage(argv[0]);
+            }
+            break;
+        case 'K': {
+            word_t mb = atoll(optarg);
+            if (mb < 1) {
+                printf("Invalid snapshot budget %lld MB\n", mb);
+                usage(argv[0]);
+            }
+            history_budget = (size_t) mb << 20;
+            break;
+        }
         default:
             printf("Invalid option '%c'\n", c);
             usage(argv[0]);
@@ -172,6 +415,14 @@ int sim_main(int argc, char **argv)
         }
     }
 
+    /* Every option but -R is part of the result cache key */
+    for (i = 1; i < optind; i++) {
+        if (strcmp(argv[i], "-R")) {
+            strncat(result_flags, argv[i], sizeof(result_flags) - strlen(result_flags) - 1);
+            strncat(result_flags, " ", sizeof(result_flags) - strlen(result_flags) - 1);
+        }
+    }
+
     /* Do we have too many arguments? */
     if (optind < argc - 1) {
         printf("Too many command line arguments:");
@@ -204,11 +455,17 @@ int sim_main(int argc, char **argv)
 	}
 
     cache = create_cache(s, b, E, d);
+    if (is != -1)
+        icache = create_cache(is, ib, iE, id);
+    mshrs = calloc(mshr_count, sizeof(mshr_t));
+    store_buf = calloc(sb_size, sizeof(store_entry_t));
+    banks = calloc(dram_banks, sizeof(dram_bank_t));
+    dram_queue = calloc(mshr_count, sizeof(dram_req_t));
 
     if (interactive) {
         sim_interactive();
-    } else {
-        run_tty_sim();
+    } else if (!run_tty_sim()) {
+        exit(1);
     }
     exit(0);
 }
@@ -216,9 +473,149 @@ int sim_main(int argc, char **argv)
 int main(int argc, char *argv[]){return sim_main(argc,argv);}
 
 /*
- * run_tty_sim - Run the simulator in TTY mode
+ * Result cache. A TTY run below -v 2 is keyed by an FNV-1a hash of the
+ * simulator build, its options and the object file contents. Its output
+ * and ISA check result are stored under that key in $Y86_RESULT_CACHE
+ * (default ~/.cache/y86sim) and replayed when the same run comes again.
+ * The build is the executable as a whole, so relinking against a changed
+ * ISA model is a new build as well; -DBUILD_ID=\"...\" names it instead.
  */
-static void run_tty_sim()
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * FNV_PRIME;
+    return h;
+}
+
+/* Hash the build into h. Returns false if it can't be identified */
+static bool result_build(uint64_t *h)
+{
+#ifdef BUILD_ID
+    *h = fnv1a(*h, BUILD_ID, sizeof(BUILD_ID));
+    return true;
+#else
+    char buf[1 << 16];
+    size_t n;
+    FILE *exe = fopen("/proc/self/exe", "rb");
+
+    if (!exe)
+        return false;
+    while ((n = fread(buf, 1, sizeof(buf), exe)) > 0)
+        *h = fnv1a(*h, buf, n);
+    fclose(exe);
+    return true;
+#endif
+}
+
+/* Name the cache file of this run in path. Returns false if the run can't be cached */
+static bool result_path(char *path, size_t size)
+{
+    char dir[4096];
+    char buf[1 << 16];
+    size_t n;
+    uint64_t h = FNV_OFFSET;
+
+    if (getenv("Y86_RESULT_CACHE")) {
+        snprintf(dir, sizeof(dir), "%s", getenv("Y86_RESULT_CACHE"));
+    } else if (getenv("HOME")) {
+        snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME"));
+        mkdir(dir, 0755);
+        strncat(dir, "/y86sim", sizeof(dir) - strlen(dir) - 1);
+    } else {
+        return false;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return false;
+
+    h = fnv1a(h, simname, sizeof(simname));
+    if (!result_build(&h))
+        return false;
+    h = fnv1a(h, result_flags, strlen(result_flags) + 1);
+    while ((n = fread(buf, 1, sizeof(buf), object_file)) > 0)
+        h = fnv1a(h, buf, n);
+    rewind(object_file);
+    snprintf(path, size, "%s/%016llx", dir, (unsigned long long) h);
+    return true;
+}
+
+/* Print the stored output of a run. Returns false if there is none */
+static bool result_replay(const char *path, bool *match)
+{
+    char buf[1 << 16];
+    size_t n;
+    FILE *f = fopen(path, "rb");
+    int c;
+
+    if (!f)
+        return false;
+    c = fgetc(f);
+    if (c != '0' && c != '1') {
+        fclose(f);
+        return false;
+    }
+    *match = c == '1';
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        fwrite(buf, 1, n, stdout);
+    fclose(f);
+    fclose(object_file);
+    return true;
+}
+
+/*
+ * run_tty_sim - Run the simulator in TTY mode, or replay the result of
+ * an identical earlier run
+ */
+static bool run_tty_sim()
+{
+    char path[4200], tmp_path[4300];
+    char buf[1 << 16];
+    size_t n;
+    bool match;
+    FILE *out, *f;
+    int saved;
+
+    if (verbosity >= 2 || !result_path(path, sizeof(path)))
+        return simulate_tty();
+    if (!result_resim && result_replay(path, &match))
+        return match;
+
+    /* Capture what the simulation prints */
+    if ((out = tmpfile()) == NULL)
+        return simulate_tty();
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(fileno(out), STDOUT_FILENO);
+    match = simulate_tty();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+    f = fopen(tmp_path, "wb");
+    if (f)
+        fputc(match ? '1' : '0', f);
+    rewind(out);
+    while ((n = fread(buf, 1, sizeof(buf), out)) > 0) {
+        fwrite(buf, 1, n, stdout);
+        if (f)
+            fwrite(buf, 1, n, f);
+    }
+    if (f && fclose(f) == 0)
+        rename(tmp_path, path);
+    else
+        unlink(tmp_path);
+    fclose(out);
+    return match;
+}
+
+/*
+ * simulate_tty - Simulate the program in TTY mode
+ */
+static bool simulate_tty()
 {
     word_t icount = 0;
     byte_t run_status = STAT_AOK;
@@ -268,7 +665,7 @@ static void run_tty_sim()
     word_t step;
     bool match = true;
     for (step = 0; step < instr_limit && e == STAT_AOK; step++) {
-        e = step_state(isa_state, stdout);
+        e = step_state(isa_state, verbosity > 0 ? stdout : NULL);
     }
 
     if (diff_reg(isa_state->r, reg, NULL)) {
@@ -292,6 +689,10 @@ static void run_tty_sim()
             cc_name(isa_state->cc), cc_name(result_cc));
         }
     }
+    /* With -v 0 the exit status is the only report */
+    if (verbosity == 0)
+        return match;
+
     if (match) {
         printf("ISA Check Succeeds\n");
     } else {
@@ -302,7 +703,32 @@ static void run_tty_sim()
 	double cpi = instructions > 0 ? (double) cycles/instructions : 1.0;
 	printf("CPI: %lld cycles/%lld instructions = %.2f\n",
 	       cycles, instructions, cpi);
-
+	printf("D-cache: %d hits, %d misses, %d dirty evictions, %d clean evictions\n",
+	       hit_count, miss_count, dirty_eviction_count, clean_eviction_count);
+	if (icache != NULL) {
+	    printf("I-cache: %lld hits, %lld misses, %lld evictions, %lld fetch stall cycles\n",
+	           icache_hits, icache_misses, icache_evictions, icache_stalls);
+	}
+	printf("MSHR: %lld primary misses, %lld merged misses, %lld full stall cycles\n",
+	       mshr_primary, mshr_merged, mshr_full_stalls);
+	if (fill_mode != FILL_FULL)
+	    printf("Early restart: %lld loads served before their block was complete\n", early_words);
+	if (dram_banks > 0) {
+	    printf("DRAM: %lld row hits, %lld row misses, %lld row conflicts\n",
+	           dram_row_hits, dram_row_misses, dram_row_conflicts);
+	    printf("DRAM latency histogram:\n");
+	    for (int i = 0; i < DRAM_HIST_BUCKETS; i++) {
+	        if (dram_latency_hist[i] == 0)
+	            continue;
+	        if (i == DRAM_HIST_BUCKETS - 1)
+	            printf("  %5d+      cycles: %lld\n", 1 << i, dram_latency_hist[i]);
+	        else
+	            printf("  %5d-%-5d cycles: %lld\n", i == 0 ? 0 : 1 << i, (2 << i) - 1, dram_latency_hist[i]);
+	    }
+	}
+	printf("Store buffer: %lld stores, %lld forwarded loads, %lld full stall cycles\n",
+	       sb_stores, sb_forwards, sb_full_stalls);
+    return match;
 }
 
 /*
@@ -313,16 +739,519 @@ static void usage(char *name)
     printf("Usage: %s [-hi] [-l m] [-v n] file.yo\n", name);
     printf("   -h     Print this message\n");
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
-    printf("   -v n   Set verbosity level to 0 <= n <= 2 [TTY mode only] (default %d)\n", verbosity);
+    printf("   -v n   Set verbosity level to 0 <= n <= 2, 0 reports only through the exit status [TTY mode only] (default %d)\n", verbosity);
+    printf("   -R     Simulate even if the result cache has this run [TTY mode only]\n");
+    printf("   -m n   Set number of data cache MSHRs to n (default %d)\n", mshr_count);
+    printf("   -w n   Set number of store buffer entries to n (default %d)\n", sb_size);
+    printf("   -k n   Snapshot every n cycles for going back [Interactive only] (default %lld)\n", snapshot_interval);
+    printf("   -K n   Keep at most n MB of snapshots [Interactive only] (default %d)\n", (int) (history_budget >> 20));
+    printf("   -c m[,n]  Fill blocks with mode m (full, early, cwf), n cycles per word\n");
+    printf("   -D n,tRCD,tCL,tRP  Serve data cache misses from a DRAM with n banks\n");
+    printf("          and the given timings in cycles (default: flat -d latency)\n");
+    printf("   -I s,E,b,d  Model an instruction cache with 2^s sets, E lines, 2^b byte\n");
+    printf("          blocks and a d cycle miss latency (default: ideal fetch)\n");
+    printf("   -T c,c Trace only categories c: state, fetch, decode, execute, memory,\n");
+    printf("          writeback, control, cache (default all)\n");
     printf("   -i     Runs the simulator in interactive mode\n");
     exit(0);
 }
 
+/*
+ * parse_trace_mask - Turn a comma separated list of trace category names,
+ * or "all", into a trace_mask. Returns -1 on an unknown name.
+ */
+static int parse_trace_mask(char *list)
+{
+    int n = sizeof(trace_names) / sizeof(trace_names[0]);
+    int mask = 0;
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int i;
+        if (!strcmp(name, "all")) {
+            mask |= TRACE_ALL;
+            continue;
+        }
+        for (i = 0; i < n && strcmp(name, trace_names[i]); i++)
+            ;
+        if (i == n)
+            return -1;
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
 
 /*********************************************************
  * Part 2: This part contains the core simulator routines.
  *********************************************************/
 
+/*****************************************************************************
+ * Non-blocking data cache
+ * Accesses are checked against the cache and the MSHRs. Memory contents
+ * always come from mem, so a value read under a miss is already correct;
+ * the MSHRs only decide when that value becomes visible to the pipeline.
+ *****************************************************************************/
+
+/* Return the MSHR filling the block at block_addr, or NULL if there is none */
+static mshr_t *mshr_find(word_t block_addr)
+{
+    for (int i = 0; i < mshr_count; i++) {
+        if (mshrs[i].valid && mshrs[i].block_addr == block_addr)
+            return &mshrs[i];
+    }
+    return NULL;
+}
+
+/* Queue the miss tracked by MSHR i at the memory controller */
+static void dram_enqueue(int i)
+{
+    mshrs[i].queued = true;
+    dram_queue[dram_queued].mshr = i;
+    dram_queue[dram_queued].waited = 0;
+    dram_queued++;
+}
+
+static void dram_record_latency(word_t latency)
+{
+    int bucket = 0;
+    while (bucket < DRAM_HIST_BUCKETS - 1 && (2 << bucket) <= latency)
+        bucket++;
+    dram_latency_hist[bucket]++;
+}
+
+/*
+ * dram_tick - Advance the DRAM by one cycle. Every idle bank picks its next
+ * request FR-FCFS and the MSHR learns how long the access will take.
+ */
+static void dram_tick()
+{
+    for (int b = 0; b < dram_banks; b++) {
+        if (banks[b].busy_cycles > 0)
+            banks[b].busy_cycles--;
+    }
+    for (int q = 0; q < dram_queued; q++)
+        dram_queue[q].waited++;
+
+    for (int b = 0; b < dram_banks; b++) {
+        dram_bank_t *bank = &banks[b];
+        if (bank->busy_cycles > 0)
+            continue;
+
+        /* Oldest row hit first, otherwise the oldest request for this bank */
+        int pick = -1;
+        word_t row = 0;
+        for (int q = 0; q < dram_queued; q++) {
+            word_t row_id = mshrs[dram_queue[q].mshr].block_addr >> DRAM_ROW_BITS;
+            if (row_id % dram_banks != b)
+                continue;
+            if (bank->row_open && row_id / dram_banks == bank->open_row) {
+                pick = q;
+                row = bank->open_row;
+                break;
+            }
+            if (pick == -1) {
+                pick = q;
+                row = row_id / dram_banks;
+            }
+        }
+        if (pick == -1)
+            continue;
+
+        word_t latency = dram_tCL;
+        if (!bank->row_open) {
+            latency += dram_tRCD;
+            dram_row_misses++;
+        } else if (bank->open_row != row) {
+            latency += dram_tRP + dram_tRCD;
+            dram_row_conflicts++;
+        } else {
+            dram_row_hits++;
+        }
+        bank->row_open = true;
+        bank->open_row = row;
+        bank->busy_cycles = latency;
+
+        mshr_t *m = &mshrs[dram_queue[pick].mshr];
+        m->queued = false;
+        m->cycles_left = latency;
+        dram_record_latency(dram_queue[pick].waited + latency);
+        TRACE(2, TRACE_CACHE, "\tDRAM: Bank %d serving 0x%llx in %lld cycles\n", b, m->block_addr, latency);
+
+        memmove(&dram_queue[pick], &dram_queue[pick + 1],
+                (dram_queued - pick - 1) * sizeof(dram_req_t));
+        dram_queued--;
+    }
+}
+
+/* Claim a free MSHR for block_addr, or return NULL if they are all busy */
+static mshr_t *mshr_alloc(word_t block_addr, operation_t operation)
+{
+    for (int i = 0; i < mshr_count; i++) {
+        if (!mshrs[i].valid) {
+            mshrs[i].valid = true;
+            mshrs[i].block_addr = block_addr;
+            mshrs[i].cycles_left = cache->d;
+            mshrs[i].queued = false;
+            if (dram_banks > 0)
+                dram_enqueue(i);
+            mshrs[i].operation = operation;
+            mshrs[i].target_count = 0;
+            mshr_primary++;
+            return &mshrs[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * mshr_word_ready - Have all the bytes of the word at pos that live in the
+ * block tracked by m arrived yet? Always false in FILL_FULL mode.
+ */
+static bool mshr_word_ready(mshr_t *m, word_t pos)
+{
+    word_t B = (word_t) 1 << cache->b;
+    word_t words = (B + 7) / 8;
+    word_t first = pos > m->block_addr ? (pos - m->block_addr) / 8 : 0;
+    word_t last = pos + 7 < m->block_addr + B ? (pos + 7 - m->block_addr) / 8 : words - 1;
+
+    if (fill_mode == FILL_FULL || m->queued)
+        return false;
+    for (word_t w = first; w <= last; w++) {
+        word_t order = fill_mode == FILL_CWF ? (w + words - m->critical) % words : w;
+        if (m->cycles_left > (words - 1 - order) * fill_beat)
+            return false;
+    }
+    return true;
+}
+
+/* Hand the values of the words that have arrived to their registers */
+static void mshr_deliver(mshr_t *m, bool all)
+{
+    for (int i = 0; i < m->target_count; i++) {
+        reg_id_t dest = m->targets[i].dest;
+        if (dest == REG_NONE || !(all || mshr_word_ready(m, m->targets[i].addr)))
+            continue;
+        TRACE(2, TRACE_CACHE, "\tMSHR: %s 0x%llx, wrote 0x%llx to register %s\n",
+            all ? "Filled" : "Streaming", m->block_addr, m->targets[i].val, reg_name(dest));
+        set_reg_val(reg, dest, m->targets[i].val);
+        reg_pending[dest] = false;
+        m->targets[i].dest = REG_NONE;
+        if (!all)
+            early_words++;
+    }
+}
+
+/* Install the block in the cache and hand the loaded values to their registers */
+static void mshr_fill(mshr_t *m)
+{
+    size_t B = (size_t) 1 << cache->b;
+    byte_t *data = calloc(B, sizeof(byte_t));
+    for (size_t i = 0; i < B; i++)
+        get_byte_val(mem, m->block_addr + i, &data[i]);
+
+    evicted_line_t *evicted = handle_miss(cache, m->block_addr, m->operation, data);
+    free(evicted->data);
+    free(evicted);
+    free(data);
+
+    mshr_deliver(m, true);
+    m->valid = false;
+}
+
+/* Advance every outstanding miss by one cycle, completing those that are due */
+static void mshr_tick()
+{
+    for (int i = 0; i < mshr_count; i++) {
+        if (!mshrs[i].valid || mshrs[i].queued)
+            continue;
+        if (--mshrs[i].cycles_left <= 0)
+            mshr_fill(&mshrs[i]);
+        else if (fill_mode != FILL_FULL)
+            mshr_deliver(&mshrs[i], false);
+    }
+}
+
+static bool mshr_busy()
+{
+    for (int i = 0; i < mshr_count; i++) {
+        if (mshrs[i].valid)
+            return true;
+    }
+    return false;
+}
+
+static bool reg_is_pending(reg_id_t r)
+{
+    return r < REG_NONE && reg_pending[r];
+}
+
+/*
+ * dcache_lookup - Check every block touched by the word at pos.
+ * Returns READY when all of them are resident. Returns IN_FLIGHT when one
+ * is still being filled; *pending is then the MSHR that completes last, or
+ * NULL if a miss could not get an MSHR and the access has to be retried.
+ * Hits and misses are only counted the first time an access is seen, so a
+ * replayed access passes retry.
+ */
+static mem_status_t dcache_lookup(word_t pos, operation_t operation, bool retry, mshr_t **pending)
+{
+    word_t B = (word_t) 1 << cache->b;
+    word_t first = pos & ~(B - 1);
+    word_t last = (pos + 7) & ~(B - 1);
+    mem_status_t result = READY;
+    bool streamed = false;
+    word_t tmp;
+
+    *pending = NULL;
+    if (!get_word_val(mem, pos, &tmp))
+        return ERROR;
+
+    for (word_t block = first; block <= last; block += B) {
+        mshr_t *m = mshr_find(block);
+        if (m == NULL) {
+            bool hit;
+            if (retry) {
+                cache_line_t *line = get_line(cache, block);
+                hit = line != NULL;
+                if (hit && operation == WRITE)
+                    mark_dirty(line);
+            } else {
+                hit = check_hit(cache, block, operation);
+            }
+            if (hit)
+                continue;
+            m = mshr_alloc(block, operation);
+            if (m == NULL) {
+                *pending = NULL;
+                return IN_FLIGHT;
+            }
+            m->critical = pos > block ? (pos - block) / 8 : 0;
+            if (!m->queued && m->cycles_left <= 0) {
+                mshr_fill(m);
+                continue;
+            }
+        } else {
+            if (!retry) {
+                miss_count++;
+                mshr_merged++;
+            }
+            if (operation == WRITE)
+                m->operation = WRITE;
+        }
+        /* Reads can use the word as soon as it has streamed in */
+        if (operation == READ && mshr_word_ready(m, pos)) {
+            streamed = true;
+            continue;
+        }
+        if (*pending == NULL || m->queued
+                || (!(*pending)->queued && m->cycles_left > (*pending)->cycles_left))
+            *pending = m;
+        result = IN_FLIGHT;
+    }
+    if (streamed && result == READY)
+        early_words++;
+    return result;
+}
+
+/*
+ * sb_match - Compare a load of the word at pos against the buffered stores.
+ * Returns 1 if the youngest overlapping store writes exactly that word (the
+ * load can be forwarded), -1 if it only partly overlaps (the load has to
+ * wait for it to drain), and 0 if no buffered store overlaps.
+ */
+static int sb_match(word_t pos)
+{
+    for (int i = sb_used - 1; i >= 0; i--) {
+        store_entry_t *e = &store_buf[(sb_head + i) % sb_size];
+        if (e->addr == pos)
+            return 1;
+        if (e->addr < pos + 8 && pos < e->addr + 8)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * sb_push - Retire a store into the store buffer. mem is updated right away
+ * so later loads see the value; the cache sees it when the entry drains.
+ * Returns IN_FLIGHT if the buffer is full.
+ */
+static mem_status_t sb_push(word_t pos, word_t val)
+{
+    word_t tmp;
+    if (!get_word_val(mem, pos, &tmp))
+        return ERROR;
+    if (sb_used == sb_size) {
+        sb_full_stalls++;
+        return IN_FLIGHT;
+    }
+    store_entry_t *e = &store_buf[(sb_head + sb_used) % sb_size];
+    e->addr = pos;
+    e->val = val;
+    e->issued = false;
+    sb_used++;
+    sb_stores++;
+    set_word_val(mem, pos, val);
+    predecode_write(pos, 8);
+    return READY;
+}
+
+/* sb_drain - Write the oldest buffered store into the cache once its blocks are present */
+static void sb_drain()
+{
+    if (sb_used == 0)
+        return;
+    store_entry_t *e = &store_buf[sb_head];
+    mshr_t *pending;
+    mem_status_t result = dcache_lookup(e->addr, WRITE, e->issued, &pending);
+    e->issued = true;
+    if (result == IN_FLIGHT)
+        return;
+    if (result == READY) {
+        set_word_cache(cache, e->addr, e->val);
+        TRACE(2, TRACE_CACHE, "\tStore buffer: Drained 0x%llx to address 0x%llx\n", e->val, e->addr);
+    }
+    sb_head = (sb_head + 1) % sb_size;
+    sb_used--;
+}
+
+/*
+ * dcache_load - Non-blocking load for instructions that only deliver the
+ * value to a register. On a miss the value is parked in the MSHR and dest
+ * becomes pending; the load itself moves on. Returns IN_FLIGHT only when
+ * there is no MSHR (or target slot) to hold the miss, or when the load has
+ * to wait for a partly overlapping buffered store.
+ */
+static mem_status_t dcache_load(word_t pos, reg_id_t dest, word_t *valm, bool *deferred)
+{
+    mshr_t *pending;
+    mem_status_t result;
+
+    *deferred = false;
+    switch (sb_match(pos)) {
+    case 1:
+        sb_forwards++;
+        get_word_val(mem, pos, valm);
+        return READY;
+    case -1:
+        return IN_FLIGHT;
+    }
+
+    dmem_looked_up = true;
+    result = dcache_lookup(pos, READ, dmem_retry, &pending);
+    if (result == ERROR)
+        return ERROR;
+    get_word_val(mem, pos, valm);
+    if (result == READY)
+        return READY;
+    if (pending == NULL || pending->target_count == MSHR_TARGETS) {
+        mshr_full_stalls++;
+        return IN_FLIGHT;
+    }
+
+    /* The instruction in execute overwrites dest anyway; nothing to deliver */
+    bool cmov_moves = execute_output->icode != I_RRMOVQ || cond_holds(cc, execute_output->ifun);
+    if (dest == REG_NONE || execute_output->destm == dest
+            || (execute_output->deste == dest && cmov_moves))
+        return READY;
+
+    pending->targets[pending->target_count].dest = dest;
+    pending->targets[pending->target_count].val = *valm;
+    pending->targets[pending->target_count].addr = pos;
+    pending->target_count++;
+    reg_pending[dest] = true;
+    *deferred = true;
+    return READY;
+}
+
+/* dcache_read - Blocking read: IN_FLIGHT until every block is resident */
+static mem_status_t dcache_read(word_t pos, word_t *valm)
+{
+    mshr_t *pending;
+    mem_status_t result;
+
+    switch (sb_match(pos)) {
+    case 1:
+        sb_forwards++;
+        get_word_val(mem, pos, valm);
+        return READY;
+    case -1:
+        return IN_FLIGHT;
+    }
+
+    dmem_looked_up = true;
+    result = dcache_lookup(pos, READ, dmem_retry, &pending);
+    if (result == READY)
+        get_word_val(mem, pos, valm);
+    else if (result == IN_FLIGHT && pending == NULL)
+        mshr_full_stalls++;
+    return result;
+}
+
+/*****************************************************************************
+ * Instruction cache
+ * Fetch checks that every block holding the instruction's bytes is in the
+ * I-cache. A miss fills one block at a time; until it arrives fetch hands
+ * decode a bubble and retries the same PC.
+ *****************************************************************************/
+
+static void icache_fill()
+{
+    size_t B = (size_t) 1 << icache->b;
+    byte_t *data = calloc(B, sizeof(byte_t));
+    for (size_t i = 0; i < B; i++)
+        get_byte_val(mem, imiss_block + i, &data[i]);
+
+    evicted_line_t *evicted = install_line(icache, imiss_block, READ, data);
+    if (evicted->valid)
+        icache_evictions++;
+    free(evicted->data);
+    free(evicted);
+    free(data);
+    imiss_valid = false;
+}
+
+static void icache_tick()
+{
+    if (imiss_valid && --imiss_cycles_left <= 0)
+        icache_fill();
+}
+
+/*
+ * icache_fetch - Return true if the len instruction bytes at pc are all in
+ * the I-cache. Otherwise start a fill for the first missing block (once the
+ * previous fill is done) and return false.
+ */
+static bool icache_fetch(word_t pc, word_t len)
+{
+    if (icache == NULL)
+        return true;
+
+    word_t B = (word_t) 1 << icache->b;
+    if (pc != ifetch_pc) {
+        ifetch_pc = pc;
+        ifetch_checked = pc & ~(B - 1);
+    }
+    for (word_t block = ifetch_checked; block < pc + len; block += B) {
+        if (get_line(icache, block) != NULL) {
+            ifetch_checked = block + B;
+            continue;
+        }
+        if (imiss_valid)
+            return false;
+        imiss_valid = true;
+        imiss_block = block;
+        imiss_cycles_left = icache->d;
+        icache_misses++;
+        if (imiss_cycles_left > 0)
+            return false;
+        icache_fill();
+        ifetch_checked = block + B;
+    }
+    ifetch_pc = -1;
+    icache_hits++;
+    return true;
+}
+
 /*****************************************************************************
  * pipeline control
  * These functions can be used to handle hazards
@@ -355,21 +1284,9 @@ void sim_stall_stage(stage_id_t stage) {
 
 static int initialized = 0;
 
-void sim_init()
+/* Point the stage aliases at the current slots of the pipe registers */
+static void connect_pipes()
 {
-    /* Create memory and register files */
-    initialized = 1;
-    mem = init_mem(MEM_SIZE);
-    reg = init_reg();
-
-    /* create 5 pipe registers */
-    fetch_state     = new_pipe(sizeof(fetch_ele), (void *) &bubble_fetch);
-    decode_state    = new_pipe(sizeof(decode_ele), (void *) &bubble_decode);
-    execute_state   = new_pipe(sizeof(execute_ele), (void *) &bubble_execute);
-    memory_state    = new_pipe(sizeof(memory_ele), (void *) &bubble_memory);
-    writeback_state = new_pipe(sizeof(writeback_ele), (void *) &bubble_writeback);
-
-    /* connect them to the pipeline stages */
     fetch_input      = fetch_state->input;
     fetch_output     = fetch_state->output;
 
@@ -384,6 +1301,24 @@ void sim_init()
 
     writeback_input  = writeback_state->input;
     writeback_output = writeback_state->output;
+}
+
+void sim_init()
+{
+    /* Create memory and register files */
+    initialized = 1;
+    mem = init_mem(MEM_SIZE);
+    reg = init_reg();
+
+    /* create 5 pipe registers */
+    fetch_state     = new_pipe(sizeof(fetch_ele), (void *) &bubble_fetch);
+    decode_state    = new_pipe(sizeof(decode_ele), (void *) &bubble_decode);
+    execute_state   = new_pipe(sizeof(execute_ele), (void *) &bubble_execute);
+    memory_state    = new_pipe(sizeof(memory_ele), (void *) &bubble_memory);
+    writeback_state = new_pipe(sizeof(writeback_ele), (void *) &bubble_writeback);
+
+    /* connect them to the pipeline stages */
+    connect_pipes();
 
     sim_reset();
     clear_mem(mem);
@@ -394,6 +1329,8 @@ void sim_reset()
     if (!initialized)
 	    sim_init();
     clear_pipes();
+    connect_pipes();
+    predecode_flush();
     clear_mem(reg);
     starting_up = 1;
     cycles = instructions = 0;
@@ -408,6 +1345,15 @@ void sim_reset()
     mem_addr = 0;
     mem_data = 0;
     mem_write = false;
+
+    memset(mshrs, 0, mshr_count * sizeof(mshr_t));
+    memset(reg_pending, 0, sizeof(reg_pending));
+    dmem_retry = false;
+    sb_head = sb_used = 0;
+    memset(banks, 0, dram_banks * sizeof(dram_bank_t));
+    dram_queued = 0;
+    imiss_valid = false;
+    ifetch_pc = -1;
 }
 
 static void print_state(word_t cyc) {
@@ -454,6 +1400,8 @@ static void print_writeback() {
 
 /* Text representation of status */
 void tty_report(word_t cyc) {
+    if (TRACE_LEVEL < 1 || !(trace_mask & TRACE_STATE) || !dumpfile)
+        return;
     print_state(cyc);
     print_fetch();
     print_decode();
@@ -478,6 +1426,7 @@ static byte_t sim_step_pipe(word_t ccount)
 {
     /* Update pipe registers */
     update_pipes();
+    connect_pipes();
     /* print status report in TTY mode */
     tty_report(ccount);
     /* error checking */
@@ -504,6 +1453,13 @@ static byte_t sim_step_pipe(word_t ccount)
      * values properly.
      ***********************************************************/
 
+    /* Outstanding misses and buffered stores make progress before any stage looks at them */
+    if (dram_banks > 0)
+        dram_tick();
+    mshr_tick();
+    sb_drain();
+    icache_tick();
+
     do_writeback_stage();
     do_memory_stage();
     do_execute_stage();
@@ -525,47 +1481,51 @@ static byte_t sim_step_pipe(word_t ccount)
     return status;
 }
 
-/*************************** Fetch stage ***************************
- * TODO: update [*decode_input, f_pc, *fetch_input]
- * you may find these functions useful:
- * HPACK(), get_byte_val_I(), get_word_val_I(), HI4(), LO4()
- *
- * imem_error is defined for logging purpose, you can use it to help
- * with your design, but it's also fine to neglect it
- *******************************************************************/
-void do_fetch_stage()
-{
-    //get_byte_val_I();
-    /* your implementation */
+/*
+ * Predecoded instructions, direct mapped by PC. An entry holds everything
+ * do_fetch_stage gets out of the instruction bytes, so a hit skips the
+ * memory reads and the decode switch. A write into a page that has
+ * predecoded instructions drops the entries it may overlap.
+ */
+#define PREDECODE_ENTRIES 4096
+#define PREDECODE_PAGE_BITS 8
+#define MAX_INSTR_LEN 10
+
+typedef struct {
+    word_t pc;
+    word_t valc;
+    word_t valp;
+    byte_t icode, ifun, ra, rb;
+    bool instr_valid;
+    bool cached;            /* entry holds the instruction at pc */
+} predecode_t;
+
+static predecode_t predecode[PREDECODE_ENTRIES];
+static byte_t *predecode_pages = NULL;  /* nonzero for pages with cached instructions */
 
+/*
+ * decode_instr - Decode the instruction at pc into d. Returns false if some
+ * of its bytes are outside memory.
+ */
+static bool decode_instr(word_t pc, predecode_t *d)
+{
     byte_t instr = HPACK(I_NOP, F_NONE);
-    printf("3 BEARS: %lld\n%d\n%d\n", fetch_output -> predPC, writeback_output -> icode == I_RET, memory_output -> icode == I_JMP && !(memory_output -> takebranch));
-    if(writeback_output -> icode == I_RET) {
-        f_pc = writeback_output -> valm;
-    } else if(memory_output -> icode == I_JMP && !(memory_output -> takebranch)) {
-        f_pc = memory_output -> vala;
-    } else {
-        f_pc = fetch_output -> predPC;
-    }
-
-    /* your implementation */
     byte_t tempB;
-	imem_error |= !get_byte_val_I(mem, f_pc, &instr);
-	byte_t icode = HI4(instr);
-    byte_t ifun = LO4(instr);
+    bool error = false;
+    bool valid = true;
 	word_t ra = 0;
 	word_t rb = 0;
 	word_t valc = 0;
     word_t valp = 0;
-    //set f_pc at first
-    
+
+	error |= !get_byte_val_I(mem, pc, &instr);
 	switch (instr) {
 		case HPACK(I_NOP, F_NONE):
-			valp = f_pc + 1;
+			valp = pc + 1;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_HALT, F_NONE):
-			valp = f_pc + 1;//should be +1
+			valp = pc + 1;//should be +1
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_RRMOVQ, F_NONE):
@@ -575,44 +1535,44 @@ void do_fetch_stage()
 		case HPACK(I_RRMOVQ, C_NE):
 		case HPACK(I_RRMOVQ, C_GE):
 		case HPACK(I_RRMOVQ, C_G):
-			imem_error |= !get_byte_val_I(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val_I(mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_IRMOVQ, F_NONE):
-			imem_error |= !get_byte_val_I(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val_I(mem, pc + 1, &tempB);
             ra = REG_NONE;
 			rb = LO4(tempB);
-			imem_error |= !get_word_val_I(mem, f_pc + 2, &valc);
-			valp = f_pc + 10;
+			error |= !get_word_val_I(mem, pc + 2, &valc);
+			valp = pc + 10;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_RMMOVQ, F_NONE):
-			imem_error |= !get_byte_val_I(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val_I(mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			imem_error |= !get_word_val_I(mem, f_pc + 2, &valc);
-			valp = f_pc + 10;
+			error |= !get_word_val_I(mem, pc + 2, &valc);
+			valp = pc + 10;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_MRMOVQ, F_NONE):
-			imem_error |= !get_byte_val_I(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val_I(mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			imem_error |= !get_word_val_I(mem, f_pc + 2, &valc);
-			valp = f_pc + 10;
+			error |= !get_word_val_I(mem, pc + 2, &valc);
+			valp = pc + 10;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_ALU, A_ADD):
 		case HPACK(I_ALU, A_SUB):
 		case HPACK(I_ALU, A_AND):
 		case HPACK(I_ALU, A_XOR):
-			imem_error |= !get_byte_val_I(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val_I(mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_JMP, C_YES):
@@ -622,40 +1582,139 @@ void do_fetch_stage()
 		case HPACK(I_JMP, C_NE):
 		case HPACK(I_JMP, C_GE):
 		case HPACK(I_JMP, C_G):
-			imem_error |= !get_word_val_I(mem, f_pc + 1, &valc);
-			valp = f_pc + 9;
+			error |= !get_word_val_I(mem, pc + 1, &valc);
+			valp = pc + 9;
             // fetch_output->predPC = valc;
             //chose pc 
 	    	break;
 		case HPACK(I_CALL, F_NONE):
-		    imem_error |= !get_word_val_I(mem, f_pc + 1, &valc);
-		    valp = f_pc + 9;
+		    error |= !get_word_val_I(mem, pc + 1, &valc);
+		    valp = pc + 9;
             // fetch_output->predPC = valc;
 		    break;
 		case HPACK(I_RET, F_NONE):
-		    valp = f_pc + 1;
+		    valp = pc + 1;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_PUSHQ, F_NONE):
-			imem_error |= !get_byte_val_I(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val_I(mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_POPQ, F_NONE):
-			imem_error |= !get_byte_val_I(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val_I(mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
 
 		default:
-			instr_valid = false;
-			printf("Invalid instruction\n");
+			valid = false;
 			break;
 	}
+
+    d->pc = pc;
+    d->icode = HI4(instr);
+    d->ifun = LO4(instr);
+    d->ra = ra;
+    d->rb = rb;
+    d->valc = valc;
+    d->valp = valp;
+    d->instr_valid = valid;
+    return !error;
+}
+
+/* Predecoded instruction at pc, decoding it on a miss */
+static predecode_t *predecode_fetch(word_t pc)
+{
+    static predecode_t uncached;
+    predecode_t *d = &predecode[pc & (PREDECODE_ENTRIES - 1)];
+
+    if (d->cached && d->pc == pc)
+        return d;
+    if (!decode_instr(pc, &uncached)) {
+        imem_error = true;
+        return &uncached;
+    }
+    *d = uncached;
+    d->cached = true;
+    predecode_pages[pc >> PREDECODE_PAGE_BITS] = 1;
+    if (d->valp > pc)
+        predecode_pages[(d->valp - 1) >> PREDECODE_PAGE_BITS] = 1;
+    return d;
+}
+
+/* Drop every predecoded instruction, for when memory changes wholesale */
+static void predecode_flush()
+{
+    size_t pages = (mem->len >> PREDECODE_PAGE_BITS) + 1;
+    if (predecode_pages == NULL)
+        predecode_pages = malloc(pages);
+    memset(predecode_pages, 0, pages);
+    memset(predecode, 0, sizeof(predecode));
+}
+
+/* Drop the predecoded instructions that the len bytes written at pos may change */
+static void predecode_write(word_t pos, int len)
+{
+    if (!predecode_pages[pos >> PREDECODE_PAGE_BITS]
+            && !predecode_pages[(pos + len - 1) >> PREDECODE_PAGE_BITS])
+        return;
+    for (word_t pc = pos >= MAX_INSTR_LEN ? pos - MAX_INSTR_LEN + 1 : 0; pc < pos + len; pc++) {
+        predecode_t *d = &predecode[pc & (PREDECODE_ENTRIES - 1)];
+        if (d->pc == pc)
+            d->cached = false;
+    }
+}
+
+/*************************** Fetch stage ***************************
+ * TODO: update [*decode_input, f_pc, *fetch_input]
+ * you may find these functions useful:
+ * HPACK(), get_byte_val_I(), get_word_val_I(), HI4(), LO4()
+ *
+ * imem_error is defined for logging purpose, you can use it to help
+ * with your design, but it's also fine to neglect it
+ *******************************************************************/
+void do_fetch_stage()
+{
+    //get_byte_val_I();
+    /* your implementation */
+
+    TRACE(3, TRACE_FETCH, "\tFetch: predPC = 0x%llx, W ret = %d, M mispredict = %d\n", fetch_output -> predPC,
+          writeback_output -> icode == I_RET, memory_output -> icode == I_JMP && !(memory_output -> takebranch));
+    if(writeback_output -> icode == I_RET) {
+        f_pc = writeback_output -> valm;
+    } else if(memory_output -> icode == I_JMP && !(memory_output -> takebranch)) {
+        f_pc = memory_output -> vala;
+    } else {
+        f_pc = fetch_output -> predPC;
+    }
+
+    predecode_t *d = predecode_fetch(f_pc);
+	byte_t icode = d->icode;
+    byte_t ifun = d->ifun;
+	word_t ra = d->ra;
+	word_t rb = d->rb;
+	word_t valc = d->valc;
+    word_t valp = d->valp;
+    if (!d->instr_valid) {
+        instr_valid = false;
+        TRACE(2, TRACE_FETCH, "\tFetch: Invalid instruction at 0x%llx\n", f_pc);
+    }
+    /* On an I-cache miss decode gets a bubble and fetch retries this PC */
+    byte_t first_byte;
+    if (get_byte_val(mem, f_pc, &first_byte)
+            && !icache_fetch(f_pc, valp > f_pc ? valp - f_pc : 1)) {
+        memcpy(decode_input, &bubble_decode, sizeof(decode_ele));
+        fetch_input->predPC = f_pc;
+        icache_stalls++;
+        TRACE(2, TRACE_FETCH, "\tFetch: I-cache miss at 0x%llx\n", f_pc);
+        return;
+    }
+
     //XXX: SHOULD NEED THIS BUT DONT>?
     // if(!instr_valid) {
     //     decode_input -> status = STAT_INS;
@@ -698,7 +1757,7 @@ void do_fetch_stage()
 
     /* logging function, do not change this */
     if (!imem_error) {
-        sim_log("\tFetch: f_pc = 0x%llx, f_instr = %s\n",
+        TRACE(2, TRACE_FETCH, "\tFetch: f_pc = 0x%llx, f_instr = %s\n",
             f_pc, iname(HPACK(decode_input->icode, decode_input->ifun)));
     }
 }
@@ -781,7 +1840,7 @@ void do_decode_stage()
 			break;
 
 		default:
-			printf("icode is not valid (%d)", decode_output->icode);
+			TRACE(2, TRACE_DECODE, "\tDecode: icode is not valid (%d)\n", decode_output->icode);
 			break;
 	}
 
@@ -795,22 +1854,22 @@ void do_decode_stage()
     // - do something similar for memory variables
 
     if(decode_output -> icode == I_CALL || decode_output -> icode == I_JMP) {
-        printf("DECODE_FORWARD_SRCA: CALL/JMP\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valA = valP for CALL/JMP\n");
         vala  = decode_output -> valp;
     } else if(srcA == memory_input -> deste && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : e_dstE\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from e_dstE\n");
         vala = memory_input -> vale; //m1.yo - should be going here; ?
     } else if(srcA == memory_output -> destm && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : M_dstM\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from M_dstM\n");
         vala = writeback_input -> valm;
     } else if(srcA == memory_output -> deste && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : M_dstE\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from M_dstE\n");
         vala = memory_output -> vale;
     } else if(srcA == wb_destM && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : W_dstM\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from W_dstM\n");
         vala = wb_valM;
     } else if(srcA == wb_destE && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : W_dstE\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from W_dstE\n");
         vala = wb_valE;
     } else {
         vala = get_reg_val(reg, srcA); //m1.yo - is going here instead; ?
@@ -819,19 +1878,19 @@ void do_decode_stage()
     //Copy and paste for valb?
     //From diagram - no valp case
     if(srcB == memory_input -> deste && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : e_dstE\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from e_dstE\n");
         valb = memory_input -> vale;
     } else if(srcB == memory_output -> destm && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : M_dstM\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from M_dstM\n");
         valb = writeback_input -> valm;
     } else if(srcB == memory_output -> deste && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : M_dstE\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from M_dstE\n");
         valb = memory_output -> vale;
     } else if(srcB == wb_destM && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : W_dstM\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from W_dstM\n");
         valb = wb_valM;
     } else if(srcB == wb_destE && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : W_dstE\n");
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from W_dstE\n");
         valb = wb_valE;
     } else {
         valb = get_reg_val(reg, srcB);
@@ -953,7 +2012,7 @@ void do_execute_stage()
 			break;
 
 		default:
-			printf("icode is not valid (%d)", execute_output->icode);
+			TRACE(2, TRACE_EXECUTE, "\tExecute: icode is not valid (%d)\n", execute_output->icode);
 		    break;
 	}
     
@@ -980,16 +2039,16 @@ void do_execute_stage()
 
     /* logging functions, do not change these */
     if (execute_output->icode == I_JMP) {
-        sim_log("\tExecute: instr = %s, cc = %s, branch %staken\n",
+        TRACE(2, TRACE_EXECUTE, "\tExecute: instr = %s, cc = %s, branch %staken\n",
             iname(HPACK(execute_output->icode, execute_output->ifun)),
             cc_name(cc),
             memory_input->takebranch ? "" : "not ");
     }
-    sim_log("\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
+    TRACE(2, TRACE_EXECUTE, "\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
         op_name(alufun), alua, alub, memory_input->vale);
     if (setcc) {
         cc = cc_in;
-	    sim_log("\tExecute: New cc=%s\n", cc_name(cc_in));
+	    TRACE(2, TRACE_EXECUTE, "\tExecute: New cc=%s\n", cc_name(cc_in));
     }
 }
 
@@ -1004,7 +2063,9 @@ void do_memory_stage()
     mem_data = 0;
     mem_write = false;
     bool mem_read = false;
+    bool deferred = false;
     dmem_status = READY;
+    dmem_looked_up = false;
 
     word_t valm = 0;
 
@@ -1024,12 +2085,11 @@ void do_memory_stage()
 				mem_addr = memory_output->vale;
 				mem_data = memory_output->vala;
                 //Something similar to MRMOVQ but with vala instead?
-                dmem_status = get_word_val_D(mem, memory_output->vale, &valm);
 				break;
 
 			case I_MRMOVQ:
                 //mem_read = true;
-				dmem_status = get_word_val_D(mem, memory_output->vale, &valm);
+				dmem_status = dcache_load(memory_output->vale, memory_output->destm, &valm, &deferred);
 				break;
 
 			case I_ALU: break;
@@ -1043,31 +2103,43 @@ void do_memory_stage()
                 //in decode send valp to vala; only for call
                 //in execute send vala to vala; only for call
                 //??????? had to grab valp from decode @_@
-                dmem_status = get_word_val_D(mem, memory_output->vale, &valm);
 				break;
 
 			case I_RET:
                 //status changed her eidk inwinwjickwnoc
-				dmem_status = get_word_val_D(mem, memory_output->vala, &valm);
+				dmem_status = dcache_read(memory_output->vala, &valm);
 				break;
 
 			case I_PUSHQ:
 				mem_write = true;
 				mem_addr = memory_output->vale;
 				mem_data = memory_output->vala;
-                dmem_status = get_word_val_D(mem, memory_output->vale, &valm);
 				break;
 
 			case I_POPQ:
                 //mem_read = true;
-				dmem_status = get_word_val_D(mem, memory_output->vala, &valm);
+				dmem_status = dcache_load(memory_output->vala, memory_output->destm, &valm, &deferred);
 				break;
 
 			default:
-				printf("icode is not valid (%d)", memory_output->icode);
+				TRACE(2, TRACE_MEMORY, "\tMemory: icode is not valid (%d)\n", memory_output->icode);
 				break;
 		}
 
+        /* Stores retire into the store buffer; only a full buffer stalls */
+        if (mem_write) {
+            if ((dmem_status = sb_push(mem_addr, mem_data)) == ERROR) {
+                TRACE(2, TRACE_MEMORY, "\tMemory: Couldn't write to address 0x%llx\n", mem_addr);
+            } else if (dmem_status == READY) {
+                TRACE(2, TRACE_MEMORY, "\tMemory: Wrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
+            }
+        }
+
+        /* A halting or faulting instruction waits for outstanding fills and stores */
+        if (memory_output->status != STAT_AOK && memory_output->status != STAT_BUB
+                && (mshr_busy() || sb_used > 0))
+            dmem_status = IN_FLIGHT;
+
         // printf("DMEM STATUS: %d\n",dmem_status);
 
         writeback_input->icode = memory_output->icode;
@@ -1075,7 +2147,7 @@ void do_memory_stage()
         writeback_input->vale = memory_output->vale;
         writeback_input->valm = valm;
         writeback_input->deste = memory_output->deste;
-        writeback_input->destm = memory_output->destm;
+        writeback_input->destm = deferred ? REG_NONE : memory_output->destm;
         writeback_input -> stage_pc = memory_output -> stage_pc;
 
         //writeback_input->status = memory_output->status;
@@ -1088,22 +2160,27 @@ void do_memory_stage()
 
 
     if (mem_read) {
-        if ((dmem_status = get_word_val_D(mem, mem_addr, &mem_data)) != READY) {
-            sim_log("\tMemory: Couldn't Read from 0x%llx\n", mem_addr);
+        if ((dmem_status = dcache_read(mem_addr, &mem_data)) != READY) {
+            TRACE(2, TRACE_MEMORY, "\tMemory: Couldn't Read from 0x%llx\n", mem_addr);
         } else {
-            sim_log("\tMemory: Read 0x%llx from 0x%llx\n",
+            TRACE(2, TRACE_MEMORY, "\tMemory: Read 0x%llx from 0x%llx\n",
                 writeback_input->valm, mem_addr);
         }
     }
 
-    if (mem_write) {
-        if ((dmem_status = set_word_val_D(mem, mem_addr, mem_data)) != READY) {
-            sim_log("\tMemory: Couldn't write to address 0x%llx\n", mem_addr);
-        } else {
-            sim_log("\tMemory: Wrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
-        }
+    if (deferred) {
+        TRACE(2, TRACE_MEMORY, "\tMemory: Miss on 0x%llx, %s pending\n",
+            memory_output->icode == I_POPQ ? memory_output->vala : memory_output->vale,
+            reg_name(memory_output->destm));
     }
 
+    /*
+     * A stalled access is replayed next cycle without being counted again.
+     * A load held back by the store buffer never got to the cache, so its
+     * first real lookup still counts.
+     */
+    dmem_retry = dmem_status == IN_FLIGHT && dmem_looked_up;
+
 }
 
 /******************** Writeback stage *********************
@@ -1139,12 +2216,12 @@ void do_writeback_stage()
     status = writeback_output -> status;
     // status = writeback_output->status;
     if (wb_destE != REG_NONE && writeback_output -> status == STAT_AOK) {
-	    sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
+	    TRACE(2, TRACE_WRITEBACK, "\tWriteback: Wrote 0x%llx to register %s\n",
 		    wb_valE, reg_name(wb_destE));
 	    set_reg_val(reg, wb_destE, wb_valE);
     }
     if (wb_destM != REG_NONE && writeback_output -> status == STAT_AOK) {
-	    sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
+	    TRACE(2, TRACE_WRITEBACK, "\tWriteback: Wrote 0x%llx to register %s\n",
 		    wb_valM, reg_name(wb_destM));
 	    set_reg_val(reg, wb_destM, wb_valM);
     }
@@ -1156,7 +2233,7 @@ p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
 {
     if (stall) {
         if (bubble) {
-            sim_log("%s: Conflicting control signals for pipe register\n",
+            TRACE(2, TRACE_CONTROL, "%s: Conflicting control signals for pipe register\n",
                 name);
             return P_ERROR;
         } else {
@@ -1185,6 +2262,12 @@ void do_stall_check()
     bool mispredictedBranchHazard = execute_output -> icode == I_JMP && !(memory_input -> takebranch);
     // printf("SC - BB ICODE %d cc %d\n", execute_output -> icode, cc);
     bool comboA = mispredictedBranchHazard && returnHazard;
+    // D reads or overwrites a register that an MSHR still owes; a wrong-path
+    // instruction behind a mispredicted branch is squashed instead
+    bool missPendingHazard = !mispredictedBranchHazard
+            && (reg_is_pending(execute_input -> srca) || reg_is_pending(execute_input -> srcb)
+                || reg_is_pending(execute_input -> deste) || reg_is_pending(execute_input -> destm));
+    loadUseHazard = loadUseHazard || missPendingHazard;
     bool comboB = loadUseHazard && returnHazard;
 
     // bool mBubble = false;
@@ -1278,12 +2361,22 @@ word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *c
     word_t ccount = 0;
     byte_t run_status = STAT_AOK;
     while (icount < max_instr && ccount < max_cycle) {
+        frozen_begin();
         run_status = sim_step_pipe(ccount);
         if (run_status != STAT_BUB)
             icount++;
         if (run_status != STAT_AOK && run_status != STAT_BUB)
             break;
         ccount++;
+
+        /* Jump over cycles in which the stalled pipeline cannot change */
+        word_t limit = max_cycle - ccount;
+        if (run_status != STAT_BUB && max_instr - icount < limit)
+            limit = max_instr - icount;
+        word_t skipped = frozen_end(limit);
+        ccount += skipped;
+        if (run_status != STAT_BUB)
+            icount += skipped;
     }
     if (statusp)
         *statusp = run_status;
@@ -1329,27 +2422,57 @@ void sim_log( const char *format, ... ) {
  ******************************************************************************/
 
 #define MAX_STAGE 10
+#define PIPE_ALIGN 64           /* cache line */
+#define PIPE_ARENA 4096
 
 /******************************************************************************
  *	static variables
  ******************************************************************************/
 
+/*
+ * Each pipe has three slots in one cache-aligned arena: two that input and
+ * output take turns in, and a private copy of its bubble value. P_LOAD
+ * hands the input slot over as the new output and P_BUBBLE points output
+ * at the bubble slot, so neither copies register contents. The stage
+ * aliases (fetch_input, decode_output, ...) follow through connect_pipes().
+ */
+static pipe_ele pipe_eles[MAX_STAGE];
 static pipe_ptr pipes[MAX_STAGE];
 static int pipe_count = 0;
+static byte_t pipe_arena[PIPE_ARENA] __attribute__((aligned(PIPE_ALIGN)));
+static size_t pipe_arena_used = 0;
+static byte_t *pipe_slots[MAX_STAGE];   /* first of the three slots */
+static size_t pipe_stride[MAX_STAGE];
 
 /******************************************************************************
  *	function definitions
  ******************************************************************************/
 
+/* The one of the two register slots of pipe s that slot is not */
+static inline void *other_slot(int s, void *slot)
+{
+    return slot == pipe_slots[s] ? pipe_slots[s] + pipe_stride[s] : pipe_slots[s];
+}
+
 /* Create new pipe with count bytes of state */
 /* bubble_val indicates state corresponding to pipeline bubble */
 pipe_ptr new_pipe(int count, void *bubble_val)
 {
-    pipe_ptr result = (pipe_ptr) malloc(sizeof(pipe_ele));
-    result->output = malloc(count);
-    result->input = malloc(count);
-    memcpy(result->output, bubble_val, count);
-    memcpy(result->input, bubble_val, count);
+    int s = pipe_count;
+    size_t stride = (count + PIPE_ALIGN - 1) & ~(size_t) (PIPE_ALIGN - 1);
+    pipe_ptr result = &pipe_eles[s];
+
+    if (pipe_arena_used + 3 * stride <= PIPE_ARENA) {
+        pipe_slots[s] = pipe_arena + pipe_arena_used;
+        pipe_arena_used += 3 * stride;
+    } else {
+        pipe_slots[s] = aligned_alloc(PIPE_ALIGN, 3 * stride);
+    }
+    pipe_stride[s] = stride;
+    for (int i = 0; i < 3; i++)
+        memcpy(pipe_slots[s] + i * stride, bubble_val, count);
+    result->output = pipe_slots[s];
+    result->input = pipe_slots[s] + stride;
     result->count = count;
     result->op = P_LOAD;
     result->bubble_val = bubble_val;
@@ -1367,15 +2490,17 @@ void update_pipes()
         {
         case P_BUBBLE:
             /* insert a bubble into the next stage */
-            memcpy(p->output, p->bubble_val, p->count);
+            p->output = pipe_slots[s] + 2 * pipe_stride[s];
             break;
 
         case P_LOAD:
-            /* copy calculated state from previous stage */
-            memcpy(p->output, p->input, p->count);
+            /* calculated state from previous stage becomes the output */
+            p->output = p->input;
+            p->input = other_slot(s, p->output);
             break;
         case P_ERROR:
-            /* Like a bubble, but insert error condition */
+            /* Like a bubble, but the error status gets written into it */
+            p->output = other_slot(s, p->input);
             memcpy(p->output, p->bubble_val, p->count);
             break;
         case P_STALL:
@@ -1388,18 +2513,161 @@ void update_pipes()
     }
 }
 
+/* Put saved input and output contents back into pipe p */
+void load_pipe(pipe_ptr p, void *input, void *output)
+{
+    int s = p - pipe_eles;
+    p->output = pipe_slots[s];
+    p->input = pipe_slots[s] + pipe_stride[s];
+    memcpy(p->input, input, p->count);
+    memcpy(p->output, output, p->count);
+}
+
 /* Set all pipes to bubble values */
 void clear_pipes()
 {
     int s;
     for (s = 0; s < pipe_count; s++) {
         pipe_ptr p = pipes[s];
-        memcpy(p->output, p->bubble_val, p->count);
-        memcpy(p->input, p->bubble_val, p->count);
+        load_pipe(p, p->bubble_val, p->bubble_val);
         p->op = P_LOAD;
     }
 }
 
+/*****************************************************************************
+ * Frozen pipeline fast path
+ * While the memory stage waits on a long miss every cycle looks the same:
+ * the pipe registers hold still and only the miss countdowns and a few stall
+ * counters move. Once a whole cycle has gone by with nothing else changing,
+ * the cycles up to the next countdown event are applied in one step. This
+ * is only done without a dump file, so no trace output is ever skipped.
+ *****************************************************************************/
+
+/* Counters that a frozen cycle may bump; a skip adds the same amount per cycle */
+static word_t *frozen_counters[] = {
+    &cycles, &mshr_full_stalls, &sb_full_stalls, &icache_stalls, &icache_hits
+};
+#define FROZEN_COUNTERS (sizeof(frozen_counters) / sizeof(frozen_counters[0]))
+
+static struct {
+    bool armed;
+    byte_t *pipe_state;     /* input, output and op of every pipe */
+    size_t pipe_bytes;
+    mshr_t *mshrs;
+    bool reg_pending[REG_NONE];
+    word_t counters[FROZEN_COUNTERS];
+    word_t instructions;
+    int hit_count, miss_count;
+    int sb_head, sb_used;
+    bool imiss_valid;
+    word_t ifetch_pc, ifetch_checked;
+    cc_t cc;
+    stat_t status;
+} frozen;
+
+static void save_pipe_state(byte_t *buf)
+{
+    for (int s = 0; s < pipe_count; s++) {
+        pipe_ptr p = pipes[s];
+        memcpy(buf, p->input, p->count);
+        memcpy(buf + p->count, p->output, p->count);
+        memcpy(buf + 2 * p->count, &p->op, sizeof(p->op));
+        buf += 2 * p->count + sizeof(p->op);
+    }
+}
+
+/* frozen_begin - Record the state before a cycle that may turn out to be frozen */
+static void frozen_begin()
+{
+    frozen.armed = dumpfile == NULL && dmem_retry && dram_queued == 0;
+    if (!frozen.armed)
+        return;
+
+    if (frozen.pipe_state == NULL) {
+        for (int s = 0; s < pipe_count; s++)
+            frozen.pipe_bytes += 2 * pipes[s]->count + sizeof(pipes[s]->op);
+        frozen.pipe_state = malloc(2 * frozen.pipe_bytes);
+        frozen.mshrs = malloc(mshr_count * sizeof(mshr_t));
+    }
+    save_pipe_state(frozen.pipe_state);
+    memcpy(frozen.mshrs, mshrs, mshr_count * sizeof(mshr_t));
+    memcpy(frozen.reg_pending, reg_pending, sizeof(reg_pending));
+    for (size_t i = 0; i < FROZEN_COUNTERS; i++)
+        frozen.counters[i] = *frozen_counters[i];
+    frozen.instructions = instructions;
+    frozen.hit_count = hit_count;
+    frozen.miss_count = miss_count;
+    frozen.sb_head = sb_head;
+    frozen.sb_used = sb_used;
+    frozen.imiss_valid = imiss_valid;
+    frozen.ifetch_pc = ifetch_pc;
+    frozen.ifetch_checked = ifetch_checked;
+    frozen.cc = cc;
+    frozen.status = status;
+}
+
+/* Cycles until the countdown of m next makes a word or the whole block arrive */
+static word_t mshr_next_event(mshr_t *m)
+{
+    word_t words = (((word_t) 1 << cache->b) + 7) / 8;
+    word_t top = (words - 1) * fill_beat;
+    word_t next = 0;
+
+    if (fill_mode != FILL_FULL)
+        next = m->cycles_left > top ? top : (m->cycles_left - 1) / fill_beat * fill_beat;
+    return m->cycles_left - next;
+}
+
+/*
+ * frozen_end - If the cycle just simulated left everything but countdowns and
+ * stall counters alone, advance by up to limit more identical cycles at once,
+ * stopping short of the next countdown event. Returns the cycles skipped.
+ */
+static word_t frozen_end(word_t limit)
+{
+    if (!frozen.armed || !dmem_retry || dram_queued != 0)
+        return 0;
+    if (instructions != frozen.instructions || hit_count != frozen.hit_count
+            || miss_count != frozen.miss_count || sb_head != frozen.sb_head
+            || sb_used != frozen.sb_used || imiss_valid != frozen.imiss_valid
+            || ifetch_pc != frozen.ifetch_pc || ifetch_checked != frozen.ifetch_checked
+            || cc != frozen.cc || status != frozen.status
+            || memcmp(reg_pending, frozen.reg_pending, sizeof(reg_pending)))
+        return 0;
+
+    byte_t *now = frozen.pipe_state + frozen.pipe_bytes;
+    save_pipe_state(now);
+    if (memcmp(now, frozen.pipe_state, frozen.pipe_bytes))
+        return 0;
+
+    /* The first countdown to reach an event ends the skip one cycle early */
+    word_t skip = limit;
+    for (int i = 0; i < mshr_count; i++) {
+        mshr_t *m = &mshrs[i];
+        frozen.mshrs[i].cycles_left = m->cycles_left;
+        if (m->valid && !m->queued && mshr_next_event(m) - 1 < skip)
+            skip = mshr_next_event(m) - 1;
+    }
+    if (memcmp(mshrs, frozen.mshrs, mshr_count * sizeof(mshr_t)))
+        return 0;
+    if (imiss_valid && imiss_cycles_left - 1 < skip)
+        skip = imiss_cycles_left - 1;
+    if (skip <= 0)
+        return 0;
+
+    for (int i = 0; i < mshr_count; i++) {
+        if (mshrs[i].valid && !mshrs[i].queued)
+            mshrs[i].cycles_left -= skip;
+    }
+    if (imiss_valid)
+        imiss_cycles_left -= skip;
+    for (int b = 0; b < dram_banks; b++)
+        banks[b].busy_cycles = banks[b].busy_cycles > skip ? banks[b].busy_cycles - skip : 0;
+    for (size_t i = 0; i < FROZEN_COUNTERS; i++)
+        *frozen_counters[i] += (*frozen_counters[i] - frozen.counters[i]) * skip;
+    return skip;
+}
+
 /*************** Bubbled version of stages *************/
 
 fetch_ele bubble_fetch = {0,STAT_AOK};
@@ -1416,18 +2684,36 @@ writeback_ele bubble_writeback = { I_NOP, 0, 0, 0, REG_NONE, REG_NONE,
 			     STAT_BUB, 0};
 
 
-extern bool inflight;
-extern size_t inflight_cycles;
-extern word_t inflight_pos;
+/* The counters reported at the end of a run, so going back does not count a cycle twice */
+typedef struct {
+    int hit_count, miss_count, dirty_eviction_count, clean_eviction_count;
+    word_t mshr_primary, mshr_merged, mshr_full_stalls, early_words;
+    word_t sb_stores, sb_forwards, sb_full_stalls;
+    word_t icache_hits, icache_misses, icache_evictions, icache_stalls;
+    word_t dram_row_hits, dram_row_misses, dram_row_conflicts;
+    word_t dram_latency_hist[DRAM_HIST_BUCKETS];
+} stats_t;
 
 typedef struct pipe_cache_restore_struct {
     processor_state_t state;
     word_t cycles;
     pipe_ptr pipes[5];
-    cache_t *cache;
-    bool inflight;
-    size_t inflight_cycles;
-    word_t inflight_pos;
+    cache_journal_t *cache_journal;   /* both caches' changes during the cycle */
+    mshr_t *mshrs;
+    bool reg_pending[REG_NONE];
+    bool dmem_retry;
+    store_entry_t *store_buf;
+    int sb_head;
+    int sb_used;
+    dram_bank_t *banks;
+    dram_req_t *dram_queue;
+    int dram_queued;
+    bool imiss_valid;
+    word_t imiss_block;
+    word_t imiss_cycles_left;
+    word_t ifetch_pc;
+    word_t ifetch_checked;
+    stats_t stats;
     struct pipe_cache_restore_struct *next;
 } pipe_cache_restore_t;
 
@@ -1445,20 +2731,88 @@ void help() {
     printf("set n             -  display info about set n\n");
     printf("undo n            -  steps back n instructions\n");
     printf("back n            -  steps back n cycles\n");
+    printf("break pc|cycle n  -  stops run when the fetch PC or cycle count reaches n\n");
+    printf("watch addr        -  stops run when the word at addr changes\n");
+    printf("delete n          -  removes breakpoint n\n");
+    printf("breakpoints       -  lists breakpoints\n");
+    printf("run               -  runs without history until a breakpoint or halt\n");
     printf("pipe X            -  displays pipeline info for stage X (f, d, e, m , w) \n");
     printf("quit              -  exit the program\n\n");
 }
 
+static void free_restore_point(pipe_cache_restore_t *pipe_cache_restore_point);
+
+static void save_stats(stats_t *st)
+{
+    st->hit_count = hit_count;
+    st->miss_count = miss_count;
+    st->dirty_eviction_count = dirty_eviction_count;
+    st->clean_eviction_count = clean_eviction_count;
+    st->mshr_primary = mshr_primary;
+    st->mshr_merged = mshr_merged;
+    st->mshr_full_stalls = mshr_full_stalls;
+    st->early_words = early_words;
+    st->sb_stores = sb_stores;
+    st->sb_forwards = sb_forwards;
+    st->sb_full_stalls = sb_full_stalls;
+    st->icache_hits = icache_hits;
+    st->icache_misses = icache_misses;
+    st->icache_evictions = icache_evictions;
+    st->icache_stalls = icache_stalls;
+    st->dram_row_hits = dram_row_hits;
+    st->dram_row_misses = dram_row_misses;
+    st->dram_row_conflicts = dram_row_conflicts;
+    memcpy(st->dram_latency_hist, dram_latency_hist, sizeof(dram_latency_hist));
+}
+
+static void load_stats(stats_t *st)
+{
+    hit_count = st->hit_count;
+    miss_count = st->miss_count;
+    dirty_eviction_count = st->dirty_eviction_count;
+    clean_eviction_count = st->clean_eviction_count;
+    mshr_primary = st->mshr_primary;
+    mshr_merged = st->mshr_merged;
+    mshr_full_stalls = st->mshr_full_stalls;
+    early_words = st->early_words;
+    sb_stores = st->sb_stores;
+    sb_forwards = st->sb_forwards;
+    sb_full_stalls = st->sb_full_stalls;
+    icache_hits = st->icache_hits;
+    icache_misses = st->icache_misses;
+    icache_evictions = st->icache_evictions;
+    icache_stalls = st->icache_stalls;
+    dram_row_hits = st->dram_row_hits;
+    dram_row_misses = st->dram_row_misses;
+    dram_row_conflicts = st->dram_row_conflicts;
+    memcpy(dram_latency_hist, st->dram_latency_hist, sizeof(dram_latency_hist));
+}
+
 static pipe_cache_restore_t *create_pipe_cache_restore_point(word_t *icount, word_t* ccount, byte_t *statusp, cc_t *ccp) {
     pipe_cache_restore_t *pipe_cache_restore_point = malloc(sizeof(pipe_cache_restore_t));
     pipe_cache_restore_point->state.cc = *ccp;
     pipe_cache_restore_point->state.status = *statusp;
     pipe_cache_restore_point->cycles = *ccount;
     pipe_cache_restore_point->state.icount = *icount;
-    pipe_cache_restore_point->inflight = inflight;
-    pipe_cache_restore_point->inflight_cycles = inflight_cycles;
-    pipe_cache_restore_point->inflight_pos = inflight_pos;
-    pipe_cache_restore_point->cache = create_checkpoint(cache);
+    pipe_cache_restore_point->mshrs = malloc(mshr_count * sizeof(mshr_t));
+    memcpy(pipe_cache_restore_point->mshrs, mshrs, mshr_count * sizeof(mshr_t));
+    memcpy(pipe_cache_restore_point->reg_pending, reg_pending, sizeof(reg_pending));
+    pipe_cache_restore_point->dmem_retry = dmem_retry;
+    pipe_cache_restore_point->store_buf = malloc(sb_size * sizeof(store_entry_t));
+    memcpy(pipe_cache_restore_point->store_buf, store_buf, sb_size * sizeof(store_entry_t));
+    pipe_cache_restore_point->sb_head = sb_head;
+    pipe_cache_restore_point->sb_used = sb_used;
+    pipe_cache_restore_point->banks = malloc(dram_banks * sizeof(dram_bank_t));
+    memcpy(pipe_cache_restore_point->banks, banks, dram_banks * sizeof(dram_bank_t));
+    pipe_cache_restore_point->dram_queue = malloc(mshr_count * sizeof(dram_req_t));
+    memcpy(pipe_cache_restore_point->dram_queue, dram_queue, mshr_count * sizeof(dram_req_t));
+    pipe_cache_restore_point->dram_queued = dram_queued;
+    pipe_cache_restore_point->imiss_valid = imiss_valid;
+    pipe_cache_restore_point->imiss_block = imiss_block;
+    pipe_cache_restore_point->imiss_cycles_left = imiss_cycles_left;
+    pipe_cache_restore_point->ifetch_pc = ifetch_pc;
+    pipe_cache_restore_point->ifetch_checked = ifetch_checked;
+    save_stats(&pipe_cache_restore_point->stats);
     for (int s = 0; s < pipe_count; s++) {
         pipe_ptr p = pipes[s];
         pipe_cache_restore_point->pipes[s] = (pipe_ptr) malloc(sizeof(pipe_ele));
@@ -1472,7 +2826,9 @@ static pipe_cache_restore_t *create_pipe_cache_restore_point(word_t *icount, wor
     }
     mem_t previous_memory = copy_mem(mem);
     mem_t previous_registers = copy_mem(reg);
+    pipe_cache_restore_point->cache_journal = cache_journal_start();
     sim_run_cycle(icount, ccount, statusp, ccp);
+    cache_journal_stop();
     pipe_cache_restore_point->state.memory = create_memory_restore(previous_memory, mem);
     pipe_cache_restore_point->state.registers = create_memory_restore(previous_registers, reg);
     return pipe_cache_restore_point;
@@ -1480,20 +2836,45 @@ static pipe_cache_restore_t *create_pipe_cache_restore_point(word_t *icount, wor
 
 static void restore_pipes_and_free(pipe_cache_restore_t *pipe_cache_restore_point) {
 
-    inflight_pos = pipe_cache_restore_point->inflight_pos;
-    inflight_cycles = pipe_cache_restore_point->inflight_cycles;
-    inflight = pipe_cache_restore_point->inflight;
-    cache_t *temp = cache;
-    cache = pipe_cache_restore_point->cache;
-    free_cache(temp);
+    memcpy(mshrs, pipe_cache_restore_point->mshrs, mshr_count * sizeof(mshr_t));
+    memcpy(reg_pending, pipe_cache_restore_point->reg_pending, sizeof(reg_pending));
+    dmem_retry = pipe_cache_restore_point->dmem_retry;
+    memcpy(store_buf, pipe_cache_restore_point->store_buf, sb_size * sizeof(store_entry_t));
+    sb_head = pipe_cache_restore_point->sb_head;
+    sb_used = pipe_cache_restore_point->sb_used;
+    memcpy(banks, pipe_cache_restore_point->banks, dram_banks * sizeof(dram_bank_t));
+    memcpy(dram_queue, pipe_cache_restore_point->dram_queue, mshr_count * sizeof(dram_req_t));
+    dram_queued = pipe_cache_restore_point->dram_queued;
+    imiss_valid = pipe_cache_restore_point->imiss_valid;
+    imiss_block = pipe_cache_restore_point->imiss_block;
+    imiss_cycles_left = pipe_cache_restore_point->imiss_cycles_left;
+    ifetch_pc = pipe_cache_restore_point->ifetch_pc;
+    ifetch_checked = pipe_cache_restore_point->ifetch_checked;
+    load_stats(&pipe_cache_restore_point->stats);
+    cache_journal_undo(pipe_cache_restore_point->cache_journal);
+    pipe_cache_restore_point->cache_journal = NULL;
 
     for (int s = 0; s < pipe_count; s++) {
         pipe_ptr p = pipes[s];
         p->bubble_val = pipe_cache_restore_point->pipes[s]->bubble_val;
         p->op = pipe_cache_restore_point->pipes[s]->op;
         p->count = pipe_cache_restore_point->pipes[s]->count;
-        memcpy(p->input, pipe_cache_restore_point->pipes[s]->input, p->count);
-        memcpy(p->output, pipe_cache_restore_point->pipes[s]->output, p->count);
+        load_pipe(p, pipe_cache_restore_point->pipes[s]->input, pipe_cache_restore_point->pipes[s]->output);
+    }
+    connect_pipes();
+    free_restore_point(pipe_cache_restore_point);
+}
+
+/* Free a restore point without applying it */
+static void free_restore_point(pipe_cache_restore_t *pipe_cache_restore_point) {
+    free(pipe_cache_restore_point->mshrs);
+    free(pipe_cache_restore_point->store_buf);
+    free(pipe_cache_restore_point->banks);
+    free(pipe_cache_restore_point->dram_queue);
+    if (pipe_cache_restore_point->cache_journal != NULL)
+        cache_journal_free(pipe_cache_restore_point->cache_journal);
+
+    for (int s = 0; s < pipe_count; s++) {
         free(pipe_cache_restore_point->pipes[s]->output);
         free(pipe_cache_restore_point->pipes[s]->input);
         free(pipe_cache_restore_point->pipes[s]);
@@ -1514,6 +2895,444 @@ static void restore_pipes_and_free(pipe_cache_restore_t *pipe_cache_restore_poin
     free(pipe_cache_restore_point);
 }
 
+/*
+ * Time travel for the interactive mode, as in psim: a snapshot of the whole
+ * simulator every snapshot_interval cycles, per-cycle restore points back to
+ * the latest snapshot, and deterministic re-simulation from the nearest
+ * earlier snapshot for anything older. Besides the processor state a
+ * snapshot holds the caches, MSHRs, store buffer, DRAM and I-fetch state
+ * and the statistics counters.
+ * Snapshots beyond history_budget are thinned out to every other one.
+ */
+typedef struct {
+    word_t cycles;              /* ccount when it was taken */
+    processor_state_t state;    /* memory and registers as diffs from mem0/reg0 */
+    byte_t *pipe_state;
+    word_t sim_cycles;
+    word_t sim_instructions;
+    int starting_up;
+    cache_t *cache;
+    cache_t *icache;
+    uword_t lru_clock;
+    mshr_t *mshrs;
+    bool reg_pending[REG_NONE];
+    bool dmem_retry;
+    store_entry_t *store_buf;
+    int sb_head;
+    int sb_used;
+    dram_bank_t *banks;
+    dram_req_t *dram_queue;
+    int dram_queued;
+    bool imiss_valid;
+    word_t imiss_block;
+    word_t imiss_cycles_left;
+    word_t ifetch_pc;
+    word_t ifetch_checked;
+    stats_t stats;
+    size_t bytes;
+} snapshot_t;
+
+static snapshot_t *snapshots = NULL;    /* in cycle order */
+static int snapshot_count = 0;
+static size_t snapshot_bytes = 0;
+static pipe_cache_restore_t *restore_head = NULL;
+static word_t restore_base = 0;         /* cycle the oldest restore point goes back to */
+static mem_t history_mem0, history_reg0;
+
+/* Return the positions and values where m differs from base */
+static memory_restore_t *diff_image(mem_t base, mem_t m)
+{
+    memory_restore_t *d = calloc(1, sizeof(memory_restore_t));
+    for (word_t i = 0; i < m->len; i++) {
+        if (m->contents[i] != base->contents[i])
+            d->count++;
+    }
+    d->positions = malloc(d->count * sizeof(word_t));
+    d->values = malloc(d->count);
+    for (word_t i = 0, k = 0; i < m->len; i++) {
+        if (m->contents[i] != base->contents[i]) {
+            d->positions[k] = i;
+            d->values[k++] = m->contents[i];
+        }
+    }
+    return d;
+}
+
+static void free_diff(memory_restore_t *d)
+{
+    free(d->positions);
+    free(d->values);
+    free(d);
+}
+
+static size_t cache_bytes(cache_t *c)
+{
+    return c == NULL ? 0 : ((size_t) 1 << c->s) * c->E * (sizeof(cache_line_t) + ((size_t) 1 << c->b));
+}
+
+static size_t pipe_state_bytes()
+{
+    size_t bytes = 0;
+    for (int s = 0; s < pipe_count; s++)
+        bytes += 2 * pipes[s]->count + sizeof(pipes[s]->op);
+    return bytes;
+}
+
+/* Index of the latest snapshot taken at or before cycle, -1 if there is none */
+static int find_snapshot(word_t cycle)
+{
+    int i = snapshot_count - 1;
+    while (i >= 0 && snapshots[i].cycles > cycle)
+        i--;
+    return i;
+}
+
+static void free_snapshot(snapshot_t *snap)
+{
+    free_diff(snap->state.memory);
+    free_diff(snap->state.registers);
+    free(snap->pipe_state);
+    free_cache(snap->cache);
+    if (snap->icache != NULL)
+        free_cache(snap->icache);
+    free(snap->mshrs);
+    free(snap->store_buf);
+    free(snap->banks);
+    free(snap->dram_queue);
+}
+
+/* Drop every other snapshot, keeping the first and last, until within budget */
+static void thin_snapshots()
+{
+    while (snapshot_bytes > history_budget && snapshot_count > 2) {
+        int kept = 1;
+        for (int i = 1; i < snapshot_count; i++) {
+            if (i % 2 == 1 && i != snapshot_count - 1) {
+                snapshot_bytes -= snapshots[i].bytes;
+                free_snapshot(&snapshots[i]);
+            } else {
+                snapshots[kept++] = snapshots[i];
+            }
+        }
+        snapshot_count = kept;
+    }
+}
+
+static void take_snapshot(word_t icount, word_t ccount, byte_t run_status)
+{
+    snapshot_t snap;
+    snap.cycles = ccount;
+    snap.state.cc = cc;
+    snap.state.status = run_status;
+    snap.state.icount = icount;
+    snap.state.memory = diff_image(history_mem0, mem);
+    snap.state.registers = diff_image(history_reg0, reg);
+    snap.pipe_state = malloc(pipe_state_bytes());
+    byte_t *buf = snap.pipe_state;
+    for (int s = 0; s < pipe_count; s++) {
+        pipe_ptr p = pipes[s];
+        memcpy(buf, p->input, p->count);
+        memcpy(buf + p->count, p->output, p->count);
+        memcpy(buf + 2 * p->count, &p->op, sizeof(p->op));
+        buf += 2 * p->count + sizeof(p->op);
+    }
+    snap.sim_cycles = cycles;
+    snap.sim_instructions = instructions;
+    snap.starting_up = starting_up;
+    snap.cache = create_checkpoint(cache);
+    snap.icache = icache != NULL ? create_checkpoint(icache) : NULL;
+    snap.lru_clock = globalLru;
+    snap.mshrs = malloc(mshr_count * sizeof(mshr_t));
+    memcpy(snap.mshrs, mshrs, mshr_count * sizeof(mshr_t));
+    memcpy(snap.reg_pending, reg_pending, sizeof(reg_pending));
+    snap.dmem_retry = dmem_retry;
+    snap.store_buf = malloc(sb_size * sizeof(store_entry_t));
+    memcpy(snap.store_buf, store_buf, sb_size * sizeof(store_entry_t));
+    snap.sb_head = sb_head;
+    snap.sb_used = sb_used;
+    snap.banks = malloc(dram_banks * sizeof(dram_bank_t));
+    memcpy(snap.banks, banks, dram_banks * sizeof(dram_bank_t));
+    snap.dram_queue = malloc(mshr_count * sizeof(dram_req_t));
+    memcpy(snap.dram_queue, dram_queue, mshr_count * sizeof(dram_req_t));
+    snap.dram_queued = dram_queued;
+    snap.imiss_valid = imiss_valid;
+    snap.imiss_block = imiss_block;
+    snap.imiss_cycles_left = imiss_cycles_left;
+    snap.ifetch_pc = ifetch_pc;
+    snap.ifetch_checked = ifetch_checked;
+    save_stats(&snap.stats);
+    snap.bytes = sizeof(snapshot_t) + pipe_state_bytes()
+        + (snap.state.memory->count + snap.state.registers->count) * (sizeof(word_t) + 1)
+        + cache_bytes(cache) + cache_bytes(icache)
+        + mshr_count * (sizeof(mshr_t) + sizeof(dram_req_t))
+        + sb_size * sizeof(store_entry_t) + dram_banks * sizeof(dram_bank_t);
+
+    int i = find_snapshot(ccount) + 1;
+    snapshots = realloc(snapshots, (snapshot_count + 1) * sizeof(snapshot_t));
+    memmove(&snapshots[i + 1], &snapshots[i], (snapshot_count - i) * sizeof(snapshot_t));
+    snapshots[i] = snap;
+    snapshot_count++;
+    snapshot_bytes += snap.bytes;
+    thin_snapshots();
+}
+
+static void free_restore_points()
+{
+    while (restore_head != NULL) {
+        pipe_cache_restore_t *temp = restore_head;
+        restore_head = restore_head->next;
+        free_restore_point(temp);
+    }
+}
+
+static void load_snapshot(snapshot_t *snap, word_t *icount, word_t *ccount, byte_t *run_status, cc_t *ccp)
+{
+    memcpy(mem->contents, history_mem0->contents, mem->len);
+    apply_restore(mem, snap->state.memory);
+    predecode_flush();
+    memcpy(reg->contents, history_reg0->contents, reg->len);
+    apply_restore(reg, snap->state.registers);
+    byte_t *buf = snap->pipe_state;
+    for (int s = 0; s < pipe_count; s++) {
+        pipe_ptr p = pipes[s];
+        load_pipe(p, buf, buf + p->count);
+        memcpy(&p->op, buf + 2 * p->count, sizeof(p->op));
+        buf += 2 * p->count + sizeof(p->op);
+    }
+    connect_pipes();
+    cc = *ccp = snap->state.cc;
+    status = snap->state.status;
+    *run_status = status;
+    *icount = snap->state.icount;
+    *ccount = snap->cycles;
+    cycles = snap->sim_cycles;
+    instructions = snap->sim_instructions;
+    starting_up = snap->starting_up;
+    restore_checkpoint(cache, snap->cache);
+    if (icache != NULL)
+        restore_checkpoint(icache, snap->icache);
+    globalLru = snap->lru_clock;
+    memcpy(mshrs, snap->mshrs, mshr_count * sizeof(mshr_t));
+    memcpy(reg_pending, snap->reg_pending, sizeof(reg_pending));
+    dmem_retry = snap->dmem_retry;
+    memcpy(store_buf, snap->store_buf, sb_size * sizeof(store_entry_t));
+    sb_head = snap->sb_head;
+    sb_used = snap->sb_used;
+    memcpy(banks, snap->banks, dram_banks * sizeof(dram_bank_t));
+    memcpy(dram_queue, snap->dram_queue, mshr_count * sizeof(dram_req_t));
+    dram_queued = snap->dram_queued;
+    imiss_valid = snap->imiss_valid;
+    imiss_block = snap->imiss_block;
+    imiss_cycles_left = snap->imiss_cycles_left;
+    ifetch_pc = snap->ifetch_pc;
+    ifetch_checked = snap->ifetch_checked;
+    load_stats(&snap->stats);
+
+    free_restore_points();
+    restore_base = *ccount;
+}
+
+/* Simulate one cycle, keeping what is needed to come back to it */
+static void history_step(word_t *icount, word_t *ccount, byte_t *statusp, cc_t *ccp)
+{
+    if (snapshot_count == 0 || *ccount - restore_base >= snapshot_interval) {
+        int i = find_snapshot(*ccount);
+        if (i < 0 || snapshots[i].cycles != *ccount)
+            take_snapshot(*icount, *ccount, *statusp);
+        free_restore_points();
+        restore_base = *ccount;
+    }
+    pipe_cache_restore_t *new_restore_point = create_pipe_cache_restore_point(icount, ccount, statusp, ccp);
+    new_restore_point->next = restore_head;
+    restore_head = new_restore_point;
+}
+
+/* Undo the most recent cycle that still has a restore point */
+static bool history_pop(word_t *icount, word_t *ccount, byte_t *run_status)
+{
+    if (restore_head == NULL)
+        return false;
+    cc = restore_head->state.cc;
+    *icount = restore_head->state.icount;
+    *ccount = restore_head->cycles;
+    apply_restore(mem, restore_head->state.memory);
+    predecode_flush();
+    apply_restore(reg, restore_head->state.registers);
+    status = restore_head->state.status;
+    *run_status = status;
+    pipe_cache_restore_t *temp = restore_head;
+    restore_head = restore_head->next;
+    restore_pipes_and_free(temp);
+    return true;
+}
+
+/* Go back to the given cycle, re-simulating from a snapshot if needed */
+static void history_rewind(word_t target, word_t *icount, word_t *ccount, byte_t *run_status, cc_t *ccp)
+{
+    if (target < restore_base) {
+        int i = find_snapshot(target);
+        if (i < 0)
+            return;
+        load_snapshot(&snapshots[i], icount, ccount, run_status, ccp);
+        FILE *saved_dumpfile = dumpfile;
+        dumpfile = NULL;
+        while (*ccount < target)
+            history_step(icount, ccount, run_status, ccp);
+        dumpfile = saved_dumpfile;
+    }
+    while (*ccount > target && history_pop(icount, ccount, run_status))
+        ;
+}
+
+/*
+ * Breakpoints for the interactive mode. run executes plain sim_run_cycle()
+ * calls with no restore points and no trace output until a breakpoint
+ * fires or the program stops, then takes a snapshot there so back and undo
+ * still work from that point.
+ */
+#define MAX_BREAKPOINTS 16
+
+typedef enum { BREAK_PC, BREAK_CYCLE, BREAK_WATCH } break_kind_t;
+
+typedef struct {
+    break_kind_t kind;
+    word_t value;           /* PC, cycle or watched address */
+    word_t old;             /* last value seen at a watched address */
+} breakpoint_t;
+
+static breakpoint_t breakpoints[MAX_BREAKPOINTS];
+static int breakpoint_count = 0;
+
+static void add_breakpoint(break_kind_t kind, word_t value)
+{
+    if (breakpoint_count == MAX_BREAKPOINTS) {
+        printf("Too many breakpoints (at most %d)\n", MAX_BREAKPOINTS);
+        return;
+    }
+    breakpoints[breakpoint_count].kind = kind;
+    breakpoints[breakpoint_count].value = value;
+    breakpoint_count++;
+    printf("Breakpoint %d set\n", breakpoint_count);
+}
+
+static void list_breakpoints()
+{
+    static const char *kinds[] = { "pc", "cycle", "watch" };
+    if (breakpoint_count == 0)
+        printf("No breakpoints\n");
+    for (int i = 0; i < breakpoint_count; i++) {
+        if (breakpoints[i].kind == BREAK_CYCLE)
+            printf("%d: cycle %lld\n", i + 1, breakpoints[i].value);
+        else
+            printf("%d: %s 0x%llx\n", i + 1, kinds[breakpoints[i].kind], breakpoints[i].value);
+    }
+}
+
+/* Run until a breakpoint fires or the program stops */
+static void run_to_breakpoint(word_t *icount, word_t *ccount, byte_t *run_status, cc_t *ccp)
+{
+    word_t icount_stored = *icount, ccount_stored = *ccount;
+    word_t last_pc = f_pc;
+    int hit = -1;
+
+    if (*run_status != STAT_AOK && *run_status != STAT_BUB) {
+        printf("Simulator is in a non AOK state\n");
+        return;
+    }
+    /* back needs somewhere to re-simulate from if nothing ran before */
+    if (snapshot_count == 0)
+        take_snapshot(*icount, *ccount, *run_status);
+    for (int i = 0; i < breakpoint_count; i++) {
+        if (breakpoints[i].kind == BREAK_WATCH)
+            get_word_val(mem, breakpoints[i].value, &breakpoints[i].old);
+    }
+
+    FILE *saved_dumpfile = dumpfile;
+    dumpfile = NULL;
+    while (hit < 0 && (*run_status == STAT_AOK || *run_status == STAT_BUB)) {
+        sim_run_cycle(icount, ccount, run_status, ccp);
+        for (int i = 0; i < breakpoint_count && hit < 0; i++) {
+            breakpoint_t *b = &breakpoints[i];
+            word_t val;
+            switch (b->kind) {
+            case BREAK_PC:
+                if (f_pc == b->value && last_pc != b->value)
+                    hit = i;
+                break;
+            case BREAK_CYCLE:
+                if (*ccount == b->value)
+                    hit = i;
+                break;
+            case BREAK_WATCH:
+                if (get_word_val(mem, b->value, &val) && val != b->old) {
+                    printf("Watched 0x%llx changed from 0x%llx to 0x%llx\n", b->value, b->old, val);
+                    b->old = val;
+                    hit = i;
+                }
+                break;
+            }
+        }
+        last_pc = f_pc;
+    }
+    dumpfile = saved_dumpfile;
+
+    /* History restarts here; older cycles come back through the snapshots */
+    free_restore_points();
+    int i = find_snapshot(*ccount);
+    if (i < 0 || snapshots[i].cycles != *ccount)
+        take_snapshot(*icount, *ccount, *run_status);
+    restore_base = *ccount;
+
+    printf("Simulator ran %lld instructions in %lld cycles\n", *icount - icount_stored, *ccount - ccount_stored);
+    if (hit >= 0)
+        printf("Stopped at breakpoint %d\n", hit + 1);
+    else
+        printf("Simulator ran to completion\n");
+    print_state(*ccount);
+}
+
+/*
+ * Handle the breakpoint commands: break pc|cycle n, watch addr, delete n,
+ * breakpoints and run. Returns false if command is not one of them.
+ */
+static bool breakpoint_command(char *command, word_t *icount, word_t *ccount, byte_t *run_status, cc_t *ccp)
+{
+    char kind[20];
+    word_t value;
+    int n;
+
+    if (!strcmp(command, "break")) {
+        if (scanf("%19s %lli", kind, &value) != 2)
+            printf("Usage: break pc|cycle n\n");
+        else if (!strcmp(kind, "pc"))
+            add_breakpoint(BREAK_PC, value);
+        else if (!strcmp(kind, "cycle"))
+            add_breakpoint(BREAK_CYCLE, value);
+        else
+            printf("Unknown breakpoint type '%s'\n", kind);
+    } else if (!strcmp(command, "watch")) {
+        word_t val;
+        if (scanf("%lli", &value) != 1 || !get_word_val(mem, value, &val))
+            printf("Usage: watch addr\n");
+        else
+            add_breakpoint(BREAK_WATCH, value);
+    } else if (!strcmp(command, "delete")) {
+        if (scanf("%d", &n) != 1 || n < 1 || n > breakpoint_count) {
+            printf("No such breakpoint\n");
+        } else {
+            memmove(&breakpoints[n - 1], &breakpoints[n], (breakpoint_count - n) * sizeof(breakpoint_t));
+            breakpoint_count--;
+        }
+    } else if (!strcmp(command, "breakpoints")) {
+        list_breakpoints();
+    } else if (!strcmp(command, "run")) {
+        run_to_breakpoint(icount, ccount, run_status, ccp);
+    } else {
+        return false;
+    }
+    return true;
+}
+
 void sim_interactive()
 {
     word_t ccount = 0, icount = 0, ucount = 0;
@@ -1544,8 +3363,8 @@ void sim_interactive()
     mem_t mem0, reg0;
     mem0 = copy_mem(mem);
     reg0 = copy_mem(reg);
-
-    pipe_cache_restore_t *restore_head = NULL;
+    history_mem0 = mem0;
+    history_reg0 = reg0;
 
     char buffer[20];
     char stage_buffer[20];
@@ -1559,6 +3378,8 @@ void sim_interactive()
             buffer[0] = 'x';
         }
         printf("\n");
+        if (breakpoint_command(buffer, &icount, &ccount, &run_status, &curr_cc))
+            continue;
 
         switch(buffer[0]) {
         case 'G':
@@ -1567,9 +3388,7 @@ void sim_interactive()
                 ccount_stored = ccount;
                 icount_stored = icount;
                 while ((run_status == STAT_AOK || run_status == STAT_BUB)) {
-                    pipe_cache_restore_t *new_restore_point = create_pipe_cache_restore_point(&icount, &ccount, &run_status, &curr_cc);
-                    new_restore_point->next = restore_head;
-                    restore_head = new_restore_point;
+                    history_step(&icount, &ccount, &run_status, &curr_cc);
                 }
 
                 printf("Simulator ran %lld instructions in %lld cycles\n", icount - icount_stored, ccount - ccount_stored);
@@ -1601,9 +3420,7 @@ void sim_interactive()
                 icount_stored = icount;
                 ccount_stored = ccount;
                 while ((run_status == STAT_AOK || run_status == STAT_BUB) && icount - icount_stored < instructions_to_run) {
-                    pipe_cache_restore_t *new_restore_point = create_pipe_cache_restore_point(&icount, &ccount, &run_status, &curr_cc);
-                    new_restore_point->next = restore_head;
-                    restore_head = new_restore_point;
+                    history_step(&icount, &ccount, &run_status, &curr_cc);
                 }
 
                 printf("Simulator ran %lld instructions in %lld cycles\n", icount - icount_stored, ccount - ccount_stored);
@@ -1628,9 +3445,7 @@ void sim_interactive()
                 icount_stored = icount;
                 ccount_stored = ccount;
                 while ((run_status == STAT_AOK || run_status == STAT_BUB) && ccount - ccount_stored < cycles_to_run) {
-                    pipe_cache_restore_t *new_restore_point = create_pipe_cache_restore_point(&icount, &ccount, &run_status, &curr_cc);
-                    new_restore_point->next = restore_head;
-                    restore_head = new_restore_point;
+                    history_step(&icount, &ccount, &run_status, &curr_cc);
                 }
 
                 printf("Simulator ran %lld instructions in %lld cycles\n", icount - icount_stored, ccount - ccount_stored);
@@ -1663,17 +3478,15 @@ void sim_interactive()
             ucount = 0;
             icount_stored = icount;
             ccount_stored = ccount;
-            while (restore_head != NULL && (icount_stored - icount) < instructions_to_undo) {
-                cc = restore_head->state.cc;
-                icount = restore_head->state.icount;
-                ccount = restore_head->cycles;
-                apply_restore(mem, restore_head->state.memory);
-                apply_restore(reg, restore_head->state.registers);
-                status = restore_head->state.status;
-                run_status = status;
-                pipe_cache_restore_t *temp = restore_head;
-                restore_head = restore_head->next;
-                restore_pipes_and_free(temp);
+            while ((icount_stored - icount) < instructions_to_undo) {
+                /* Out of restore points: rebuild them from the previous snapshot */
+                if (restore_head == NULL) {
+                    if (ccount == 0)
+                        break;
+                    history_rewind(ccount - 1, &icount, &ccount, &run_status, &curr_cc);
+                } else {
+                    history_pop(&icount, &ccount, &run_status);
+                }
                 ucount++;
             }
             printf("Instructions undone: %lld Cycles undone: %lld\n", icount_stored - icount, ccount_stored - ccount);
@@ -1694,19 +3507,8 @@ void sim_interactive()
             ucount = 0;
             ccount_stored = ccount;
             icount_stored = icount;
-            while (restore_head != NULL && (ccount_stored - ccount) < cycles_to_undo) {
-                cc = restore_head->state.cc;
-                icount = restore_head->state.icount;
-                ccount = restore_head->cycles;
-                apply_restore(mem, restore_head->state.memory);
-                apply_restore(reg, restore_head->state.registers);
-                status = restore_head->state.status;
-                run_status = status;
-                pipe_cache_restore_t *temp = restore_head;
-                restore_head = restore_head->next;
-                restore_pipes_and_free(temp);
-                ucount++;
-            }
+            history_rewind(cycles_to_undo < ccount ? ccount - cycles_to_undo : 0,
+                           &icount, &ccount, &run_status, &curr_cc);
             printf("Instructions undone: %lld Cycles undone: %lld\n", icount_stored - icount, ccount_stored - ccount);
             print_state(ccount);
             dump_reg_display(stdout, reg);
@@ -0,0 +1,43 @@
+/**************************************************************************
+ * libpsim.h - Run PIPE simulations from another program
+ *
+ * Build psim.c and isa.c into a shared library (cc -DLIBPSIM -shared -fPIC)
+ * and link against it. A simulation lives in the thread-local state of
+ * the thread that created its context: every call on a context must come
+ * from that thread, and a thread hosts one context at a time. Simulations
+ * on different threads run concurrently.
+ **************************************************************************/
+
+#ifndef LIBPSIM_H
+#define LIBPSIM_H
+
+#include "isa.h"
+
+typedef struct sim_ctx sim_ctx;
+
+typedef struct {
+    word_t cycles;          /* as counted for the CPI report */
+    word_t instructions;
+    stat_t status;          /* STAT_AOK until the program stops */
+    cc_t cc;
+} sim_stats_t;
+
+/* New simulator with empty memory, NULL if this thread already has one */
+sim_ctx *sim_ctx_create();
+
+/* Load a .yo listing or a binary object. Returns the bytes loaded, 0 on error */
+word_t sim_ctx_load(sim_ctx *ctx, const char *filename);
+
+/* Same for the len bytes of a listing or binary object at buf */
+word_t sim_ctx_load_buffer(sim_ctx *ctx, const void *buf, size_t len);
+
+/* Simulate at most max_cycles more cycles. Returns the status afterwards */
+stat_t sim_ctx_run(sim_ctx *ctx, word_t max_cycles);
+
+void sim_ctx_stats(sim_ctx *ctx, sim_stats_t *stats);
+word_t sim_ctx_reg(sim_ctx *ctx, reg_id_t id);
+bool sim_ctx_mem(sim_ctx *ctx, word_t addr, word_t *val);
+
+void sim_ctx_destroy(sim_ctx *ctx);
+
+#endif /* LIBPSIM_H */
@@ -12,11 +12,26 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #include "isa.h"
 #include "pipeline.h"
 #include "stages.h"
 #include "sim.h"
+#include "trace.h"
+#include "yobj.h"
+#include "libpsim.h"
 
 char simname[] = "Y86-64 Processor: PIPE";
 
@@ -25,18 +40,64 @@ char *object_filename;   /* The input object file name. */
 FILE *object_file;       /* Input file handle */
 int verbosity = 2;    /* Verbosity level [Non interactive Mode only] (-v) */
 word_t instr_limit = 10000; /* Instruction limit [Non interactive Mode only] (-l) */
+word_t snapshot_interval = 1000; /* Cycles between snapshots [Interactive Mode only] (-k) */
+size_t history_budget = 64 << 20; /* Bytes of snapshots kept [Interactive Mode only] (-K, in MB) */
+char *trace_filename = NULL; /* Binary event trace file [Non interactive Mode only] (-B) */
+bool result_resim = false; /* Simulate even if the result cache has the run [TTY only] (-R) */
+static char result_flags[1024]; /* The options, part of the result cache key */
+char *batch_manifest = NULL; /* Programs to run in parallel [Batch Mode only] (-M) */
+bool batch_json = false; /* Report batch results as JSON instead of CSV (-J) */
+char *server_socket = NULL; /* Unix socket to serve simulation requests on [Server Mode only] (-S) */
+word_t ff_limit = 0; /* Instructions to fast-forward before the pipeline [Non interactive Mode only] (-F) */
+int ras_depth = 0; /* Return address stack entries, 0 for none (-A) */
 
 /* Log file */
 FILE *dumpfile = NULL;
 
-/* Performance monitoring */
-/* How many cycles have been simulated? */
-word_t cycles = 0;
-/* How many instructions have passed through the WB stage? */
-word_t instructions = 0;
+/*
+ * The state of the simulation itself is thread-local, so every thread can
+ * host a simulator of its own (see libpsim.h). The TTY and interactive
+ * front ends run one simulation on the main thread; their tracing, ISA
+ * check and history state below stays global.
+ */
+#define SIM_LOCAL __thread
+
+static SIM_LOCAL word_t entry_pc = 0;  /* Initial PC, set by binary object files */
+
+/*
+ * Trace points. TRACE_LEVEL decides at compile time which ones exist:
+ * 0 none, 1 the per-cycle pipeline state, 2 also stage events, 3 also
+ * forwarding and stall decisions. trace_mask picks categories at run time.
+ * The arguments are only evaluated when the trace point is enabled and
+ * there is a dumpfile, so -v 0 never formats anything.
+ */
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 2
+#endif
+
+#define TRACE_STATE     0x01
+#define TRACE_FETCH     0x02
+#define TRACE_DECODE    0x04
+#define TRACE_EXECUTE   0x08
+#define TRACE_MEMORY    0x10
+#define TRACE_WRITEBACK 0x20
+#define TRACE_CONTROL   0x40
+#define TRACE_ALL       0x7f
+
+static const char *trace_names[] = {
+    "state", "fetch", "decode", "execute", "memory", "writeback", "control"
+};
+
+int trace_mask = TRACE_ALL; /* Trace categories logged (-T) */
+
+#define TRACE(level, category, ...) \
+    do { \
+        if (TRACE_LEVEL >= (level) && (trace_mask & (category)) && dumpfile) \
+            sim_log(__VA_ARGS__); \
+    } while (0)
 
 /* Has simulator gotten past initial bubbles? */
-static int starting_up = 1;
+static SIM_LOCAL int starting_up = 1;
 
 
 
@@ -50,61 +111,98 @@ static int starting_up = 1;
  * word_t is 8 bytes, mem_t is an array of bytes you can treat as an emulation of
  * memory or registers, cc_t are the condition codes, and stat_t is the machine
  * status. The remaining pipeline stage structs you can see declared in stages.h.
+ *
+ * The lab headers may declare these names as ordinary globals, and a thread-local
+ * definition cannot follow such a declaration, so they live in one thread-local
+ * struct instead: the stages use sim.mem, sim.cc, sim.decode_input and so on.
  **********************************************************************************/
 
-/* Both instruction and data memory */
-mem_t mem;
-/* Register file */
-mem_t reg;
-
-/* Condition code register */
-cc_t cc;
-/* Status code */
-stat_t status;
-
-/* Pending updates to state */
-word_t cc_in    = DEFAULT_CC;
-word_t wb_destE = REG_NONE;
-word_t wb_valE  = 0;
-word_t wb_destM = REG_NONE;
-word_t wb_valM  = 0;
-word_t mem_addr = 0;
-word_t mem_data = 0;
-bool mem_write  = false;
-bool mem_read   = false;
-
-/* Output and input states of all pipeline registers */
-fetch_ptr fetch_output;
-decode_ptr decode_output;
-execute_ptr execute_output;
-memory_ptr memory_output;
-writeback_ptr writeback_output;
-
-fetch_ptr fetch_input;
-decode_ptr decode_input;
-execute_ptr execute_input;
-memory_ptr memory_input;
-writeback_ptr writeback_input;
-
-/* Intermediate values */
-word_t f_pc;
-byte_t imem_icode;
-byte_t imem_ifun;
-bool imem_error;
-bool instr_valid;
-word_t d_regvala;
-word_t d_regvalb;
-word_t e_vala;
-word_t e_valb;
-bool e_bcond;
-bool dmem_error;
-
-/* The pipeline state */
-pipe_ptr fetch_state, decode_state, execute_state, memory_state, writeback_state;
-
-
-
-
+typedef struct {
+    /* Performance monitoring */
+    word_t cycles;          /* How many cycles have been simulated? */
+    word_t instructions;    /* How many instructions have passed through the WB stage? */
+
+    /* Both instruction and data memory */
+    mem_t mem;
+    /* Register file */
+    mem_t reg;
+
+    /* Condition code register */
+    cc_t cc;
+    /* Status code */
+    stat_t status;
+
+    /* Pending updates to state */
+    word_t cc_in;
+    word_t wb_destE;
+    word_t wb_valE;
+    word_t wb_destM;
+    word_t wb_valM;
+    word_t mem_addr;
+    word_t mem_data;
+    bool mem_write;
+    bool mem_read;
+
+    /* Output and input states of all pipeline registers */
+    fetch_ptr fetch_output;
+    decode_ptr decode_output;
+    execute_ptr execute_output;
+    memory_ptr memory_output;
+    writeback_ptr writeback_output;
+
+    fetch_ptr fetch_input;
+    decode_ptr decode_input;
+    execute_ptr execute_input;
+    memory_ptr memory_input;
+    writeback_ptr writeback_input;
+
+    /* Intermediate values */
+    word_t f_pc;
+    byte_t imem_icode;
+    byte_t imem_ifun;
+    bool imem_error;
+    bool instr_valid;
+    word_t d_regvala;
+    word_t d_regvalb;
+    word_t e_vala;
+    word_t e_valb;
+    bool e_bcond;
+    bool dmem_error;
+
+    /* The pipeline state */
+    pipe_ptr fetch_state, decode_state, execute_state, memory_state, writeback_state;
+} sim_state_t;
+
+static SIM_LOCAL sim_state_t sim = {
+    .cc_in = DEFAULT_CC,
+    .wb_destE = REG_NONE,
+    .wb_destM = REG_NONE,
+};
+
+static SIM_LOCAL byte_t d_fwd_a;     /* trace_fwd_t sources of decode's valA and valB */
+static SIM_LOCAL byte_t d_fwd_b;
+static SIM_LOCAL bool m_ret_miss;    /* the ret in M was predicted to go elsewhere */
+
+/* Return address stack position, enough to undo what later fetches did */
+typedef struct {
+    int pos;                /* next free entry */
+    int count;              /* valid entries below pos */
+    word_t top;             /* the entry below pos */
+} ras_mark_t;
+
+/* The branch prediction that rides along with the instruction in D, E, M and W */
+typedef struct {
+    bool taken;             /* fetch guessed the jump taken */
+    bool ras;               /* fetch predicted the ret's target from the RAS */
+    word_t other;           /* where fetch would have gone otherwise, or the ret target */
+    word_t hist;            /* global history the guess was made with */
+    ras_mark_t mark;        /* the RAS just after this instruction's fetch */
+} pred_ele, *pred_ptr;
+
+static pred_ele bubble_pred = { false, false, 0, 0, { 0, 0, 0 } };
+
+/* Side pipe registers holding them, stalled and bubbled like D, E, M and W */
+static SIM_LOCAL pipe_ptr pred_state[4];
 
 /***************************
  * Begin function prototypes
@@ -112,13 +210,175 @@ pipe_ptr fetch_state, decode_state, execute_state, memory_state, writeback_state
 
 word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
 static void usage(char *name);           /* Print helpful usage message */
-static void run_tty_sim();               /* Run simulator in TTY mode */
+static bool run_tty_sim();               /* Run simulator in TTY mode */
+static bool simulate_tty();              /* run_tty_sim() without the result cache */
+static int parse_trace_mask(char *list); /* Trace categories named in list */
+static bool bp_configure(char *spec);    /* Select the branch predictor of -P */
+static void bp_reset();                  /* Forget everything the predictor learned */
+static void bp_advance();                /* Move predictions along with their instructions */
+static void bp_report(FILE *out);        /* Print per-branch prediction accuracy */
+static word_t load_object(mem_t m, FILE *f); /* Load a .yo listing or a binary object */
+static void trace_open(char *filename);  /* Start the binary trace writer */
+static void trace_close();               /* Flush and close the binary trace */
+static void predecode_flush();           /* Forget all predecoded instructions */
+static void predecode_write(word_t pos, int len); /* Forget those a write overlaps */
+static word_t fast_forward(word_t max_instr, word_t *pcp); /* Run instructions functionally */
+static void check_start(state_ptr isa_state, word_t skip); /* Start the concurrent ISA check */
+static word_t check_finish(stat_t *statusp); /* Wait for the ISA check to catch up */
+static const char *check_divergence();   /* Why the ISA check failed, or NULL */
+static bool run_batch(char *manifest);   /* Run every program of a manifest */
+static void run_server(char *path);      /* Serve simulation requests on a socket */
 static void sim_interactive();
 
 /*************************
  * End function prototypes
  *************************/
 
+/*
+ * Undo log for interactive mode. While a restore point is being recorded,
+ * memory and register writes first save the bytes they overwrite, so a
+ * restore point only costs what its cycle actually wrote.
+ */
+static memory_restore_t *mem_undo = NULL;
+static memory_restore_t *reg_undo = NULL;
+
+/*
+ * Dirty pages of a TTY run. The first pipeline write to a page saves its
+ * original contents, so the initial memory image is copy-on-write, and
+ * the diffs at the end of the run only visit pages either the pipeline
+ * or the ISA model wrote.
+ */
+#define DIRTY_PAGE_BITS 12
+#define DIRTY_PAGE_SIZE (1 << DIRTY_PAGE_BITS)
+
+static word_t dirty_pages = 0;          /* 0 while not tracking */
+static byte_t *pipe_dirty = NULL;       /* nonzero for pages the pipeline wrote */
+static byte_t *isa_dirty = NULL;        /* nonzero for pages the ISA model wrote */
+static byte_t **mem0_pages = NULL;      /* original contents of pipeline dirty pages */
+
+static void dirty_start()
+{
+    dirty_pages = (sim.mem->len + DIRTY_PAGE_SIZE - 1) >> DIRTY_PAGE_BITS;
+    pipe_dirty = calloc(dirty_pages, 1);
+    isa_dirty = calloc(dirty_pages, 1);
+    mem0_pages = calloc(dirty_pages, sizeof(byte_t *));
+}
+
+/* Note a pipeline write of the 8 bytes at pos, before it happens */
+static inline void mem_dirty(word_t pos)
+{
+    if (dirty_pages == 0 || pos < 0 || pos + 8 > sim.mem->len)
+        return;
+    for (word_t p = pos >> DIRTY_PAGE_BITS; p <= (pos + 7) >> DIRTY_PAGE_BITS; p++) {
+        if (pipe_dirty[p])
+            continue;
+        word_t base = p << DIRTY_PAGE_BITS;
+        word_t len = sim.mem->len - base < DIRTY_PAGE_SIZE ? sim.mem->len - base : DIRTY_PAGE_SIZE;
+        mem0_pages[p] = malloc(len);
+        memcpy(mem0_pages[p], sim.mem->contents + base, len);
+        pipe_dirty[p] = 1;
+    }
+}
+
+/* step_state(), noting the pages the instruction at the ISA PC writes */
+static stat_t isa_step(state_ptr s, FILE *error_file)
+{
+    byte_t code, regs;
+    word_t addr, valc;
+
+    if (dirty_pages > 0 && get_byte_val(s->m, s->pc, &code)) {
+        addr = -1;
+        switch (HI4(code)) {
+        case I_RMMOVQ:
+            if (get_byte_val(s->m, s->pc + 1, &regs) && get_word_val(s->m, s->pc + 2, &valc))
+                addr = get_reg_val(s->r, LO4(regs)) + valc;
+            break;
+        case I_CALL:
+        case I_PUSHQ:
+            addr = get_reg_val(s->r, REG_RSP) - 8;
+            break;
+        }
+        if (addr >= 0 && addr + 8 <= s->m->len) {
+            isa_dirty[addr >> DIRTY_PAGE_BITS] = 1;
+            isa_dirty[(addr + 7) >> DIRTY_PAGE_BITS] = 1;
+        }
+    }
+    return step_state(s, error_file);
+}
+
+/*
+ * diff_mem() over the dirty pages only. oldm NULL compares against the
+ * memory image the run started with.
+ */
+static bool diff_dirty(mem_t oldm, mem_t newm, FILE *outfile)
+{
+    bool diff = false;
+
+    for (word_t p = 0; p < dirty_pages && (!diff || outfile); p++) {
+        if (!pipe_dirty[p] && !isa_dirty[p])
+            continue;
+        if (oldm == NULL && mem0_pages[p] == NULL)
+            continue;
+        word_t base = p << DIRTY_PAGE_BITS;
+        for (word_t pos = base; pos < base + DIRTY_PAGE_SIZE && pos < newm->len; pos += 8) {
+            word_t ov = 0, nv = 0;
+            if (oldm == NULL) {
+                for (int i = 7; i >= 0; i--)
+                    ov = (ov << 8) | mem0_pages[p][pos - base + i];
+            } else {
+                get_word_val(oldm, pos, &ov);
+            }
+            get_word_val(newm, pos, &nv);
+            if (ov != nv) {
+                diff = true;
+                if (outfile)
+                    fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos, ov, nv);
+                else
+                    break;
+            }
+        }
+    }
+    return diff;
+}
+
+
+
+
+
+/* Save the old values of the 8 bytes at pos that this cycle has not saved yet */
+static void log_old_word(memory_restore_t *r, mem_t m, word_t pos)
+{
+    if (r == NULL)
+        return;
+    r->positions = realloc(r->positions, (r->count + 8) * sizeof(word_t));
+    r->values = realloc(r->values, r->count + 8);
+    for (word_t a = pos; a < pos + 8; a++) {
+        bool seen = false;
+        for (int i = 0; i < r->count && !seen; i++)
+            seen = r->positions[i] == a;
+        if (!seen && get_byte_val(m, a, &r->values[r->count]))
+            r->positions[r->count++] = a;
+    }
+}
+
+static bool set_word_val_logged(mem_t m, word_t pos, word_t val)
+{
+    log_old_word(mem_undo, m, pos);
+    mem_dirty(pos);
+    if (!set_word_val(m, pos, val))
+        return false;
+    predecode_write(pos, 8);
+    return true;
+}
+
+static void set_reg_val_logged(mem_t r, reg_id_t id, word_t val)
+{
+    if (id < REG_NONE)
+        log_old_word(reg_undo, r, id * 8);
+    set_reg_val(r, id, val);
+}
+
+
 
 /*******************************************************************
  * Part 1: This part is the initial entry point that handles general
@@ -139,11 +399,14 @@ int sim_main(int argc, char **argv)
     int interactive = 0;
 
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "hil:v:")) != -1) {
+    while ((c = getopt(argc, argv, "hik:K:l:v:B:F:T:M:JS:RP:A:")) != -1) {
         switch(c) {
         case 'h':
             usage(argv[0]);
             break;
+        case 'R':
+            result_resim = true;
+            break;
         case 'l':
             instr_limit = atoll(optarg);
             break;
@@ -157,6 +420,57 @@ int sim_main(int argc, char **argv)
         case 'i':
             interactive = true;
             break;
+        case 'B':
+            trace_filename = optarg;
+            break;
+        case 'F':
+            ff_limit = atoll(optarg);
+            break;
+        case 'M':
+            batch_manifest = optarg;
+            break;
+        case 'J':
+            batch_json = true;
+            break;
+        case 'S':
+            server_socket = optarg;
+            break;
+        case 'P':
+            if (!bp_configure(optarg)) {
+                printf("Invalid branch predictor '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'A':
+            ras_depth = atoi(optarg);
+            if (ras_depth < 1) {
+                printf("Invalid return address stack depth %d\n", ras_depth);
+                usage(argv[0]);
+            }
+            break;
+        case 'T':
+            trace_mask = parse_trace_mask(optarg);
+            if (trace_mask < 0) {
+                printf("Invalid trace categories '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            snapshot_interval = atoll(optarg);
+            if (snapshot_interval < 1) {
+                printf("Invalid snapshot interval %lld\n", snapshot_interval);
+                usage(argv[0]);
+            }
+            break;
+        case 'K': {
+            word_t mb = atoll(optarg);
+            if (mb < 1) {
+                printf("Invalid snapshot budget %lld MB\n", mb);
+                usage(argv[0]);
+            }
+            history_budget = (size_t) mb << 20;
+            break;
+        }
         default:
             printf("Invalid option '%c'\n", c);
             usage(argv[0]);
@@ -165,6 +479,19 @@ int sim_main(int argc, char **argv)
     }
 
 
+    if (batch_manifest)
+        exit(run_batch(batch_manifest) ? 0 : 1);
+    if (server_socket)
+        run_server(server_socket);
+
+    /* Every option but -R is part of the result cache key */
+    for (i = 1; i < optind; i++) {
+        if (strcmp(argv[i], "-R")) {
+            strncat(result_flags, argv[i], sizeof(result_flags) - strlen(result_flags) - 1);
+            strncat(result_flags, " ", sizeof(result_flags) - strlen(result_flags) - 1);
+        }
+    }
+
     /* Do we have too many arguments? */
     if (optind < argc - 1) {
 	printf("Too many command line arguments:");
@@ -194,24 +521,167 @@ int sim_main(int argc, char **argv)
 
     if (interactive) {
         sim_interactive();
-    } else {
-        run_tty_sim();
+    } else if (!run_tty_sim()) {
+        exit(1);
     }
     exit(0);
 }
 
+#ifndef LIBPSIM
 int main(int argc, char *argv[]){return sim_main(argc,argv);}
+#endif
+
+/*
+ * Result cache. A TTY run below -v 2 is keyed by an FNV-1a hash of the
+ * simulator build, its options and the object file contents. Its output
+ * and ISA check result are stored under that key in $Y86_RESULT_CACHE
+ * (default ~/.cache/y86sim) and replayed when the same run comes again.
+ * The build is the executable as a whole, so relinking against a changed
+ * ISA model is a new build as well; -DBUILD_ID=\"...\" names it instead.
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * FNV_PRIME;
+    return h;
+}
+
+/* Hash the build into h. Returns false if it can't be identified */
+static bool result_build(uint64_t *h)
+{
+#ifdef BUILD_ID
+    *h = fnv1a(*h, BUILD_ID, sizeof(BUILD_ID));
+    return true;
+#else
+    char buf[1 << 16];
+    size_t n;
+    FILE *exe = fopen("/proc/self/exe", "rb");
+
+    if (!exe)
+        return false;
+    while ((n = fread(buf, 1, sizeof(buf), exe)) > 0)
+        *h = fnv1a(*h, buf, n);
+    fclose(exe);
+    return true;
+#endif
+}
+
+/* Name the cache file of this run in path. Returns false if the run can't be cached */
+static bool result_path(char *path, size_t size)
+{
+    char dir[4096];
+    char buf[1 << 16];
+    size_t n;
+    uint64_t h = FNV_OFFSET;
+
+    if (getenv("Y86_RESULT_CACHE")) {
+        snprintf(dir, sizeof(dir), "%s", getenv("Y86_RESULT_CACHE"));
+    } else if (getenv("HOME")) {
+        snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME"));
+        mkdir(dir, 0755);
+        strncat(dir, "/y86sim", sizeof(dir) - strlen(dir) - 1);
+    } else {
+        return false;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return false;
+
+    h = fnv1a(h, simname, sizeof(simname));
+    if (!result_build(&h))
+        return false;
+    h = fnv1a(h, result_flags, strlen(result_flags) + 1);
+    while ((n = fread(buf, 1, sizeof(buf), object_file)) > 0)
+        h = fnv1a(h, buf, n);
+    rewind(object_file);
+    snprintf(path, size, "%s/%016llx", dir, (unsigned long long) h);
+    return true;
+}
+
+/* Print the stored output of a run. Returns false if there is none */
+static bool result_replay(const char *path, bool *match)
+{
+    char buf[1 << 16];
+    size_t n;
+    FILE *f = fopen(path, "rb");
+    int c;
+
+    if (!f)
+        return false;
+    c = fgetc(f);
+    if (c != '0' && c != '1') {
+        fclose(f);
+        return false;
+    }
+    *match = c == '1';
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        fwrite(buf, 1, n, stdout);
+    fclose(f);
+    fclose(object_file);
+    return true;
+}
+
+/*
+ * run_tty_sim - Run the simulator in TTY mode, or replay the result of
+ * an identical earlier run
+ */
+static bool run_tty_sim()
+{
+    char path[4200], tmp_path[4300];
+    char buf[1 << 16];
+    size_t n;
+    bool match;
+    FILE *out, *f;
+    int saved;
+
+    if (verbosity >= 2 || trace_filename || !result_path(path, sizeof(path)))
+        return simulate_tty();
+    if (!result_resim && result_replay(path, &match))
+        return match;
+
+    /* Capture what the simulation prints */
+    if ((out = tmpfile()) == NULL)
+        return simulate_tty();
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(fileno(out), STDOUT_FILENO);
+    match = simulate_tty();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+    f = fopen(tmp_path, "wb");
+    if (f)
+        fputc(match ? '1' : '0', f);
+    rewind(out);
+    while ((n = fread(buf, 1, sizeof(buf), out)) > 0) {
+        fwrite(buf, 1, n, stdout);
+        if (f)
+            fwrite(buf, 1, n, f);
+    }
+    if (f && fclose(f) == 0)
+        rename(tmp_path, path);
+    else
+        unlink(tmp_path);
+    fclose(out);
+    return match;
+}
 
 /*
- * run_tty_sim - Run the simulator in TTY mode
+ * simulate_tty - Simulate the program in TTY mode
  */
-static void run_tty_sim()
+static bool simulate_tty()
 {
     word_t icount = 0;
+    word_t ff_count = 0;
     byte_t run_status = STAT_AOK;
     cc_t result_cc = 0;
     word_t byte_cnt = 0;
-    mem_t mem0, reg0;
+    mem_t reg0;
     state_ptr isa_state = NULL;
 
     if (verbosity >= 2)
@@ -222,7 +692,7 @@ static void run_tty_sim()
     if (verbosity >= 2)
 	    printf("%s\n", simname);
 
-    byte_cnt = load_mem(mem, object_file, 1);
+    byte_cnt = load_object(sim.mem, object_file);
     if (byte_cnt == 0) {
 	    fprintf(stderr, "No lines of code found\n");
 	    exit(1);
@@ -230,62 +700,89 @@ static void run_tty_sim()
 	    printf("%lld bytes of code read\n", byte_cnt);
     }
     fclose(object_file);
+    sim.fetch_input->predPC = sim.fetch_output->predPC = entry_pc;
 
     isa_state = new_state(0);
     free_mem(isa_state->r);
     free_mem(isa_state->m);
-    isa_state->m = copy_mem(mem);
-    isa_state->r = copy_mem(reg);
-    isa_state->cc = cc;
-
-    mem0 = copy_mem(mem);
-    reg0 = copy_mem(reg);
+    isa_state->m = copy_mem(sim.mem);
+    isa_state->r = copy_mem(sim.reg);
+    isa_state->cc = sim.cc;
+    isa_state->pc = entry_pc;
+
+    dirty_start();
+    reg0 = copy_mem(sim.reg);
+
+    /* The pipeline starts from empty at the PC the fast-forward stopped at */
+    if (ff_limit > 0) {
+        word_t pc;
+        ff_count = fast_forward(ff_limit, &pc);
+        sim.fetch_input->predPC = sim.fetch_output->predPC = pc;
+        predecode_flush();
+    }
 
+    check_start(isa_state, ff_count);
+    if (trace_filename)
+        trace_open(trace_filename);
     icount = sim_run_pipe(instr_limit, 5*instr_limit, &run_status, &result_cc);
+    if (trace_filename)
+        trace_close();
+    stat_t e;
+    word_t step = check_finish(&e);
     if (verbosity > 0) {
+        if (ff_limit > 0)
+            printf("%lld instructions fast-forwarded\n", ff_count);
         printf("%lld instructions executed\n", icount);
         printf("Status = %s\n", stat_name(run_status));
         printf("Condition Codes: %s\n", cc_name(result_cc));
         printf("Changed Register State:\n");
-        diff_reg(reg0, reg, stdout);
+        diff_reg(reg0, sim.reg, stdout);
         printf("Changed Memory State:\n");
-        diff_mem(mem0, mem, stdout);
+        diff_dirty(NULL, sim.mem, stdout);
     }
 
-    byte_t e = STAT_AOK;
-    word_t step;
     bool match = true;
 
-    for (step = 0; step < instr_limit && e == STAT_AOK; step++) {
-        e = step_state(isa_state, stdout);
-    }
-
-    if (diff_reg(isa_state->r, reg, NULL)) {
+    if (check_divergence()) {
         match = false;
-        if (verbosity > 0) {
-            printf("ISA Register != Pipeline Register File\n");
-            printf("\tISA register\t\tPipeline Register\n");
-            diff_reg(isa_state->r, reg, stdout);
+        if (verbosity > 0)
+            printf("%s\n", check_divergence());
+    } else {
+        /* Let the ISA model run past the last retired instruction, e.g. a halt */
+        for (; step < ff_count + instr_limit && e == STAT_AOK; step++)
+            e = isa_step(isa_state, verbosity > 0 ? stdout : NULL);
+
+        if (diff_reg(isa_state->r, sim.reg, NULL)) {
+            match = false;
+            if (verbosity > 0) {
+                printf("ISA Register != Pipeline Register File\n");
+                printf("\tISA register\t\tPipeline Register\n");
+                diff_reg(isa_state->r, sim.reg, stdout);
+            }
         }
-    }
 
-    if (diff_mem(isa_state->m, mem, NULL)) {
-        match = false;
-        if (verbosity > 0) {
-            printf("ISA Memory != Pipeline Memory\n");
-            printf("\tISA Memory\t\tPipeline Memory\n");
-            diff_mem(isa_state->m, mem, stdout);
+        if (diff_dirty(isa_state->m, sim.mem, NULL)) {
+            match = false;
+            if (verbosity > 0) {
+                printf("ISA Memory != Pipeline Memory\n");
+                printf("\tISA Memory\t\tPipeline Memory\n");
+                diff_dirty(isa_state->m, sim.mem, stdout);
+            }
         }
-    }
 
-    if (isa_state->cc != result_cc) {
-        match = false;
-        if (verbosity > 0) {
-            printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
-                cc_name(isa_state->cc), cc_name(result_cc));
+        if (isa_state->cc != result_cc) {
+            match = false;
+            if (verbosity > 0) {
+                printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
+                    cc_name(isa_state->cc), cc_name(result_cc));
+            }
         }
     }
 
+    /* With -v 0 the exit status is the only report */
+    if (verbosity == 0)
+        return match;
+
     if (match) {
         printf("ISA Check Succeeds\n");
     } else {
@@ -293,9 +790,11 @@ static void run_tty_sim()
     }
 
     /* Emit CPI statistics */
-	double cpi = instructions > 0 ? (double) cycles/instructions : 1.0;
+	double cpi = sim.instructions > 0 ? (double) sim.cycles/sim.instructions : 1.0;
 	printf("CPI: %lld cycles/%lld instructions = %.2f\n",
-	       cycles, instructions, cpi);
+	       sim.cycles, sim.instructions, cpi);
+    bp_report(stdout);
+    return match;
 }
 
 /*
@@ -303,14 +802,115 @@ static void run_tty_sim()
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-hi] [-l m] [-v n] file.yo\n", name);
+    printf("Usage: %s [-hi] [-l m] [-v n] file.yo|file.ybo\n", name);
     printf("   -h     Print this message\n");
     printf("   -l m   Set instruction limit to m [non interactive mode only] (default %lld)\n", instr_limit);
-    printf("   -v n   Set verbosity level to 0 <= n <= 2 [non interactive mode only] (default %d)\n", verbosity);
+    printf("   -v n   Set verbosity level to 0 <= n <= 2, 0 reports only through the exit status [non interactive mode only] (default %d)\n", verbosity);
+    printf("   -R     Simulate even if the result cache has this run [TTY mode only]\n");
     printf("   -i     Runs the simulator in interactive mode\n");
+    printf("   -k n   Snapshot every n cycles for going back [interactive mode only] (default %lld)\n", snapshot_interval);
+    printf("   -K n   Keep at most n MB of snapshots [interactive mode only] (default %d)\n", (int) (history_budget >> 20));
+    printf("   -F n   Execute the first n instructions functionally before simulating the pipeline [non interactive mode only]\n");
+    printf("   -B f   Write a binary event trace to f, read it with tracedump [non interactive mode only]\n");
+    printf("   -M f   Run the programs listed in manifest f on all cores and print a CSV report\n");
+    printf("   -J     Print the -M report as JSON\n");
+    printf("   -S f   Serve run/load requests on Unix socket f, answering each with a JSON line\n");
+    printf("   -T c,c Trace only categories c: state, fetch, decode, execute, memory, writeback, control (default all)\n");
+    printf("   -P p,n,b Predict jumps with p: taken (default), btfnt, bimodal, gshare or tournament, with 2^n counters (default 12) and a b entry BTB (default none), and report the accuracy\n");
+    printf("   -A n   Predict ret targets with an n entry return address stack and report its hits (default none)\n");
     exit(0);
 }
 
+/*
+ * parse_trace_mask - Turn a comma separated list of trace category names,
+ * or "all", into a trace_mask. Returns -1 on an unknown name.
+ */
+static int parse_trace_mask(char *list)
+{
+    int n = sizeof(trace_names) / sizeof(trace_names[0]);
+    int mask = 0;
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int i;
+        if (!strcmp(name, "all")) {
+            mask |= TRACE_ALL;
+            continue;
+        }
+        for (i = 0; i < n && strcmp(name, trace_names[i]); i++)
+            ;
+        if (i == n)
+            return -1;
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
+/* Whether the size bytes at image start like a binary object */
+static bool is_object_image(const byte_t *image, size_t size)
+{
+    return size >= sizeof(yobj_header_t) && !memcmp(image, YOBJ_MAGIC, sizeof(YOBJ_MAGIC));
+}
+
+/*
+ * Copy the segments of the binary object (yobj.h) held in the size bytes
+ * at image into m. Returns the number of bytes loaded, 0 on error.
+ */
+static word_t load_object_image(mem_t m, const byte_t *image, size_t size)
+{
+    yobj_header_t *header = (yobj_header_t *) image;
+    word_t count = 0;
+
+    if (header->version != YOBJ_VERSION) {
+        fprintf(stderr, "Can't read version %u object files\n", header->version);
+        return 0;
+    }
+    if (sizeof(*header) + header->nsegs * sizeof(yobj_segment_t) > size) {
+        fprintf(stderr, "Truncated object file\n");
+        return 0;
+    }
+
+    yobj_segment_t *segs = (yobj_segment_t *) (image + sizeof(*header));
+    for (uint32_t i = 0; i < header->nsegs; i++) {
+        if (segs[i].offset > (uint64_t) size || segs[i].size > (uint64_t) size - segs[i].offset) {
+            fprintf(stderr, "Truncated object file\n");
+            return 0;
+        }
+        if (segs[i].addr > (uint64_t) m->len || segs[i].size > (uint64_t) m->len - segs[i].addr) {
+            fprintf(stderr, "Segment at 0x%llx does not fit in memory\n", (word_t) segs[i].addr);
+            return 0;
+        }
+        memcpy(m->contents + segs[i].addr, image + segs[i].offset, segs[i].size);
+        count += segs[i].size;
+    }
+    entry_pc = header->entry;
+    return count;
+}
+
+/*
+ * Load a binary object by mapping the file, or pass a .yo listing on to
+ * load_mem(). Returns the number of bytes loaded, 0 on error.
+ */
+static word_t load_object(mem_t m, FILE *f)
+{
+    byte_t magic[sizeof(yobj_header_t)];
+    struct stat st;
+
+    if (fread(magic, sizeof(magic), 1, f) != 1 || !is_object_image(magic, sizeof(magic))) {
+        rewind(f);
+        return load_mem(m, f, 1);
+    }
+    if (fstat(fileno(f), &st) < 0) {
+        fprintf(stderr, "Couldn't stat object file\n");
+        return 0;
+    }
+    byte_t *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map object file\n");
+        return 0;
+    }
+    word_t count = load_object_image(m, image, st.st_size);
+    munmap(image, st.st_size);
+    return count;
+}
 
 /*********************************************************
  * Part 2: This part contains the core simulator routines.
@@ -327,11 +927,11 @@ void sim_bubble_stage(stage_id_t stage)
 {
     switch (stage)
 	{
-	case FETCH_STAGE     : fetch_state->op     = P_BUBBLE; break;
-	case DECODE_STAGE    : decode_state->op    = P_BUBBLE; break;
-	case EXECUTE_STAGE   : execute_state->op   = P_BUBBLE; break;
-	case MEMORY_STAGE    : memory_state->op    = P_BUBBLE; break;
-	case WRITEBACK_STAGE : writeback_state->op = P_BUBBLE; break;
+	case FETCH_STAGE     : sim.fetch_state->op     = P_BUBBLE; break;
+	case DECODE_STAGE    : sim.decode_state->op    = P_BUBBLE; break;
+	case EXECUTE_STAGE   : sim.execute_state->op   = P_BUBBLE; break;
+	case MEMORY_STAGE    : sim.memory_state->op    = P_BUBBLE; break;
+	case WRITEBACK_STAGE : sim.writeback_state->op = P_BUBBLE; break;
 	}
 }
 
@@ -339,48 +939,56 @@ void sim_bubble_stage(stage_id_t stage)
 void sim_stall_stage(stage_id_t stage) {
     switch (stage)
 	{
-	case FETCH_STAGE     : fetch_state->op     = P_STALL; break;
-	case DECODE_STAGE    : decode_state->op    = P_STALL; break;
-	case EXECUTE_STAGE   : execute_state->op   = P_STALL; break;
-	case MEMORY_STAGE    : memory_state->op    = P_STALL; break;
-	case WRITEBACK_STAGE : writeback_state->op = P_STALL; break;
+	case FETCH_STAGE     : sim.fetch_state->op     = P_STALL; break;
+	case DECODE_STAGE    : sim.decode_state->op    = P_STALL; break;
+	case EXECUTE_STAGE   : sim.execute_state->op   = P_STALL; break;
+	case MEMORY_STAGE    : sim.memory_state->op    = P_STALL; break;
+	case WRITEBACK_STAGE : sim.writeback_state->op = P_STALL; break;
 	}
 }
 
-static int initialized = 0;
+static SIM_LOCAL int initialized = 0;
+
+/* Point the stage aliases at the current slots of the pipe registers */
+static void connect_pipes()
+{
+    sim.fetch_input      = sim.fetch_state->input;
+    sim.fetch_output     = sim.fetch_state->output;
+
+    sim.decode_input     = sim.decode_state->input;
+    sim.decode_output    = sim.decode_state->output;
+
+    sim.execute_input    = sim.execute_state->input;
+    sim.execute_output   = sim.execute_state->output;
+
+    sim.memory_input     = sim.memory_state->input;
+    sim.memory_output    = sim.memory_state->output;
+
+    sim.writeback_input  = sim.writeback_state->input;
+    sim.writeback_output = sim.writeback_state->output;
+}
 
 void sim_init()
 {
     /* Create memory and register files */
     initialized = 1;
-    mem = init_mem(MEM_SIZE);
-    reg = init_reg();
+    sim.mem = init_mem(MEM_SIZE);
+    sim.reg = init_reg();
 
     /* create 5 pipe registers */
-    fetch_state     = new_pipe(sizeof(fetch_ele), (void *) &bubble_fetch);
-    decode_state    = new_pipe(sizeof(decode_ele), (void *) &bubble_decode);
-    execute_state   = new_pipe(sizeof(execute_ele), (void *) &bubble_execute);
-    memory_state    = new_pipe(sizeof(memory_ele), (void *) &bubble_memory);
-    writeback_state = new_pipe(sizeof(writeback_ele), (void *) &bubble_writeback);
+    sim.fetch_state     = new_pipe(sizeof(fetch_ele), (void *) &bubble_fetch);
+    sim.decode_state    = new_pipe(sizeof(decode_ele), (void *) &bubble_decode);
+    sim.execute_state   = new_pipe(sizeof(execute_ele), (void *) &bubble_execute);
+    sim.memory_state    = new_pipe(sizeof(memory_ele), (void *) &bubble_memory);
+    sim.writeback_state = new_pipe(sizeof(writeback_ele), (void *) &bubble_writeback);
+    for (int i = 0; i < 4; i++)
+        pred_state[i] = new_pipe(sizeof(pred_ele), (void *) &bubble_pred);
 
     /* connect them to the pipeline stages */
-    fetch_input      = fetch_state->input;
-    fetch_output     = fetch_state->output;
-
-    decode_input     = decode_state->input;
-    decode_output    = decode_state->output;
-
-    execute_input    = execute_state->input;
-    execute_output   = execute_state->output;
-
-    memory_input     = memory_state->input;
-    memory_output    = memory_state->output;
-
-    writeback_input  = writeback_state->input;
-    writeback_output = writeback_state->output;
+    connect_pipes();
 
     sim_reset();
-    clear_mem(mem);
+    clear_mem(sim.mem);
 }
 
 void sim_reset()
@@ -388,66 +996,72 @@ void sim_reset()
     if (!initialized)
 	    sim_init();
     clear_pipes();
-    clear_mem(reg);
+    connect_pipes();
+    predecode_flush();
+    bp_reset();
+    clear_mem(sim.reg);
     starting_up = 1;
-    cycles = instructions = 0;
-    cc = DEFAULT_CC;
-    status = STAT_AOK;
-
-    cc = cc_in = DEFAULT_CC;
-    wb_destE  = REG_NONE;
-    wb_valE   = 0;
-    wb_destM  = REG_NONE;
-    wb_valM   = 0;
-    mem_addr  = 0;
-    mem_data  = 0;
-    mem_write = false;
+    sim.cycles = sim.instructions = 0;
+    sim.cc = DEFAULT_CC;
+    sim.status = STAT_AOK;
+
+    sim.cc = sim.cc_in = DEFAULT_CC;
+    sim.wb_destE  = REG_NONE;
+    sim.wb_valE   = 0;
+    sim.wb_destM  = REG_NONE;
+    sim.wb_valM   = 0;
+    sim.mem_addr  = 0;
+    sim.mem_data  = 0;
+    sim.mem_write = false;
+    m_ret_miss = false;
 }
 
 static void print_state(word_t cyc) {
-    sim_log("\nCycle = %lld. CC = %s, Stat = %s\n", cyc, cc_name(cc), stat_name(status));
+    sim_log("\nCycle = %lld. CC = %s, Stat = %s\n", cyc, cc_name(sim.cc), stat_name(sim.status));
 }
 
 static void print_fetch() {
-    sim_log("F: predPC = 0x%llx\n", fetch_output->predPC);
+    sim_log("F: predPC = 0x%llx\n", sim.fetch_output->predPC);
 }
 
 static void print_decode() {
     sim_log("D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s, Stage PC = 0x%llx\n",
-	    iname(HPACK(decode_output->icode, decode_output->ifun)),
-	    reg_name(decode_output->ra), reg_name(decode_output->rb),
-	    decode_output->valc, decode_output->valp,
-	    stat_name(decode_output->status), decode_output->stage_pc);
+	    iname(HPACK(sim.decode_output->icode, sim.decode_output->ifun)),
+	    reg_name(sim.decode_output->ra), reg_name(sim.decode_output->rb),
+	    sim.decode_output->valc, sim.decode_output->valp,
+	    stat_name(sim.decode_output->status), sim.decode_output->stage_pc);
 }
 
 static void print_execute() {
     sim_log("E: instr = %s, valC = 0x%llx, valA = 0x%llx, valB = 0x%llx\n   srcA = %s, srcB = %s, dstE = %s, dstM = %s, Stat = %s, Stage PC = 0x%llx\n",
-	    iname(HPACK(execute_output->icode, execute_output->ifun)),
-	    execute_output->valc, execute_output->vala, execute_output->valb,
-	    reg_name(execute_output->srca), reg_name(execute_output->srcb),
-	    reg_name(execute_output->deste), reg_name(execute_output->destm),
-	    stat_name(execute_output->status), execute_output->stage_pc);
+	    iname(HPACK(sim.execute_output->icode, sim.execute_output->ifun)),
+	    sim.execute_output->valc, sim.execute_output->vala, sim.execute_output->valb,
+	    reg_name(sim.execute_output->srca), reg_name(sim.execute_output->srcb),
+	    reg_name(sim.execute_output->deste), reg_name(sim.execute_output->destm),
+	    stat_name(sim.execute_output->status), sim.execute_output->stage_pc);
 }
 
 static void print_memory() {
     sim_log("M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s, Stage PC = 0x%llx\n",
-	    iname(HPACK(memory_output->icode, memory_output->ifun)),
-	    memory_output->takebranch,
-	    memory_output->vale, memory_output->vala,
-	    reg_name(memory_output->deste), reg_name(memory_output->destm),
-	    stat_name(memory_output->status), memory_output->stage_pc);
+	    iname(HPACK(sim.memory_output->icode, sim.memory_output->ifun)),
+	    sim.memory_output->takebranch,
+	    sim.memory_output->vale, sim.memory_output->vala,
+	    reg_name(sim.memory_output->deste), reg_name(sim.memory_output->destm),
+	    stat_name(sim.memory_output->status), sim.memory_output->stage_pc);
 }
 
 static void print_writeback() {
     sim_log("W: instr = %s, valE = 0x%llx, valM = 0x%llx, dstE = %s, dstM = %s, Stat = %s, Stage PC = 0x%llx\n",
-	    iname(HPACK(writeback_output->icode, writeback_output->ifun)),
-	    writeback_output->vale, writeback_output->valm,
-	    reg_name(writeback_output->deste), reg_name(writeback_output->destm),
-	    stat_name(writeback_output->status), writeback_output->stage_pc);
+	    iname(HPACK(sim.writeback_output->icode, sim.writeback_output->ifun)),
+	    sim.writeback_output->vale, sim.writeback_output->valm,
+	    reg_name(sim.writeback_output->deste), reg_name(sim.writeback_output->destm),
+	    stat_name(sim.writeback_output->status), sim.writeback_output->stage_pc);
 }
 
 /* Text representation of status */
 void tty_report(word_t cyc) {
+    if (TRACE_LEVEL < 1 || !(trace_mask & TRACE_STATE) || !dumpfile)
+        return;
     print_state(cyc);
     print_fetch();
     print_decode();
@@ -456,6 +1070,347 @@ void tty_report(word_t cyc) {
     print_writeback();
 }
 
+/*****************************************************************************
+ * Binary event trace (-B)
+ * Each cycle fills one trace_rec_t in a ring of blocks. A full block is
+ * handed to a writer thread, so the simulation only blocks when the disk
+ * falls a whole ring behind.
+ *****************************************************************************/
+
+#define TRACE_BLOCK_RECORDS 4096
+#define TRACE_BLOCKS 4
+
+static FILE *trace_file = NULL;
+static trace_rec_t *trace_ring;             /* TRACE_BLOCKS blocks back to back */
+static int trace_fill[TRACE_BLOCKS];        /* records in a handed off block, 0 if free */
+static int trace_block, trace_pos;          /* next record the simulator fills */
+static trace_rec_t *trace_rec;              /* record of the current cycle */
+static bool trace_done;
+static pthread_t trace_thread;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+
+static void *trace_writer(void *arg)
+{
+    int b = 0;
+    pthread_mutex_lock(&trace_lock);
+    while (1) {
+        while (trace_fill[b] == 0 && !trace_done)
+            pthread_cond_wait(&trace_cond, &trace_lock);
+        if (trace_fill[b] == 0)
+            break;
+        int n = trace_fill[b];
+        pthread_mutex_unlock(&trace_lock);
+        fwrite(&trace_ring[b * TRACE_BLOCK_RECORDS], sizeof(trace_rec_t), n, trace_file);
+        pthread_mutex_lock(&trace_lock);
+        trace_fill[b] = 0;
+        pthread_cond_broadcast(&trace_cond);
+        b = (b + 1) % TRACE_BLOCKS;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+/* Hand the current block to the writer and wait for the next one to be free */
+static void trace_submit()
+{
+    pthread_mutex_lock(&trace_lock);
+    trace_fill[trace_block] = trace_pos;
+    pthread_cond_broadcast(&trace_cond);
+    trace_block = (trace_block + 1) % TRACE_BLOCKS;
+    while (trace_fill[trace_block] != 0)
+        pthread_cond_wait(&trace_cond, &trace_lock);
+    pthread_mutex_unlock(&trace_lock);
+    trace_pos = 0;
+}
+
+static void trace_open(char *filename)
+{
+    trace_header_t header = { TR_MAGIC, TR_VERSION, sizeof(trace_rec_t) };
+
+    trace_file = fopen(filename, "wb");
+    if (!trace_file) {
+        fprintf(stderr, "Couldn't open trace file %s\n", filename);
+        exit(1);
+    }
+    fwrite(&header, sizeof(header), 1, trace_file);
+    trace_ring = malloc(TRACE_BLOCKS * TRACE_BLOCK_RECORDS * sizeof(trace_rec_t));
+    trace_block = trace_pos = 0;
+    trace_done = false;
+    pthread_create(&trace_thread, NULL, trace_writer, NULL);
+}
+
+static void trace_close()
+{
+    if (trace_pos > 0)
+        trace_submit();
+    pthread_mutex_lock(&trace_lock);
+    trace_done = true;
+    pthread_cond_broadcast(&trace_cond);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_join(trace_thread, NULL);
+    fclose(trace_file);
+    free(trace_ring);
+    trace_file = NULL;
+}
+
+/* Record the pipeline registers as tty_report would print them */
+static void trace_begin_cycle(word_t cyc)
+{
+    trace_rec_t *r = trace_rec = &trace_ring[trace_block * TRACE_BLOCK_RECORDS + trace_pos];
+
+    r->cycle = cyc;
+    r->cc = sim.cc;
+    r->status = sim.status;
+    r->f_predpc = sim.fetch_output->predPC;
+    r->d_instr = HPACK(sim.decode_output->icode, sim.decode_output->ifun);
+    r->d_ra = sim.decode_output->ra;
+    r->d_rb = sim.decode_output->rb;
+    r->d_valc = sim.decode_output->valc;
+    r->d_valp = sim.decode_output->valp;
+    r->d_status = sim.decode_output->status;
+    r->d_pc = sim.decode_output->stage_pc;
+    r->e_instr = HPACK(sim.execute_output->icode, sim.execute_output->ifun);
+    r->e_valc = sim.execute_output->valc;
+    r->e_vala = sim.execute_output->vala;
+    r->e_valb = sim.execute_output->valb;
+    r->e_srca = sim.execute_output->srca;
+    r->e_srcb = sim.execute_output->srcb;
+    r->e_deste = sim.execute_output->deste;
+    r->e_destm = sim.execute_output->destm;
+    r->e_status = sim.execute_output->status;
+    r->e_pc = sim.execute_output->stage_pc;
+    r->m_instr = HPACK(sim.memory_output->icode, sim.memory_output->ifun);
+    r->m_cnd = sim.memory_output->takebranch;
+    r->m_vale = sim.memory_output->vale;
+    r->m_vala = sim.memory_output->vala;
+    r->m_deste = sim.memory_output->deste;
+    r->m_destm = sim.memory_output->destm;
+    r->m_status = sim.memory_output->status;
+    r->m_pc = sim.memory_output->stage_pc;
+    r->w_instr = HPACK(sim.writeback_output->icode, sim.writeback_output->ifun);
+    r->w_vale = sim.writeback_output->vale;
+    r->w_valm = sim.writeback_output->valm;
+    r->w_deste = sim.writeback_output->deste;
+    r->w_destm = sim.writeback_output->destm;
+    r->w_status = sim.writeback_output->status;
+    r->w_pc = sim.writeback_output->stage_pc;
+}
+
+/* Add what the stages decided and commit the record */
+static void trace_end_cycle()
+{
+    trace_rec_t *r = trace_rec;
+
+    r->f_pc = sim.f_pc;
+    r->fwd_a = d_fwd_a;
+    r->fwd_b = d_fwd_b;
+    r->ops[0] = sim.fetch_state->op;
+    r->ops[1] = sim.decode_state->op;
+    r->ops[2] = sim.execute_state->op;
+    r->ops[3] = sim.memory_state->op;
+    r->ops[4] = sim.writeback_state->op;
+    r->mem_op = (sim.mem_write ? TR_MEM_WRITE : 0) | (sim.dmem_error ? TR_MEM_ERROR : 0);
+    r->mem_addr = sim.mem_addr;
+    r->mem_data = sim.mem_data;
+    if (++trace_pos == TRACE_BLOCK_RECORDS)
+        trace_submit();
+}
+
+/*****************************************************************************
+ * Concurrent ISA check
+ * In TTY mode the ISA model runs on a second thread while the pipeline
+ * simulates. Every instruction that retires from W is passed through a
+ * single-producer single-consumer ring; the checker steps the ISA model
+ * once per record and compares the PC and everything the instruction
+ * wrote. The first divergence is kept and stops the pipeline.
+ *****************************************************************************/
+
+#define CHECK_RING 4096         /* power of two */
+#define CHECK_BATCH 256         /* records between wakeups of an idle checker */
+
+typedef struct {
+    word_t cycle;
+    word_t pc;
+    byte_t icode;
+    byte_t deste, destm;
+    bool store;
+    word_t vale, valm;
+    word_t addr, data;          /* memory write, if store */
+} retire_t;
+
+static retire_t check_ring[CHECK_RING];
+static _Atomic size_t check_head __attribute__((aligned(64))) = 0; /* next record the checker reads */
+static _Atomic size_t check_tail __attribute__((aligned(64))) = 0; /* next record the pipeline writes */
+static atomic_bool check_done = false;      /* no more records will come */
+static atomic_bool check_diverged = false;
+static atomic_bool check_sleeping = false;  /* checker waits on check_cond */
+static bool check_running = false;
+static pthread_t check_thread;
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t check_cond = PTHREAD_COND_INITIALIZER;
+
+static state_ptr check_state;               /* the ISA model */
+static mem_t check_reg;                     /* register file as the pipeline wrote it */
+static word_t check_skip;                   /* instructions to step before comparing */
+static word_t check_steps;                  /* instructions the checker has stepped */
+static stat_t check_status;
+static char check_error[200];
+
+/* The store made by the instruction now in M, attached when it retires */
+static bool store_pending;
+static word_t store_pc, store_addr, store_data;
+
+static void check_fail(retire_t *rec, const char *format, ...)
+{
+    va_list arg;
+    int n = snprintf(check_error, sizeof(check_error),
+                     "ISA check diverged at cycle %lld, W Stage PC = 0x%llx: ", rec->cycle, rec->pc);
+    va_start(arg, format);
+    vsnprintf(check_error + n, sizeof(check_error) - n, format, arg);
+    va_end(arg);
+    atomic_store(&check_diverged, true);
+}
+
+/* Step the ISA model over one retired instruction and compare what it did */
+static bool check_record(retire_t *rec)
+{
+    word_t val;
+
+    if (check_state->pc != rec->pc) {
+        check_fail(rec, "ISA is at PC 0x%llx", check_state->pc);
+        return false;
+    }
+    set_reg_val(check_reg, rec->deste, rec->vale);
+    set_reg_val(check_reg, rec->destm, rec->valm);
+    check_status = isa_step(check_state, NULL);
+    check_steps++;
+    if (check_status != STAT_AOK) {
+        check_fail(rec, "ISA stopped with status %s", stat_name(check_status));
+        return false;
+    }
+
+    if (memcmp(check_reg->contents, check_state->r->contents, REG_NONE * 8)) {
+        for (int i = 0; i < REG_NONE; i++) {
+            word_t expect = get_reg_val(check_reg, i);
+            val = get_reg_val(check_state->r, i);
+            if (val != expect) {
+                check_fail(rec, "%s = 0x%llx, ISA has 0x%llx", reg_name(i), expect, val);
+                break;
+            }
+        }
+        return false;
+    }
+    if (rec->store) {
+        if (!get_word_val(check_state->m, rec->addr, &val) || val != rec->data) {
+            check_fail(rec, "wrote 0x%llx to 0x%llx, ISA has 0x%llx", rec->data, rec->addr, val);
+            return false;
+        }
+    } else if (rec->icode == I_RMMOVQ || rec->icode == I_CALL || rec->icode == I_PUSHQ) {
+        check_fail(rec, "%s did not write memory", iname(HPACK(rec->icode, 0)));
+        return false;
+    }
+    return true;
+}
+
+static void check_wake()
+{
+    pthread_mutex_lock(&check_lock);
+    pthread_cond_signal(&check_cond);
+    pthread_mutex_unlock(&check_lock);
+}
+
+static void *check_run(void *arg)
+{
+    size_t head = 0, tail = 0;
+
+    /* Catch up with the fast-forwarded instructions first */
+    for (check_steps = 0; check_steps < check_skip && check_status == STAT_AOK; check_steps++)
+        check_status = isa_step(check_state, NULL);
+    check_reg = copy_mem(check_state->r);
+
+    while (1) {
+        if (head == tail) {
+            atomic_store_explicit(&check_head, head, memory_order_release);
+            tail = atomic_load_explicit(&check_tail, memory_order_acquire);
+            if (head == tail) {
+                /* Sleep until the pipeline has queued a batch or is done */
+                pthread_mutex_lock(&check_lock);
+                atomic_store(&check_sleeping, true);
+                while (!atomic_load(&check_done)
+                       && atomic_load(&check_tail) - head < CHECK_BATCH)
+                    pthread_cond_wait(&check_cond, &check_lock);
+                atomic_store(&check_sleeping, false);
+                pthread_mutex_unlock(&check_lock);
+                tail = atomic_load_explicit(&check_tail, memory_order_acquire);
+                if (head == tail)
+                    break;
+            }
+        }
+        if (!check_record(&check_ring[head % CHECK_RING]))
+            break;
+        head++;
+    }
+    atomic_store_explicit(&check_head, head, memory_order_release);
+    free_mem(check_reg);
+    return NULL;
+}
+
+/* Start checking the pipeline against isa_state, after skip instructions */
+static void check_start(state_ptr isa_state, word_t skip)
+{
+    check_state = isa_state;
+    check_skip = skip;
+    check_status = STAT_AOK;
+    check_running = true;
+    pthread_create(&check_thread, NULL, check_run, NULL);
+}
+
+/* Wait for the checker to catch up. Returns the instructions it stepped */
+static word_t check_finish(stat_t *statusp)
+{
+    atomic_store(&check_done, true);
+    check_wake();
+    pthread_join(check_thread, NULL);
+    check_running = false;
+    *statusp = check_status;
+    return check_steps;
+}
+
+static const char *check_divergence()
+{
+    return atomic_load(&check_diverged) ? check_error : NULL;
+}
+
+/* Queue the instruction retiring from W this cycle */
+static void check_retire(word_t cyc)
+{
+    size_t tail = atomic_load_explicit(&check_tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&check_head, memory_order_acquire) == CHECK_RING) {
+        if (atomic_load(&check_diverged))
+            return;
+        if (atomic_load(&check_sleeping))
+            check_wake();
+        sched_yield();
+    }
+
+    retire_t *rec = &check_ring[tail % CHECK_RING];
+    rec->cycle = cyc;
+    rec->pc = sim.writeback_output->stage_pc;
+    rec->icode = sim.writeback_output->icode;
+    rec->deste = sim.writeback_output->deste;
+    rec->destm = sim.writeback_output->destm;
+    rec->vale = sim.writeback_output->vale;
+    rec->valm = sim.writeback_output->valm;
+    rec->store = store_pending && store_pc == rec->pc;
+    rec->addr = store_addr;
+    rec->data = store_data;
+    atomic_store_explicit(&check_tail, tail + 1, memory_order_release);
+    if ((tail + 1) % CHECK_BATCH == 0
+            && atomic_load_explicit(&check_sleeping, memory_order_relaxed))
+        check_wake();
+}
+
 /******************************************************************
  * This function runs the pipeline for one cycle. max_instr
  * indicates maximum number of instructions that want to complete
@@ -475,19 +1430,22 @@ static byte_t sim_step_pipe(word_t ccount)
 {
     /* Update pipe registers */
     update_pipes();
+    connect_pipes();
     /* print status report in TTY mode */
     tty_report(ccount);
+    if (trace_file)
+        trace_begin_cycle(ccount);
     /* error checking */
-    if (fetch_state->op == P_ERROR)
-	    fetch_output->status = STAT_PIP;
-    if (decode_state->op == P_ERROR)
-	    decode_output->status = STAT_PIP;
-    if (execute_state->op == P_ERROR)
-	    execute_output->status = STAT_PIP;
-    if (memory_state->op == P_ERROR)
-	    memory_output->status = STAT_PIP;
-    if (writeback_state->op == P_ERROR)
-	    writeback_output->status = STAT_PIP;
+    if (sim.fetch_state->op == P_ERROR)
+	    sim.fetch_output->status = STAT_PIP;
+    if (sim.decode_state->op == P_ERROR)
+	    sim.decode_output->status = STAT_PIP;
+    if (sim.execute_state->op == P_ERROR)
+	    sim.execute_output->status = STAT_PIP;
+    if (sim.memory_state->op == P_ERROR)
+	    sim.memory_output->status = STAT_PIP;
+    if (sim.writeback_state->op == P_ERROR)
+	    sim.writeback_output->status = STAT_PIP;
 
     /****************** Stage implementations ******************
      * TODO: implement the following functions to simulate the
@@ -513,58 +1471,76 @@ static byte_t sim_step_pipe(word_t ccount)
     do_fetch_stage();
 
     do_stall_check();
+    bp_advance();
+    if (trace_file)
+        trace_end_cycle();
+    if (check_running) {
+        if (sim.writeback_output->status == STAT_AOK)
+            check_retire(ccount);
+        store_pending = sim.mem_write && !sim.dmem_error;
+        store_pc = sim.memory_output->stage_pc;
+        store_addr = sim.mem_addr;
+        store_data = sim.mem_data;
+    }
 
     /* Performance monitoring. Do not change anything below */
-    if (writeback_output->status != STAT_BUB) {
+    if (sim.writeback_output->status != STAT_BUB) {
         starting_up = 0;
-        instructions++;
-        cycles++;
+        sim.instructions++;
+        sim.cycles++;
     } else {
 	    if (!starting_up)
-	        cycles++;
+	        sim.cycles++;
     }
 
-    return status;
+    return sim.status;
 }
 
-/*************************** Fetch stage ***************************
- * TODO: update [*decode_input, f_pc, *fetch_input]
- * you may find these functions useful:
- * HPACK(), get_byte_val(), get_word_val(), HI4(), LO4()
- *
- * imem_error is defined for logging purpose, you can use it to help
- * with your design, but it's also fine to neglect it
- *******************************************************************/
-void do_fetch_stage()
+/*
+ * Predecoded instructions, direct mapped by PC. An entry holds everything
+ * do_fetch_stage gets out of the instruction bytes, so a hit skips the
+ * memory reads and the decode switch. A write into a page that has
+ * predecoded instructions drops the entries it may overlap.
+ */
+#define PREDECODE_ENTRIES 4096
+#define PREDECODE_PAGE_BITS 8
+#define MAX_INSTR_LEN 10
+
+typedef struct {
+    word_t pc;
+    word_t valc;
+    word_t valp;
+    byte_t icode, ifun, ra, rb;
+    bool instr_valid;
+    bool cached;            /* entry holds the instruction at pc */
+} predecode_t;
+
+static SIM_LOCAL predecode_t *predecode = NULL;
+static SIM_LOCAL byte_t *predecode_pages = NULL;  /* nonzero for pages with cached instructions */
+
+/*
+ * decode_instr - Decode the instruction at pc into d. Returns false if some
+ * of its bytes are outside memory.
+ */
+static bool decode_instr(word_t pc, predecode_t *d)
 {
     byte_t instr = HPACK(I_NOP, F_NONE);
-    
-    if(writeback_output -> icode == I_RET) {
-        f_pc = writeback_output -> valm;
-    } else if(memory_output -> icode == I_JMP && !(memory_output -> takebranch)) {
-        f_pc = memory_output -> vala;
-    } else {
-        f_pc = fetch_output -> predPC;
-    }
-
-    /* your implementation */
     byte_t tempB;
-	imem_error |= !get_byte_val(mem, f_pc, &instr);
-	byte_t icode = HI4(instr);
-    byte_t ifun = LO4(instr);
+    bool error = false;
+    bool valid = true;
 	word_t ra = 0;
 	word_t rb = 0;
 	word_t valc = 0;
     word_t valp = 0;
-    //set f_pc at first
-    
+
+	error |= !get_byte_val(sim.mem, pc, &instr);
 	switch (instr) {
 		case HPACK(I_NOP, F_NONE):
-			valp = f_pc + 1;
+			valp = pc + 1;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_HALT, F_NONE):
-			valp = f_pc + 1;//should be +1
+			valp = pc + 1;//should be +1
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_RRMOVQ, F_NONE):
@@ -574,35 +1550,35 @@ void do_fetch_stage()
 		case HPACK(I_RRMOVQ, C_NE):
 		case HPACK(I_RRMOVQ, C_GE):
 		case HPACK(I_RRMOVQ, C_G):
-			imem_error |= !get_byte_val(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val(sim.mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_IRMOVQ, F_NONE):
-			imem_error |= !get_byte_val(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val(sim.mem, pc + 1, &tempB);
             ra = REG_NONE;
 			rb = LO4(tempB);
-			imem_error |= !get_word_val(mem, f_pc + 2, &valc);
-			valp = f_pc + 10;
+			error |= !get_word_val(sim.mem, pc + 2, &valc);
+			valp = pc + 10;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_RMMOVQ, F_NONE):
-			imem_error |= !get_byte_val(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val(sim.mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			imem_error |= !get_word_val(mem, f_pc + 2, &valc);
-			valp = f_pc + 10;
+			error |= !get_word_val(sim.mem, pc + 2, &valc);
+			valp = pc + 10;
             //fetch_output->predPC = valp;
 			break;
         case HPACK(I_LEAQ, F_NONE):
 		case HPACK(I_MRMOVQ, F_NONE):
-			imem_error |= !get_byte_val(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val(sim.mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			imem_error |= !get_word_val(mem, f_pc + 2, &valc);
-			valp = f_pc + 10;
+			error |= !get_word_val(sim.mem, pc + 2, &valc);
+			valp = pc + 10;
             //fetch_output->predPC = valp;
 			break;
         case HPACK(I_VECADD, F_NONE):
@@ -610,19 +1586,19 @@ void do_fetch_stage()
 		case HPACK(I_ALU, A_SUB):
 		case HPACK(I_ALU, A_AND):
 		case HPACK(I_ALU, A_XOR):
-			imem_error |= !get_byte_val(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val(sim.mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
         case HPACK(I_SHF, S_HL):
         case HPACK(I_SHF, S_HR):
         case HPACK(I_SHF, S_AR):
-            imem_error |= !get_byte_val(mem, f_pc + 1, &tempB);
+            error |= !get_byte_val(sim.mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
 
@@ -633,73 +1609,870 @@ void do_fetch_stage()
 		case HPACK(I_JMP, C_NE):
 		case HPACK(I_JMP, C_GE):
 		case HPACK(I_JMP, C_G):
-			imem_error |= !get_word_val(mem, f_pc + 1, &valc);
-			valp = f_pc + 9;
+			error |= !get_word_val(sim.mem, pc + 1, &valc);
+			valp = pc + 9;
             // fetch_output->predPC = valc;
             //chose pc 
 	    	break;
 		case HPACK(I_CALL, F_NONE):
-		    imem_error |= !get_word_val(mem, f_pc + 1, &valc);
-		    valp = f_pc + 9;
+		    error |= !get_word_val(sim.mem, pc + 1, &valc);
+		    valp = pc + 9;
             // fetch_output->predPC = valc;
 		    break;
 		case HPACK(I_RET, F_NONE):
-		    valp = f_pc + 1;
+		    valp = pc + 1;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_PUSHQ, F_NONE):
-			imem_error |= !get_byte_val(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val(sim.mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
 		case HPACK(I_POPQ, F_NONE):
-			imem_error |= !get_byte_val(mem, f_pc + 1, &tempB);
+			error |= !get_byte_val(sim.mem, pc + 1, &tempB);
 			ra = HI4(tempB);
 			rb = LO4(tempB);
-			valp = f_pc + 2;
+			valp = pc + 2;
             //fetch_output->predPC = valp;
 			break;
 
 		default:
-			instr_valid = false;
-			printf("Invalid instruction\n");
+			valid = false;
 			break;
 	}
 
+    d->pc = pc;
+    d->icode = HI4(instr);
+    d->ifun = LO4(instr);
+    d->ra = ra;
+    d->rb = rb;
+    d->valc = valc;
+    d->valp = valp;
+    d->instr_valid = valid;
+    return !error;
+}
+
+/* Predecoded instruction at pc, decoding it on a miss */
+static predecode_t *predecode_fetch(word_t pc)
+{
+    static SIM_LOCAL predecode_t uncached;
+    predecode_t *d = &predecode[pc & (PREDECODE_ENTRIES - 1)];
+
+    if (d->cached && d->pc == pc)
+        return d;
+    if (!decode_instr(pc, &uncached)) {
+        sim.imem_error = true;
+        return &uncached;
+    }
+    *d = uncached;
+    d->cached = true;
+    predecode_pages[pc >> PREDECODE_PAGE_BITS] = 1;
+    if (d->valp > pc)
+        predecode_pages[(d->valp - 1) >> PREDECODE_PAGE_BITS] = 1;
+    return d;
+}
+
+/* Drop every predecoded instruction, for when memory changes wholesale */
+static void predecode_flush()
+{
+    size_t pages = (sim.mem->len >> PREDECODE_PAGE_BITS) + 1;
+    if (predecode_pages == NULL) {
+        predecode_pages = malloc(pages);
+        predecode = malloc(PREDECODE_ENTRIES * sizeof(predecode_t));
+    }
+    memset(predecode_pages, 0, pages);
+    memset(predecode, 0, PREDECODE_ENTRIES * sizeof(predecode_t));
+}
+
+/* Drop the predecoded instructions that the len bytes written at pos may change */
+static void predecode_write(word_t pos, int len)
+{
+    if (!predecode_pages[pos >> PREDECODE_PAGE_BITS]
+            && !predecode_pages[(pos + len - 1) >> PREDECODE_PAGE_BITS])
+        return;
+    for (word_t pc = pos >= MAX_INSTR_LEN ? pos - MAX_INSTR_LEN + 1 : 0; pc < pos + len; pc++) {
+        predecode_t *d = &predecode[pc & (PREDECODE_ENTRIES - 1)];
+        if (d->pc == pc)
+            d->cached = false;
+    }
+}
+
+/*****************************************************************************
+ * Functional fast-forward (-F)
+ * Runs the first instructions of a program without the pipeline. Code is
+ * translated into basic blocks of direct-threaded ops whose handlers are
+ * labels in ff_run, dispatched with computed goto. Anything unusual (halt,
+ * invalid instructions, REG_NONE operands, address errors, instructions
+ * beyond the base Y86-64 set) ends the fast-forward just before it, so the
+ * pipeline simulates those with its own rules.
+ *****************************************************************************/
+
+#define FF_BLOCK_MAX 64         /* instructions per block */
+#define FF_HASH 1024
+#define FF_CONTINUE 0x100       /* handlers[] slot of the block chaining op */
+
+typedef struct {
+    void *handler;
+    word_t pc, valc, valp;
+    byte_t ifun, ra, rb;
+} ff_op_t;
+
+typedef struct ff_block {
+    word_t pc;
+    struct ff_block *next;      /* hash chain */
+    ff_op_t ops[FF_BLOCK_MAX + 1];
+} ff_block_t;
+
+static ff_block_t *ff_blocks[FF_HASH];
+static byte_t *ff_code_pages = NULL;    /* nonzero for pages with translated code */
+
+static void ff_flush()
+{
+    for (int h = 0; h < FF_HASH; h++) {
+        while (ff_blocks[h] != NULL) {
+            ff_block_t *b = ff_blocks[h];
+            ff_blocks[h] = b->next;
+            free(b);
+        }
+    }
+    memset(ff_code_pages, 0, (sim.mem->len >> PREDECODE_PAGE_BITS) + 1);
+}
+
+static inline word_t ff_load(word_t addr)
+{
+    word_t val = 0;
+    for (int i = 7; i >= 0; i--)
+        val = (val << 8) | sim.mem->contents[addr + i];
+    return val;
+}
+
+/* Returns whether the store hit translated code, which must then be flushed */
+static inline bool ff_store(word_t addr, word_t val)
+{
+    mem_dirty(addr);
+    for (int i = 0; i < 8; i++, val >>= 8)
+        sim.mem->contents[addr + i] = val;
+    return ff_code_pages[addr >> PREDECODE_PAGE_BITS] || ff_code_pages[(addr + 7) >> PREDECODE_PAGE_BITS];
+}
+
+static inline bool ff_addr_ok(word_t addr)
+{
+    return addr >= 0 && addr + 8 <= sim.mem->len;
+}
+
+/* Whether the register operands of d are real registers where they must be */
+static bool ff_regs_ok(predecode_t *d)
+{
+    switch (d->icode) {
+    case I_RRMOVQ:
+    case I_ALU:
+        return d->ra != REG_NONE && d->rb != REG_NONE;
+    case I_IRMOVQ:
+        return d->rb != REG_NONE;
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+    case I_PUSHQ:
+    case I_POPQ:
+        return d->ra != REG_NONE;
+    default:
+        return true;
+    }
+}
+
+/*
+ * ff_translate - Build the block starting at pc. handlers maps HPACK'd
+ * instructions to op labels, stop is the label that ends fast-forward.
+ */
+static ff_block_t *ff_translate(word_t pc, void **handlers, void *stop)
+{
+    ff_block_t *b = malloc(sizeof(ff_block_t));
+
+    b->pc = pc;
+    for (int n = 0; ; n++) {
+        predecode_t d;
+        ff_op_t *op = &b->ops[n];
+        bool ok = decode_instr(pc, &d) && d.instr_valid && ff_regs_ok(&d);
+
+        op->pc = pc;
+        op->valc = d.valc;
+        op->valp = d.valp;
+        op->ifun = d.ifun;
+        op->ra = d.ra;
+        op->rb = d.rb;
+        op->handler = ok ? handlers[HPACK(d.icode, d.ifun)] : NULL;
+        if (n == FF_BLOCK_MAX) {
+            op->handler = handlers[FF_CONTINUE];
+            break;
+        }
+        if (op->handler == NULL) {
+            op->handler = stop;
+            break;
+        }
+
+        ff_code_pages[pc >> PREDECODE_PAGE_BITS] = 1;
+        ff_code_pages[(d.valp - 1) >> PREDECODE_PAGE_BITS] = 1;
+        if (d.icode == I_JMP || d.icode == I_CALL || d.icode == I_RET)
+            break;
+        pc = d.valp;
+    }
+
+    b->next = ff_blocks[b->pc % FF_HASH];
+    ff_blocks[b->pc % FF_HASH] = b;
+    return b;
+}
+
+/*
+ * fast_forward - Execute up to max_instr instructions functionally, starting
+ * at entry_pc, and leave reg, mem and cc as they are after the last one.
+ * Returns the number executed; *pcp is where the pipeline continues.
+ */
+static word_t fast_forward(word_t max_instr, word_t *pcp)
+{
+    static void *handlers[FF_CONTINUE + 1];
+    word_t r[REG_NONE + 1];
+    word_t pc = entry_pc, done = 0, addr, val;
+    ff_block_t *b;
+    ff_op_t *op;
+    cc_t ccs = sim.cc;
+
+#define NEXT do { op++; if (++done >= max_instr) { pc = op->pc; goto out; } goto *op->handler; } while (0)
+#define JUMP(target) do { pc = (target); done++; goto lookup; } while (0)
+#define STOP do { pc = op->pc; goto out; } while (0)
+/* After a store into translated code: throw the translations away */
+#define FLUSH(target) do { pc = (target); done++; ff_flush(); goto lookup; } while (0)
+
+    if (handlers[FF_CONTINUE] == NULL) {
+        for (int c = C_YES; c <= C_G; c++) {
+            handlers[HPACK(I_RRMOVQ, c)] = &&op_rrmovq;
+            handlers[HPACK(I_JMP, c)] = &&op_jmp;
+        }
+        handlers[HPACK(I_NOP, F_NONE)] = &&op_nop;
+        handlers[HPACK(I_IRMOVQ, F_NONE)] = &&op_irmovq;
+        handlers[HPACK(I_RMMOVQ, F_NONE)] = &&op_rmmovq;
+        handlers[HPACK(I_MRMOVQ, F_NONE)] = &&op_mrmovq;
+        handlers[HPACK(I_ALU, A_ADD)] = &&op_alu;
+        handlers[HPACK(I_ALU, A_SUB)] = &&op_alu;
+        handlers[HPACK(I_ALU, A_AND)] = &&op_alu;
+        handlers[HPACK(I_ALU, A_XOR)] = &&op_alu;
+        handlers[HPACK(I_CALL, F_NONE)] = &&op_call;
+        handlers[HPACK(I_RET, F_NONE)] = &&op_ret;
+        handlers[HPACK(I_PUSHQ, F_NONE)] = &&op_pushq;
+        handlers[HPACK(I_POPQ, F_NONE)] = &&op_popq;
+        handlers[FF_CONTINUE] = &&op_continue;
+    }
+    if (ff_code_pages == NULL)
+        ff_code_pages = calloc((sim.mem->len >> PREDECODE_PAGE_BITS) + 1, 1);
+    for (int i = 0; i < REG_NONE; i++)
+        r[i] = get_reg_val(sim.reg, i);
+    r[REG_NONE] = 0;
+
+lookup:
+    if (done >= max_instr)
+        goto out;
+    for (b = ff_blocks[pc % FF_HASH]; b != NULL && b->pc != pc; b = b->next)
+        ;
+    if (b == NULL)
+        b = ff_translate(pc, handlers, &&op_stop);
+    op = b->ops;
+    goto *op->handler;
+
+op_nop:
+    NEXT;
+op_rrmovq:
+    if (cond_holds(ccs, op->ifun))
+        r[op->rb] = r[op->ra];
+    NEXT;
+op_irmovq:
+    r[op->rb] = op->valc;
+    NEXT;
+op_rmmovq:
+    addr = op->valc + r[op->rb];
+    if (!ff_addr_ok(addr))
+        STOP;
+    if (ff_store(addr, r[op->ra]))
+        FLUSH(op->valp);
+    NEXT;
+op_mrmovq:
+    addr = op->valc + r[op->rb];
+    if (!ff_addr_ok(addr))
+        STOP;
+    r[op->ra] = ff_load(addr);
+    NEXT;
+op_alu:
+    val = compute_alu(op->ifun, r[op->ra], r[op->rb]);
+    ccs = compute_cc(op->ifun, r[op->ra], r[op->rb]);
+    r[op->rb] = val;
+    NEXT;
+op_jmp:
+    JUMP(cond_holds(ccs, op->ifun) ? op->valc : op->valp);
+op_call:
+    addr = r[REG_RSP] - 8;
+    if (!ff_addr_ok(addr))
+        STOP;
+    r[REG_RSP] = addr;
+    if (ff_store(addr, op->valp))
+        FLUSH(op->valc);
+    JUMP(op->valc);
+op_ret:
+    addr = r[REG_RSP];
+    if (!ff_addr_ok(addr))
+        STOP;
+    r[REG_RSP] = addr + 8;
+    JUMP(ff_load(addr));
+op_pushq:
+    addr = r[REG_RSP] - 8;
+    if (!ff_addr_ok(addr))
+        STOP;
+    val = r[op->ra];
+    r[REG_RSP] = addr;
+    if (ff_store(addr, val))
+        FLUSH(op->valp);
+    NEXT;
+op_popq:
+    addr = r[REG_RSP];
+    if (!ff_addr_ok(addr))
+        STOP;
+    r[REG_RSP] = addr + 8;
+    r[op->ra] = ff_load(addr);
+    NEXT;
+op_continue:
+    pc = op->pc;
+    goto lookup;
+op_stop:
+    STOP;
+
+#undef NEXT
+#undef JUMP
+#undef STOP
+#undef FLUSH
+
+out:
+    for (int i = 0; i < REG_NONE; i++)
+        set_reg_val(sim.reg, i, r[i]);
+    sim.cc = ccs;
+    *pcp = pc;
+    return done;
+}
+
+/*
+ * Branch prediction. Fetch guesses the direction of each conditional jump
+ * and the guess follows the jump through D, E and M in pred_state. E
+ * resolves the jump and trains the predictor; a wrong guess costs the
+ * usual two bubbles, after which fetch restarts from the address the
+ * guess did not take. Y86 targets are in valC, so fetch always knows
+ * where a taken jump goes. A BTB only comes into play when given a size:
+ * a jump then predicts taken only if its PC is in the BTB, which holds
+ * the jumps last seen taken.
+ *
+ * With -A, fetch pushes the return address of every call onto a return
+ * address stack and a ret continues at the address it pops instead of
+ * stalling. M checks the target against the word the ret reads; a wrong
+ * one squashes F, D and E and fetch takes the target from W as for an
+ * unpredicted ret. Wrong path fetches may have pushed and popped, so a
+ * mispredict puts the stack back to where the jump or ret left it.
+ */
+typedef enum { BP_TAKEN, BP_BTFNT, BP_BIMODAL, BP_GSHARE, BP_TOURNAMENT } bp_kind_t;
+
+static const char *bp_names[] = { "taken", "btfnt", "bimodal", "gshare", "tournament" };
+
+bp_kind_t bp_kind = BP_TAKEN;   /* Branch predictor (-P) */
+int bp_bits = 12;               /* 2^bp_bits counters per table */
+int bp_btb_size = 0;            /* BTB entries, 0 for none */
+bool bp_stats_on = false;       /* Count and report, only with -P */
+
+/* Per-branch counts, open addressed by PC */
+#define BP_STATS 1024
+#define BP_REPORT 10
+
+typedef struct {
+    word_t pc;
+    word_t execs;
+    word_t misses;
+} bp_stat_t;
+
+static SIM_LOCAL byte_t *bp_bimodal = NULL;    /* 2-bit counters indexed by PC */
+static SIM_LOCAL byte_t *bp_gshare = NULL;     /* indexed by PC ^ history */
+static SIM_LOCAL byte_t *bp_chooser = NULL;    /* tournament: 2 and 3 pick gshare */
+static SIM_LOCAL word_t *bp_btb = NULL;        /* PC of the jump in each entry */
+static SIM_LOCAL word_t bp_history = 0;        /* outcomes of the last bp_bits jumps */
+static SIM_LOCAL bp_stat_t *bp_stats = NULL;
+static SIM_LOCAL word_t bp_jumps = 0, bp_misses = 0;
+
+static SIM_LOCAL word_t *ras_stack = NULL;     /* circular, the oldest entries get overwritten */
+static SIM_LOCAL int ras_pos = 0, ras_count = 0;
+static SIM_LOCAL ras_mark_t ras_undo;          /* the RAS before this cycle's fetch */
+static SIM_LOCAL bool ras_overflowed;          /* this cycle's fetch pushed out an entry */
+static SIM_LOCAL word_t ras_hits = 0, ras_misses = 0, ras_empty = 0, ras_overflows = 0;
+
+/*
+ * Predictor state kept by the interactive history. A snapshot copies every
+ * table; a restore point only logs the table entries its cycle overwrites,
+ * the same way mem_undo does for memory.
+ */
+typedef struct {
+    void *at;
+    size_t size;
+    byte_t old[sizeof(bp_stat_t)];  /* the largest entry */
+} bp_undo_t;
+
+typedef struct {
+    word_t history, jumps, misses;
+    int ras_pos, ras_count;
+    ras_mark_t ras_undo;
+    bool ras_overflowed;
+    word_t ras_hits, ras_misses, ras_empty, ras_overflows;
+    byte_t *tables;             /* snapshot: copy of every table in use */
+    int undo_count;             /* restore point: entries overwritten, oldest first */
+    bp_undo_t *undo;
+} bp_saved_t;
+
+static bp_saved_t *bp_log = NULL;
+
+/* "name[,bits[,btb]]" */
+static bool bp_configure(char *spec)
+{
+    int n = sizeof(bp_names) / sizeof(bp_names[0]);
+    char *name = strtok(spec, ",");
+    char *bits = strtok(NULL, ",");
+    char *btb = strtok(NULL, ",");
+    int k;
+
+    if (name == NULL)
+        return false;
+    for (k = 0; k < n && strcmp(name, bp_names[k]); k++)
+        ;
+    if (k == n)
+        return false;
+    bp_kind = k;
+    if (bits)
+        bp_bits = atoi(bits);
+    if (btb)
+        bp_btb_size = atoi(btb);
+    bp_stats_on = true;
+    return bp_bits > 0 && bp_bits <= 24 && bp_btb_size >= 0;
+}
+
+static void bp_reset()
+{
+    size_t n = (size_t) 1 << bp_bits;
+    if (bp_bimodal == NULL) {
+        bp_bimodal = malloc(n);
+        bp_gshare = malloc(n);
+        bp_chooser = malloc(n);
+        bp_stats = malloc(BP_STATS * sizeof(bp_stat_t));
+        if (bp_btb_size)
+            bp_btb = malloc(bp_btb_size * sizeof(word_t));
+        if (ras_depth)
+            ras_stack = calloc(ras_depth, sizeof(word_t));
+    }
+    /* Weakly taken, and the tournament starts out trusting bimodal */
+    memset(bp_bimodal, 2, n);
+    memset(bp_gshare, 2, n);
+    memset(bp_chooser, 1, n);
+    memset(bp_stats, 0, BP_STATS * sizeof(bp_stat_t));
+    for (int i = 0; i < bp_btb_size; i++)
+        bp_btb[i] = -1;
+    bp_history = 0;
+    bp_jumps = bp_misses = 0;
+    ras_pos = ras_count = 0;
+    ras_hits = ras_misses = ras_empty = ras_overflows = 0;
+}
+
+static void bp_free()
+{
+    free(bp_bimodal);
+    free(bp_gshare);
+    free(bp_chooser);
+    free(bp_stats);
+    free(bp_btb);
+    free(ras_stack);
+    bp_bimodal = bp_gshare = bp_chooser = NULL;
+    bp_stats = NULL;
+    bp_btb = NULL;
+    ras_stack = NULL;
+}
+
+/* Save the bytes at at before the predictor overwrites them, if a restore point is recording */
+static void bp_note(void *at, size_t size)
+{
+    if (bp_log == NULL)
+        return;
+    bp_log->undo = realloc(bp_log->undo, (bp_log->undo_count + 1) * sizeof(bp_undo_t));
+    bp_undo_t *u = &bp_log->undo[bp_log->undo_count++];
+    u->at = at;
+    u->size = size;
+    memcpy(u->old, at, size);
+}
+
+static size_t bp_tables_bytes()
+{
+    size_t bytes = ras_depth * sizeof(word_t);
+    if (bp_stats_on)
+        bytes += 3 * ((size_t) 1 << bp_bits) + BP_STATS * sizeof(bp_stat_t) + bp_btb_size * sizeof(word_t);
+    return bytes;
+}
+
+/* Copy the predictor into s, with its tables if it is for a snapshot */
+static void bp_save(bp_saved_t *s, bool tables)
+{
+    size_t n = (size_t) 1 << bp_bits;
+
+    s->history = bp_history;
+    s->jumps = bp_jumps;
+    s->misses = bp_misses;
+    s->ras_pos = ras_pos;
+    s->ras_count = ras_count;
+    s->ras_undo = ras_undo;
+    s->ras_overflowed = ras_overflowed;
+    s->ras_hits = ras_hits;
+    s->ras_misses = ras_misses;
+    s->ras_empty = ras_empty;
+    s->ras_overflows = ras_overflows;
+    s->tables = NULL;
+    s->undo_count = 0;
+    s->undo = NULL;
+    if (!tables)
+        return;
+    byte_t *buf = s->tables = malloc(bp_tables_bytes());
+    memcpy(buf, ras_stack, ras_depth * sizeof(word_t));
+    buf += ras_depth * sizeof(word_t);
+    if (!bp_stats_on)
+        return;
+    memcpy(buf, bp_bimodal, n);
+    memcpy(buf + n, bp_gshare, n);
+    memcpy(buf + 2 * n, bp_chooser, n);
+    buf += 3 * n;
+    memcpy(buf, bp_stats, BP_STATS * sizeof(bp_stat_t));
+    buf += BP_STATS * sizeof(bp_stat_t);
+    memcpy(buf, bp_btb, bp_btb_size * sizeof(word_t));
+}
+
+/* Put the predictor back the way bp_save found it, undoing logged writes newest first */
+static void bp_load(bp_saved_t *s)
+{
+    size_t n = (size_t) 1 << bp_bits;
+
+    for (int i = s->undo_count - 1; i >= 0; i--)
+        memcpy(s->undo[i].at, s->undo[i].old, s->undo[i].size);
+    if (s->tables != NULL) {
+        byte_t *buf = s->tables;
+        memcpy(ras_stack, buf, ras_depth * sizeof(word_t));
+        buf += ras_depth * sizeof(word_t);
+        if (bp_stats_on) {
+            memcpy(bp_bimodal, buf, n);
+            memcpy(bp_gshare, buf + n, n);
+            memcpy(bp_chooser, buf + 2 * n, n);
+            buf += 3 * n;
+            memcpy(bp_stats, buf, BP_STATS * sizeof(bp_stat_t));
+            buf += BP_STATS * sizeof(bp_stat_t);
+            memcpy(bp_btb, buf, bp_btb_size * sizeof(word_t));
+        }
+    }
+    bp_history = s->history;
+    bp_jumps = s->jumps;
+    bp_misses = s->misses;
+    ras_pos = s->ras_pos;
+    ras_count = s->ras_count;
+    ras_undo = s->ras_undo;
+    ras_overflowed = s->ras_overflowed;
+    ras_hits = s->ras_hits;
+    ras_misses = s->ras_misses;
+    ras_empty = s->ras_empty;
+    ras_overflows = s->ras_overflows;
+}
+
+static void bp_saved_free(bp_saved_t *s)
+{
+    free(s->tables);
+    free(s->undo);
+}
+
+static ras_mark_t ras_mark()
+{
+    ras_mark_t m = { ras_pos, ras_count, 0 };
+    if (ras_depth)
+        m.top = ras_stack[(ras_pos + ras_depth - 1) % ras_depth];
+    return m;
+}
+
+static void ras_restore(ras_mark_t m)
+{
+    ras_pos = m.pos;
+    ras_count = m.count;
+    bp_note(&ras_stack[(m.pos + ras_depth - 1) % ras_depth], sizeof(word_t));
+    ras_stack[(m.pos + ras_depth - 1) % ras_depth] = m.top;
+}
+
+static void ras_push(word_t addr)
+{
+    bp_note(&ras_stack[ras_pos], sizeof(word_t));
+    ras_stack[ras_pos] = addr;
+    ras_pos = (ras_pos + 1) % ras_depth;
+    if (ras_count < ras_depth)
+        ras_count++;
+    else
+        ras_overflowed = true;
+}
+
+static word_t ras_pop()
+{
+    ras_pos = (ras_pos + ras_depth - 1) % ras_depth;
+    ras_count--;
+    return ras_stack[ras_pos];
+}
+
+static inline void bp_count(byte_t *ctr, bool taken)
+{
+    bp_note(ctr, 1);
+    if (taken && *ctr < 3)
+        (*ctr)++;
+    else if (!taken && *ctr > 0)
+        (*ctr)--;
+}
+
+/* Direction guess for the conditional jump at pc */
+static bool bp_guess(word_t pc, word_t valc, word_t hist)
+{
+    word_t mask = ((word_t) 1 << bp_bits) - 1;
+    switch (bp_kind) {
+    case BP_BTFNT:
+        return valc <= pc;
+    case BP_BIMODAL:
+        return bp_bimodal[pc & mask] >= 2;
+    case BP_GSHARE:
+        return bp_gshare[(pc ^ hist) & mask] >= 2;
+    case BP_TOURNAMENT:
+        if (bp_chooser[pc & mask] >= 2)
+            return bp_gshare[(pc ^ hist) & mask] >= 2;
+        return bp_bimodal[pc & mask] >= 2;
+    case BP_TAKEN:
+    default:
+        return true;
+    }
+}
+
+/* Where fetch goes after the instruction at pc; records the guess for D */
+static word_t bp_predict(word_t pc, byte_t icode, byte_t ifun, word_t valc, word_t valp)
+{
+    pred_ptr p = pred_state[0]->input;
+    word_t next = valp;
+
+    p->ras = false;
+    if (ras_depth) {
+        ras_undo = ras_mark();
+        ras_overflowed = false;
+        if (icode == I_CALL)
+            ras_push(valp);
+        if (icode == I_RET && ras_count > 0) {
+            p->ras = true;
+            p->other = next = ras_pop();
+        }
+        p->mark = ras_mark();
+    }
+    if (icode == I_CALL)
+        return valc;
+    if (icode != I_JMP)
+        return next;
+    p->taken = ifun == C_YES || bp_guess(pc, valc, bp_history);
+    if (bp_btb_size && bp_btb[pc % bp_btb_size] != pc)
+        p->taken = false;
+    p->other = p->taken ? valp : valc;
+    p->hist = bp_history;
+    return p->taken ? valc : valp;
+}
+
+/* The ret in M read valm as its target: was the RAS wrong about it? */
+static bool bp_check_return(word_t valm)
+{
+    pred_ptr p = pred_state[2]->output;
+
+    if (!ras_depth || sim.writeback_input->status != STAT_AOK)
+        return false;
+    if (!p->ras) {
+        ras_empty++;
+        return false;
+    }
+    if (p->other == valm) {
+        ras_hits++;
+        return false;
+    }
+    ras_misses++;
+    return true;
+}
+
+/* The ret in W went where the RAS said, so fetch is already past it */
+static bool bp_return_predicted()
+{
+    pred_ptr p = pred_state[3]->output;
+    return p->ras && p->other == sim.writeback_output->valm;
+}
+
+/* The jump at pc in E went the way taken says: train and count */
+static void bp_resolve(word_t pc, byte_t ifun, bool taken)
+{
+    pred_ptr p = pred_state[1]->output;
+    word_t mask = ((word_t) 1 << bp_bits) - 1;
+    bool miss = p->taken != taken;
+
+    if (!bp_stats_on)
+        return;
+    if (ifun != C_YES) {
+        byte_t *b = &bp_bimodal[pc & mask];
+        byte_t *g = &bp_gshare[(pc ^ p->hist) & mask];
+        if ((*b >= 2) != (*g >= 2))
+            bp_count(&bp_chooser[pc & mask], (*g >= 2) == taken);
+        bp_count(b, taken);
+        bp_count(g, taken);
+        bp_history = ((bp_history << 1) | taken) & mask;
+    }
+    if (taken && bp_btb_size) {
+        bp_note(&bp_btb[pc % bp_btb_size], sizeof(word_t));
+        bp_btb[pc % bp_btb_size] = pc;
+    }
+
+    bp_jumps++;
+    bp_misses += miss;
+    for (int i = 0; i < BP_STATS; i++) {
+        bp_stat_t *s = &bp_stats[(pc + i) % BP_STATS];
+        if (s->execs == 0 || s->pc == pc)
+            bp_note(s, sizeof(bp_stat_t));
+        if (s->execs == 0)
+            s->pc = pc;
+        if (s->pc == pc) {
+            s->execs++;
+            s->misses += miss;
+            break;
+        }
+    }
+}
+
+/* Called after do_stall_check: the guesses move like D, E, M and W do */
+static void bp_advance()
+{
+    pred_ptr e = pred_state[1]->output;
+
+    *(pred_ptr) pred_state[1]->input = *(pred_ptr) pred_state[0]->output;
+    *(pred_ptr) pred_state[2]->input = *(pred_ptr) pred_state[1]->output;
+    *(pred_ptr) pred_state[3]->input = *(pred_ptr) pred_state[2]->output;
+    pred_state[0]->op = sim.decode_state->op;
+    pred_state[1]->op = sim.execute_state->op;
+    pred_state[2]->op = sim.memory_state->op;
+    pred_state[3]->op = sim.writeback_state->op;
+
+    if (!ras_depth)
+        return;
+    /* A fetch that does not make it into D is done again or squashed */
+    if (sim.decode_state->op != P_LOAD)
+        ras_restore(ras_undo);
+    else if (ras_overflowed)
+        ras_overflows++;
+    if (m_ret_miss)
+        ras_restore(((pred_ptr) pred_state[2]->output)->mark);
+    else if (sim.execute_output->icode == I_JMP && sim.memory_input->takebranch != e->taken)
+        ras_restore(e->mark);
+}
+
+static int bp_stat_cmp(const void *a, const void *b)
+{
+    const bp_stat_t *x = a, *y = b;
+    if (x->misses != y->misses)
+        return x->misses < y->misses ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+/* Overall accuracy and the jumps mispredicted most often */
+static void bp_report(FILE *out)
+{
+    bp_stat_t sorted[BP_STATS];
+    int n = 0;
+
+    if (ras_depth) {
+        fprintf(out, "Return address stack, %d entries: %lld hits, %lld mispredicted, %lld with the stack empty, %lld overflows\n",
+                ras_depth, ras_hits, ras_misses, ras_empty, ras_overflows);
+    }
+    if (!bp_stats_on)
+        return;
+    fprintf(out, "Branch predictor %s, %d counters, ", bp_names[bp_kind], 1 << bp_bits);
+    if (bp_btb_size)
+        fprintf(out, "%d entry BTB\n", bp_btb_size);
+    else
+        fprintf(out, "no BTB\n");
+    fprintf(out, "%lld jumps, %lld mispredicted (%.2f%% correct)\n", bp_jumps, bp_misses,
+            bp_jumps ? 100.0 * (bp_jumps - bp_misses) / bp_jumps : 100.0);
+    for (int i = 0; i < BP_STATS; i++) {
+        if (bp_stats[i].execs)
+            sorted[n++] = bp_stats[i];
+    }
+    if (n == 0)
+        return;
+    qsort(sorted, n, sizeof(bp_stat_t), bp_stat_cmp);
+    fprintf(out, "\tPC\tJumps\tMispredicted\tCorrect\n");
+    for (int i = 0; i < n && i < BP_REPORT; i++) {
+        fprintf(out, "\t0x%llx\t%lld\t%lld\t%.2f%%\n", sorted[i].pc, sorted[i].execs, sorted[i].misses,
+                100.0 * (sorted[i].execs - sorted[i].misses) / sorted[i].execs);
+    }
+}
+
+/*************************** Fetch stage ***************************
+ * TODO: update [*decode_input, f_pc, *fetch_input]
+ * you may find these functions useful:
+ * HPACK(), get_byte_val(), get_word_val(), HI4(), LO4()
+ *
+ * imem_error is defined for logging purpose, you can use it to help
+ * with your design, but it's also fine to neglect it
+ *******************************************************************/
+void do_fetch_stage()
+{
+    if(sim.writeback_output -> icode == I_RET && !bp_return_predicted()) {
+        sim.f_pc = sim.writeback_output -> valm;
+    } else if(sim.memory_output -> icode == I_JMP && sim.memory_output -> takebranch != ((pred_ptr) pred_state[2]->output)->taken) {
+        sim.f_pc = ((pred_ptr) pred_state[2]->output)->other;
+    } else {
+        sim.f_pc = sim.fetch_output -> predPC;
+    }
+
+    predecode_t *d = predecode_fetch(sim.f_pc);
+	byte_t icode = d->icode;
+    byte_t ifun = d->ifun;
+	word_t ra = d->ra;
+	word_t rb = d->rb;
+	word_t valc = d->valc;
+    word_t valp = d->valp;
+    if (!d->instr_valid) {
+        sim.instr_valid = false;
+        TRACE(2, TRACE_FETCH, "\tFetch: Invalid instruction at 0x%llx\n", sim.f_pc);
+    }
+
     
     
     //f_pc = valp;
     //valc jump or call
-    decode_input->icode = icode;
-    decode_input->ifun = ifun;
-    decode_input->ra =ra;
-    decode_input->rb = rb;
-    decode_input->valc = valc;
-    decode_input->valp = valp;
-    decode_input->status = STAT_AOK;
-    decode_input->stage_pc = f_pc;//idk
-
-    if (icode == I_JMP || icode == I_CALL) {
-        fetch_input -> predPC = valc;
-    } else {
-        fetch_input -> predPC = valp;
-    }
+    sim.decode_input->icode = icode;
+    sim.decode_input->ifun = ifun;
+    sim.decode_input->ra =ra;
+    sim.decode_input->rb = rb;
+    sim.decode_input->valc = valc;
+    sim.decode_input->valp = valp;
+    sim.decode_input->status = STAT_AOK;
+    sim.decode_input->stage_pc = sim.f_pc;//idk
+
+    sim.fetch_input -> predPC = bp_predict(sim.f_pc, icode, ifun, valc, valp);
 
     //ASSUMPTION #1:
     //After last instruction, halts are inserted, set up status accordingly
     if(icode == I_HALT) {
-        decode_input -> status = STAT_HLT;
+        sim.decode_input -> status = STAT_HLT;
         //decode_input -> stage_pc = 0;
     }
 
     // sim_log("IF: Fetched %s at 0x%llx.  ra=%s, rb=%s, valC = 0x%llx\n",
 	//     iname(HPACK(icode,ifun)), pc, reg_name(ra), reg_name(rb), valc);
     /* logging function, do not change this */
-    if (!imem_error) {
-        sim_log("\tFetch: f_pc = 0x%llx, f_instr = %s\n",
-            f_pc, iname(HPACK(decode_input->icode, decode_input->ifun)));
+    if (!sim.imem_error) {
+        TRACE(2, TRACE_FETCH, "\tFetch: f_pc = 0x%llx, f_instr = %s\n",
+            sim.f_pc, iname(HPACK(sim.decode_input->icode, sim.decode_input->ifun)));
     }
 }
 
@@ -723,39 +2496,39 @@ void do_decode_stage()
     // }
 
 
-	switch (decode_output->icode) {
+	switch (sim.decode_output->icode) {
 		case I_HALT: break;
 
 		case I_NOP: break;
 
 		case I_RRMOVQ: // aka CMOVQ
-		    srcA = decode_output->ra;
-			destE = decode_output->rb;
+		    srcA = sim.decode_output->ra;
+			destE = sim.decode_output->rb;
 			break;
 		
         case I_IRMOVQ:
-			destE = decode_output->rb;
+			destE = sim.decode_output->rb;
 			break;
 
 		case I_RMMOVQ:
-			srcA = decode_output->ra;
-			srcB = decode_output->rb;
+			srcA = sim.decode_output->ra;
+			srcB = sim.decode_output->rb;
 			break;
         case I_LEAQ:
-            srcB = decode_output->rb;
-			destE = decode_output->ra;
+            srcB = sim.decode_output->rb;
+			destE = sim.decode_output->ra;
 			break;
 		case I_MRMOVQ:
             //m1.y0 - Should we updating srcA ?
-			srcB = decode_output->rb;
-			destM = decode_output->ra;
+			srcB = sim.decode_output->rb;
+			destM = sim.decode_output->ra;
 			break;
         case I_VECADD:
         case I_SHF:
 		case I_ALU:
-			srcA = decode_output->ra;
-			srcB = decode_output->rb;
-			destE = decode_output->rb;
+			srcA = sim.decode_output->ra;
+			srcB = sim.decode_output->rb;
+			destE = sim.decode_output->rb;
     		break;
 
 		case I_JMP: break;
@@ -763,7 +2536,7 @@ void do_decode_stage()
     	case I_CALL:
 			srcB = REG_RSP;
 			destE = REG_RSP;
-            vala = decode_output -> valp;
+            vala = sim.decode_output -> valp;
 			break;
 
 		case I_RET:
@@ -773,7 +2546,7 @@ void do_decode_stage()
 			break;
 
 		case I_PUSHQ:
-			srcA = decode_output->ra;
+			srcA = sim.decode_output->ra;
 			srcB = REG_RSP;
 			destE = REG_RSP;
 			break;
@@ -782,11 +2555,11 @@ void do_decode_stage()
             srcA = REG_RSP;
 			srcB = REG_RSP;
 			destE = REG_RSP;
-			destM = decode_output->ra;
+			destM = sim.decode_output->ra;
 			break;
 
 		default:
-			printf("icode is not valid (%d)", decode_output->icode);
+			TRACE(2, TRACE_DECODE, "\tDecode: icode is not valid (%d)\n", sim.decode_output->icode);
 			break;
 	}
 
@@ -812,57 +2585,70 @@ void do_decode_stage()
     //WriteBack variables - use the dummy placeholders at the top of the stage
     // - do something similar for memory variables
 
-    if(decode_output -> icode == I_CALL || decode_output -> icode == I_JMP) {
-        printf("DECODE_FORWARD_SRCA: CALL/JMP\n");
-        vala  = decode_output -> valp;
-    } else if(srcA == memory_input -> deste && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : e_dstE\n");
-        vala = memory_input -> vale; //m1.yo - should be going here; ?
-    } else if(srcA == memory_output -> destm && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : M_dstM\n");
-        vala = writeback_input -> valm;
-    } else if(srcA == memory_output -> deste && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : M_dstE\n");
-        vala = memory_output -> vale;
-    } else if(srcA == wb_destM && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : W_dstM\n");
-        vala = wb_valM;
-    } else if(srcA == wb_destE && srcA != 15) {
-        printf("DECODE_FORWARD_SRCA : W_dstE\n");
-        vala = wb_valE;
+    if(sim.decode_output -> icode == I_CALL || sim.decode_output -> icode == I_JMP) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valA = valP for CALL/JMP\n");
+        d_fwd_a = FWD_VALP;
+        vala  = sim.decode_output -> valp;
+    } else if(srcA == sim.memory_input -> deste && srcA != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from e_dstE\n");
+        d_fwd_a = FWD_E_DSTE;
+        vala = sim.memory_input -> vale; //m1.yo - should be going here; ?
+    } else if(srcA == sim.memory_output -> destm && srcA != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from M_dstM\n");
+        d_fwd_a = FWD_M_DSTM;
+        vala = sim.writeback_input -> valm;
+    } else if(srcA == sim.memory_output -> deste && srcA != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from M_dstE\n");
+        d_fwd_a = FWD_M_DSTE;
+        vala = sim.memory_output -> vale;
+    } else if(srcA == sim.wb_destM && srcA != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from W_dstM\n");
+        d_fwd_a = FWD_W_DSTM;
+        vala = sim.wb_valM;
+    } else if(srcA == sim.wb_destE && srcA != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valA forwarded from W_dstE\n");
+        d_fwd_a = FWD_W_DSTE;
+        vala = sim.wb_valE;
     } else {
-        vala = get_reg_val(reg, srcA); //m1.yo - is going here instead; ?
+        d_fwd_a = FWD_REG;
+        vala = get_reg_val(sim.reg, srcA); //m1.yo - is going here instead; ?
     }
     
     //Copy and paste for valb?
     //From diagram - no valp case
-    if(srcB == memory_input -> deste && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : e_dstE\n");
-        valb = memory_input -> vale;
-    } else if(srcB == memory_output -> destm && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : M_dstM\n");
-        valb = writeback_input -> valm;
-    } else if(srcB == memory_output -> deste && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : M_dstE\n");
-        valb = memory_output -> vale;
-    } else if(srcB == wb_destM && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : W_dstM\n");
-        valb = wb_valM;
-    } else if(srcB == wb_destE && srcB != 15) {
-        printf("DECODE_FORWARD_SRCB : W_dstE\n");
-        valb = wb_valE;
+    if(srcB == sim.memory_input -> deste && srcB != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from e_dstE\n");
+        d_fwd_b = FWD_E_DSTE;
+        valb = sim.memory_input -> vale;
+    } else if(srcB == sim.memory_output -> destm && srcB != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from M_dstM\n");
+        d_fwd_b = FWD_M_DSTM;
+        valb = sim.writeback_input -> valm;
+    } else if(srcB == sim.memory_output -> deste && srcB != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from M_dstE\n");
+        d_fwd_b = FWD_M_DSTE;
+        valb = sim.memory_output -> vale;
+    } else if(srcB == sim.wb_destM && srcB != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from W_dstM\n");
+        d_fwd_b = FWD_W_DSTM;
+        valb = sim.wb_valM;
+    } else if(srcB == sim.wb_destE && srcB != 15) {
+        TRACE(3, TRACE_DECODE, "\tDecode: valB forwarded from W_dstE\n");
+        d_fwd_b = FWD_W_DSTE;
+        valb = sim.wb_valE;
     } else {
-        valb = get_reg_val(reg, srcB);
+        d_fwd_b = FWD_REG;
+        valb = get_reg_val(sim.reg, srcB);
     }
     
-    wb_destE = writeback_output->deste;
-    wb_valE  = writeback_output->vale;
-    wb_destM = writeback_output->destm;
-    wb_valM  = writeback_output->valm;
+    sim.wb_destE = sim.writeback_output->deste;
+    sim.wb_valE  = sim.writeback_output->vale;
+    sim.wb_destM = sim.writeback_output->destm;
+    sim.wb_valM  = sim.writeback_output->valm;
 
-    execute_input->icode = decode_output->icode;
-    execute_input->ifun = decode_output->ifun;
-    execute_input->valc = decode_output->valc;
+    sim.execute_input->icode = sim.decode_output->icode;
+    sim.execute_input->ifun = sim.decode_output->ifun;
+    sim.execute_input->valc = sim.decode_output->valc;
 
     /*if(decode_output -> icode == I_CALL) {
         execute_input -> vala = decode_output -> valp;
@@ -870,15 +2656,15 @@ void do_decode_stage()
         execute_input->vala = vala;
     }*/
 
-    execute_input->vala = vala;
+    sim.execute_input->vala = vala;
 
-    execute_input->valb = valb;
-    execute_input->srca = srcA;
-    execute_input->srcb = srcB;
-    execute_input->deste = destE;
-    execute_input->destm = destM;
-    execute_input->status = decode_output->status;
-    execute_input -> stage_pc = decode_output -> stage_pc;
+    sim.execute_input->valb = valb;
+    sim.execute_input->srca = srcA;
+    sim.execute_input->srcb = srcB;
+    sim.execute_input->deste = destE;
+    sim.execute_input->destm = destM;
+    sim.execute_input->status = sim.decode_output->status;
+    sim.execute_input -> stage_pc = sim.decode_output -> stage_pc;
     /* your implementation */
 }
 word_t compute_shf(alu_t op, word_t argA, word_t argB)
@@ -916,108 +2702,108 @@ word_t compute_vecadd(alu_t op, word_t argA, word_t argB)
 void do_execute_stage()
 {
     /* dummy placeholders, replace them with your implementation */
-    cc_in = cc; /* should not overwrite original cc */
+    sim.cc_in = sim.cc; /* should not overwrite original cc */
     /* some useful variables for logging purpose */
     bool setcc = false;
     alu_t alufun = A_NONE;
     word_t alua, alub;
     alua = alub = 0;
-    alua = execute_output -> vala;
-    alub = execute_output -> valb;
+    alua = sim.execute_output -> vala;
+    alub = sim.execute_output -> valb;
 
     word_t vale = 0;
     bool cnd = false;
-    byte_t deste = execute_output->deste;
+    byte_t deste = sim.execute_output->deste;
     
     //memory_input->takebranch = false;
 
 
-    switch (execute_output->icode) {
+    switch (sim.execute_output->icode) {
 	    case I_HALT: break;
 
 		case I_NOP: break;
 
 		case I_RRMOVQ: // aka CMOVQ
-			cnd = cond_holds(cc, execute_output->ifun);
-			vale = execute_output->vala;
+			cnd = cond_holds(sim.cc, sim.execute_output->ifun);
+			vale = sim.execute_output->vala;
 			if (!cnd) {
 				deste = REG_NONE;
 			}
 			break;
 
 		case I_IRMOVQ:
-			vale = execute_output->valc;
-            alua = execute_output -> valc;
-            alub = execute_output -> vala;
+			vale = sim.execute_output->valc;
+            alua = sim.execute_output -> valc;
+            alub = sim.execute_output -> vala;
 			break;
 
 		case I_RMMOVQ:
-			vale = execute_output->valb + execute_output->valc;
-            alua = execute_output -> valc;
-            alub = execute_output -> valb;
+			vale = sim.execute_output->valb + sim.execute_output->valc;
+            alua = sim.execute_output -> valc;
+            alub = sim.execute_output -> valb;
 			break;
 
         case I_LEAQ:
 		case I_MRMOVQ:
-			vale = execute_output->valb + execute_output->valc;
+			vale = sim.execute_output->valb + sim.execute_output->valc;
 			break;
         
         case I_SHF:
-            vale = compute_shf(execute_output->ifun, alua, alub);
+            vale = compute_shf(sim.execute_output->ifun, alua, alub);
             // cc_in = compute_cc(execute_output->ifun, alua, alub);
 
-            cc_in = 0;
+            sim.cc_in = 0;
             bool zf = vale == 0;
             // bool sf = (vale & 0x8000000000000000) >> 15;
             bool sf = (vale & 0x8000000000000000) == (0x8000000000000000);
             if(zf != 0) {
-                cc_in = cc_in | 4;
+                sim.cc_in = sim.cc_in | 4;
             }
             if(sf) {
-                cc_in = cc_in | 2;
+                sim.cc_in = sim.cc_in | 2;
             }
 
             // setcc = true;
-            setcc = writeback_input -> status != STAT_ADR && writeback_input -> status != STAT_INS && writeback_input -> status != STAT_HLT
-                    && writeback_output -> status != STAT_ADR && writeback_output -> status != STAT_INS && writeback_output -> status != STAT_HLT;
+            setcc = sim.writeback_input -> status != STAT_ADR && sim.writeback_input -> status != STAT_INS && sim.writeback_input -> status != STAT_HLT
+                    && sim.writeback_output -> status != STAT_ADR && sim.writeback_output -> status != STAT_INS && sim.writeback_output -> status != STAT_HLT;
             break;
 
 		case I_ALU:
-            vale = compute_alu(execute_output->ifun, alua, alub);
-			cc_in = compute_cc(execute_output->ifun, alua, alub);
+            vale = compute_alu(sim.execute_output->ifun, alua, alub);
+			sim.cc_in = compute_cc(sim.execute_output->ifun, alua, alub);
 			// setcc = true;
             //From book p.493
             //Post: Observed no change
-            setcc = writeback_input -> status != STAT_ADR && writeback_input -> status != STAT_INS && writeback_input -> status != STAT_HLT
-                    && writeback_output -> status != STAT_ADR && writeback_output -> status != STAT_INS && writeback_output -> status != STAT_HLT;
+            setcc = sim.writeback_input -> status != STAT_ADR && sim.writeback_input -> status != STAT_INS && sim.writeback_input -> status != STAT_HLT
+                    && sim.writeback_output -> status != STAT_ADR && sim.writeback_output -> status != STAT_INS && sim.writeback_output -> status != STAT_HLT;
             break;
         
         case I_VECADD:
-            vale = compute_vecadd(execute_output->ifun, alua, alub);
-			cc_in = compute_cc(execute_output->ifun, alua, alub);
+            vale = compute_vecadd(sim.execute_output->ifun, alua, alub);
+			sim.cc_in = compute_cc(sim.execute_output->ifun, alua, alub);
 			// setcc = true;
             //From book p.493
             //Post: Observed no change
-            cc_in = 0;
+            sim.cc_in = 0;
             bool zff = vale == 0;
             // bool sf = (vale & 0x8000000000000000) >> 15;
             bool sff = (vale & 0x8000000000000000) == (0x8000000000000000);
             if(zff != 0) {
-                cc_in = cc_in | 4;
+                sim.cc_in = sim.cc_in | 4;
             }
             if(sff) {
-                cc_in = cc_in | 2;
+                sim.cc_in = sim.cc_in | 2;
             }
 
 
-            setcc = writeback_input -> status != STAT_ADR && writeback_input -> status != STAT_INS && writeback_input -> status != STAT_HLT
-                    && writeback_output -> status != STAT_ADR && writeback_output -> status != STAT_INS && writeback_output -> status != STAT_HLT;
+            setcc = sim.writeback_input -> status != STAT_ADR && sim.writeback_input -> status != STAT_INS && sim.writeback_input -> status != STAT_HLT
+                    && sim.writeback_output -> status != STAT_ADR && sim.writeback_output -> status != STAT_INS && sim.writeback_output -> status != STAT_HLT;
              
             break;
 
 		case I_JMP:
             alua = 0;
-			cnd = cond_holds(cc, execute_output->ifun);
+			cnd = cond_holds(sim.cc, sim.execute_output->ifun);
             //cc_in = compute_cc(execute_output->ifun, alua, alub);
             
             //Maybe 
@@ -1025,61 +2811,64 @@ void do_execute_stage()
 
 		case I_CALL:
 			alua = -8;
-            vale = execute_output->valb - 8;
+            vale = sim.execute_output->valb - 8;
 			break;
 
 		case I_RET:
             alua = 8;
-			vale = execute_output->valb + 8;
+			vale = sim.execute_output->valb + 8;
 			break;
 
 		case I_PUSHQ:
-			vale = execute_output->valb - 8;
+			vale = sim.execute_output->valb - 8;
 			break;
 
 		case I_POPQ:
-			vale = execute_output->valb + 8;
+			vale = sim.execute_output->valb + 8;
 			break;
 
 		default:
-			printf("icode is not valid (%d)", execute_output->icode);
+			TRACE(2, TRACE_EXECUTE, "\tExecute: icode is not valid (%d)\n", sim.execute_output->icode);
 		    break;
 	}
             
         
-    memory_input->takebranch=cnd;
+    sim.memory_input->takebranch=cnd;
+    if (sim.execute_output->icode == I_JMP && sim.execute_output->status == STAT_AOK)
+        bp_resolve(sim.execute_output->stage_pc, sim.execute_output->ifun, cnd);
     //if(execute_output -> icode == I_JMP) {
     //    memory_input -> takebranch = true;
     //}
     
-    memory_input->icode = execute_output->icode;
+    sim.memory_input->icode = sim.execute_output->icode;
     
-    memory_input -> ifun = execute_output -> ifun;
-    memory_input->status = execute_output->status;
-    memory_input->vale = vale;
-    memory_input->vala = execute_output->vala;
-    memory_input->deste = deste;
-    memory_input->destm = execute_output->destm;
-    memory_input->srca = execute_output->srca;
-    memory_input -> stage_pc = execute_output -> stage_pc;
+    sim.memory_input -> ifun = sim.execute_output -> ifun;
+    sim.memory_input->status = sim.execute_output->status;
+    sim.memory_input->vale = vale;
+    sim.memory_input->vala = sim.execute_output->vala;
+    sim.memory_input->deste = deste;
+    sim.memory_input->destm = sim.execute_output->destm;
+    sim.memory_input->srca = sim.execute_output->srca;
+    sim.memory_input -> stage_pc = sim.execute_output -> stage_pc;
     //something wrong; when jne I get ? when it should be +
-    alufun = execute_output -> ifun;
+    alufun = sim.execute_output -> ifun;
     //printf("EX - ALUFUN = %d\n",op_name(alufun));
 
     /* your implementation */
 
     /* logging functions, do not change these */
-    if (execute_output->icode == I_JMP) {
-        sim_log("\tExecute: instr = %s, cc = %s, branch %staken\n",
-            iname(HPACK(execute_output->icode, execute_output->ifun)),
-            cc_name(cc),
-            memory_input->takebranch ? "" : "not ");
+    if (sim.execute_output->icode == I_JMP) {
+        TRACE(2, TRACE_EXECUTE, "\tExecute: instr = %s, cc = %s, branch %staken\n",
+            iname(HPACK(sim.execute_output->icode, sim.execute_output->ifun)),
+            cc_name(sim.cc),
+            sim.memory_input->takebranch ? "" : "not ");
     }
-    sim_log("\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
-        op_name(alufun), alua, alub, memory_input->vale);
-    if (setcc) {
-        cc = cc_in;
-	    sim_log("\tExecute: New cc=%s\n", cc_name(cc_in));
+    TRACE(2, TRACE_EXECUTE, "\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
+        op_name(alufun), alua, alub, sim.memory_input->vale);
+    /* Instructions fetched after a mispredicted ret must not set CC */
+    if (setcc && !m_ret_miss) {
+        sim.cc = sim.cc_in;
+	    TRACE(2, TRACE_EXECUTE, "\tExecute: New cc=%s\n", cc_name(sim.cc_in));
     }
 }
 
@@ -1091,17 +2880,17 @@ void do_execute_stage()
 void do_memory_stage()
 {
     /* dummy placeholders, replace them with your implementation */
-    mem_addr   = 0;
-    mem_data   = 0;
-    mem_write  = false;
-    mem_read   = false;
-    dmem_error = false;
+    sim.mem_addr   = 0;
+    sim.mem_data   = 0;
+    sim.mem_write  = false;
+    sim.mem_read   = false;
+    sim.dmem_error = false;
 
     word_t valm = 0;
 
-    switch (memory_output->icode) {
+    switch (sim.memory_output->icode) {
 			case I_HALT:
-				writeback_input->status = STAT_HLT;
+				sim.writeback_input->status = STAT_HLT;
 				break;
 
 			case I_NOP: break;
@@ -1112,16 +2901,16 @@ void do_memory_stage()
 
 			case I_RMMOVQ:
                 
-				mem_write = true;
-				mem_addr = memory_output->vale;
-				mem_data = memory_output->vala;
+				sim.mem_write = true;
+				sim.mem_addr = sim.memory_output->vale;
+				sim.mem_data = sim.memory_output->vala;
                 //Something similar to MRMOVQ but with vala instead?
-                dmem_error |= !get_word_val(mem, memory_output->vale, &valm);
+                sim.dmem_error |= !get_word_val(sim.mem, sim.memory_output->vale, &valm);
 				break;
             //case I_LEAQ:
 			case I_MRMOVQ:
                 //mem_read = true;
-				dmem_error |= !get_word_val(mem, memory_output->vale, &valm);
+				sim.dmem_error |= !get_word_val(sim.mem, sim.memory_output->vale, &valm);
 				break;
             case I_VECADD:
             case I_SHF:
@@ -1130,66 +2919,67 @@ void do_memory_stage()
 			case I_JMP: break;
 
 			case I_CALL:
-				mem_write = true;
-				mem_addr = memory_output->vale;
-				mem_data = memory_output->vala;
+				sim.mem_write = true;
+				sim.mem_addr = sim.memory_output->vale;
+				sim.mem_data = sim.memory_output->vala;
                 //in decode send valp to vala; only for call
                 //in execute send vala to vala; only for call
                 //??????? had to grab valp from decode @_@
 				break;
 
 			case I_RET:
-				dmem_error |= !get_word_val(mem, memory_output->vala, &valm);
+				sim.dmem_error |= !get_word_val(sim.mem, sim.memory_output->vala, &valm);
 				break;
 
 			case I_PUSHQ:
-				mem_write = true;
-				mem_addr = memory_output->vale;
-				mem_data = memory_output->vala;
-                dmem_error |= !get_word_val(mem, memory_output->vale, &valm);
+				sim.mem_write = true;
+				sim.mem_addr = sim.memory_output->vale;
+				sim.mem_data = sim.memory_output->vala;
+                sim.dmem_error |= !get_word_val(sim.mem, sim.memory_output->vale, &valm);
 				break;
 
 			case I_POPQ:
                 //mem_read = true;
-				dmem_error |= !get_word_val(mem, memory_output->vala, &valm);
+				sim.dmem_error |= !get_word_val(sim.mem, sim.memory_output->vala, &valm);
 				break;
 
 			default:
-				printf("icode is not valid (%d)", memory_output->icode);
+				TRACE(2, TRACE_MEMORY, "\tMemory: icode is not valid (%d)\n", sim.memory_output->icode);
 				break;
 		}
-        writeback_input->icode = memory_output->icode;
-        writeback_input->ifun = memory_output->ifun;
-        writeback_input->vale = memory_output->vale;
-        writeback_input->valm = valm;
-        writeback_input->deste = memory_output->deste;
-        writeback_input->destm = memory_output->destm;
-        writeback_input -> stage_pc = memory_output -> stage_pc;
+        sim.writeback_input->icode = sim.memory_output->icode;
+        sim.writeback_input->ifun = sim.memory_output->ifun;
+        sim.writeback_input->vale = sim.memory_output->vale;
+        sim.writeback_input->valm = valm;
+        sim.writeback_input->deste = sim.memory_output->deste;
+        sim.writeback_input->destm = sim.memory_output->destm;
+        sim.writeback_input -> stage_pc = sim.memory_output -> stage_pc;
 
         //writeback_input->status = memory_output->status;
         //From book p.492
-        if(dmem_error) {
-            writeback_input -> status = STAT_ADR;
+        if(sim.dmem_error) {
+            sim.writeback_input -> status = STAT_ADR;
         } else {
-            writeback_input->status = memory_output->status;
+            sim.writeback_input->status = sim.memory_output->status;
         }
+        m_ret_miss = sim.memory_output->icode == I_RET && bp_check_return(valm);
 
     /* your implementation */
 
-    if (mem_read) {
-        if ((dmem_error |= !get_word_val(mem, mem_addr, &mem_data))) {
-            sim_log("\tMemory: Couldn't Read from 0x%llx\n", mem_addr);
+    if (sim.mem_read) {
+        if ((sim.dmem_error |= !get_word_val(sim.mem, sim.mem_addr, &sim.mem_data))) {
+            TRACE(2, TRACE_MEMORY, "\tMemory: Couldn't Read from 0x%llx\n", sim.mem_addr);
         } else {
-            sim_log("\tMemory: Read 0x%llx from 0x%llx\n",
-                mem_data, mem_addr);
+            TRACE(2, TRACE_MEMORY, "\tMemory: Read 0x%llx from 0x%llx\n",
+                sim.mem_data, sim.mem_addr);
         }
     }
 
-    if (mem_write) {
-        if ((dmem_error |= !set_word_val(mem, mem_addr, mem_data))) {
-            sim_log("\tMemory: Couldn't write to address 0x%llx\n", mem_addr);
+    if (sim.mem_write) {
+        if ((sim.dmem_error |= !set_word_val_logged(sim.mem, sim.mem_addr, sim.mem_data))) {
+            TRACE(2, TRACE_MEMORY, "\tMemory: Couldn't write to address 0x%llx\n", sim.mem_addr);
         } else {
-            sim_log("\tMemory: Wrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
+            TRACE(2, TRACE_MEMORY, "\tMemory: Wrote 0x%llx to address 0x%llx\n", sim.mem_data, sim.mem_addr);
         }
     }
 }
@@ -1200,17 +2990,17 @@ void do_memory_stage()
 void do_writeback_stage()
 {
     /* dummy placeholders, replace them with your implementation */
-    wb_destE = writeback_output->deste;
-    wb_valE  = writeback_output->vale;
-    wb_destM = writeback_output->destm;
-    wb_valM  = writeback_output->valm;
+    sim.wb_destE = sim.writeback_output->deste;
+    sim.wb_valE  = sim.writeback_output->vale;
+    sim.wb_destM = sim.writeback_output->destm;
+    sim.wb_valM  = sim.writeback_output->valm;
 
     /* your implementation */
-    if(wb_destE != REG_NONE && ! imem_error && !dmem_error && instr_valid) {
-        set_reg_val(reg, wb_destE, wb_valE);
+    if(sim.wb_destE != REG_NONE && ! sim.imem_error && !sim.dmem_error && sim.instr_valid) {
+        set_reg_val_logged(sim.reg, sim.wb_destE, sim.wb_valE);
     }
-    if(wb_destM != REG_NONE && !imem_error && !dmem_error && instr_valid) {
-        set_reg_val(reg, wb_destM, wb_valM);
+    if(sim.wb_destM != REG_NONE && !sim.imem_error && !sim.dmem_error && sim.instr_valid) {
+        set_reg_val_logged(sim.reg, sim.wb_destM, sim.wb_valM);
     }
 
 
@@ -1220,23 +3010,23 @@ void do_writeback_stage()
     //From book ? I think this is wrong
     //Tested and proven to go from 147 to 145?
     
-    if(writeback_output -> status == STAT_BUB) {
-        status = STAT_AOK;
+    if(sim.writeback_output -> status == STAT_BUB) {
+        sim.status = STAT_AOK;
     } else {
-        status = writeback_output -> status;
+        sim.status = sim.writeback_output -> status;
     }
     
 
 
-    if (wb_destE != REG_NONE &&  writeback_output -> status == STAT_AOK) {
-	    sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
-		    wb_valE, reg_name(wb_destE));
-	    set_reg_val(reg, wb_destE, wb_valE);
+    if (sim.wb_destE != REG_NONE &&  sim.writeback_output -> status == STAT_AOK) {
+	    TRACE(2, TRACE_WRITEBACK, "\tWriteback: Wrote 0x%llx to register %s\n",
+		    sim.wb_valE, reg_name(sim.wb_destE));
+	    set_reg_val_logged(sim.reg, sim.wb_destE, sim.wb_valE);
     }
-    if (wb_destM != REG_NONE &&  writeback_output -> status == STAT_AOK) {
-	    sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
-		    wb_valM, reg_name(wb_destM));
-	    set_reg_val(reg, wb_destM, wb_valM);
+    if (sim.wb_destM != REG_NONE &&  sim.writeback_output -> status == STAT_AOK) {
+	    TRACE(2, TRACE_WRITEBACK, "\tWriteback: Wrote 0x%llx to register %s\n",
+		    sim.wb_valM, reg_name(sim.wb_destM));
+	    set_reg_val_logged(sim.reg, sim.wb_destM, sim.wb_valM);
     }
 
 }
@@ -1246,7 +3036,7 @@ p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
 {
     if (stall) {
         if (bubble) {
-            sim_log("%s: Conflicting control signals for pipe register\n",
+            TRACE(2, TRACE_CONTROL, "%s: Conflicting control signals for pipe register\n",
                 name);
             return P_ERROR;
         } else
@@ -1267,10 +3057,13 @@ p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
 void do_stall_check()
 {
     //I DONT THINK CC IS BEING SET CORRECTLY
-    bool returnHazard = (decode_output -> icode == I_RET || execute_output -> icode == I_RET || memory_output -> icode == I_RET);
-    bool loadUseHazard = ((execute_output -> icode == I_MRMOVQ || execute_output -> icode == I_POPQ) && (execute_output -> destm == execute_input -> srca || execute_output -> destm == execute_input -> srcb));
-    bool mispredictedBranchHazard = execute_output -> icode == I_JMP && !(memory_input -> takebranch);
-    printf("SC - BB ICODE %d cc %d\n", execute_output -> icode, cc);
+    /* Only rets the return address stack had no prediction for */
+    bool returnHazard = (sim.decode_output -> icode == I_RET && !((pred_ptr) pred_state[0]->output)->ras)
+            || (sim.execute_output -> icode == I_RET && !((pred_ptr) pred_state[1]->output)->ras)
+            || (sim.memory_output -> icode == I_RET && !((pred_ptr) pred_state[2]->output)->ras);
+    bool loadUseHazard = ((sim.execute_output -> icode == I_MRMOVQ || sim.execute_output -> icode == I_POPQ) && (sim.execute_output -> destm == sim.execute_input -> srca || sim.execute_output -> destm == sim.execute_input -> srcb));
+    bool mispredictedBranchHazard = sim.execute_output -> icode == I_JMP && sim.memory_input -> takebranch != ((pred_ptr) pred_state[1]->output)->taken;
+    TRACE(3, TRACE_CONTROL, "\tControl: E icode = %d, cc = %s\n", sim.execute_output -> icode, cc_name(sim.cc));
     bool comboA = mispredictedBranchHazard && returnHazard;
     bool comboB = loadUseHazard && returnHazard;
 
@@ -1278,8 +3071,8 @@ void do_stall_check()
     //From book p.494
     //Post: Seems to work with no downsides! Ptest does not better
     //
-    bool mBubble = writeback_input -> status == STAT_ADR || writeback_input -> status == STAT_INS || writeback_input -> status == STAT_HLT
-            || writeback_output -> status == STAT_ADR || writeback_output -> status == STAT_INS || writeback_output -> status == STAT_HLT;
+    bool mBubble = sim.writeback_input -> status == STAT_ADR || sim.writeback_input -> status == STAT_INS || sim.writeback_input -> status == STAT_HLT
+            || sim.writeback_output -> status == STAT_ADR || sim.writeback_output -> status == STAT_INS || sim.writeback_output -> status == STAT_HLT;
     
     //Continuing p.494
     //CANCELLED - not sure if it will provide benefits
@@ -1287,48 +3080,55 @@ void do_stall_check()
     
     
     // printf("SC - RETURN - %d\nSC - LOAD_USE - %d\nSC - MISPREDICTED_BRANCH - %d\n",returnHazard, loadUseHazard, mispredictedBranchHazard);
-    if(comboB) {
+    if(m_ret_miss) {
+        // The wrong path after the ret is in F, D and E; W redirects fetch
+        sim.fetch_state -> op = pipe_cntl("PC", false, false);
+        sim.decode_state -> op = pipe_cntl("ID", false, true);
+        sim.execute_state -> op = pipe_cntl("EX", false, true);
+        sim.memory_state -> op = pipe_cntl("MEM", false, true);
+        sim.writeback_state -> op = pipe_cntl("WB", false, false);
+    } else if(comboB) {
         // printf("SC -> COMBO_B\n");
-        fetch_state -> op = pipe_cntl("PC", true, false);
-        decode_state -> op = pipe_cntl("ID", true, false);
-        execute_state -> op = pipe_cntl("EX", false, true);
-        memory_state -> op = pipe_cntl("MEM", false, mBubble);
-        writeback_state -> op = pipe_cntl("WB", false, false);
+        sim.fetch_state -> op = pipe_cntl("PC", true, false);
+        sim.decode_state -> op = pipe_cntl("ID", true, false);
+        sim.execute_state -> op = pipe_cntl("EX", false, true);
+        sim.memory_state -> op = pipe_cntl("MEM", false, mBubble);
+        sim.writeback_state -> op = pipe_cntl("WB", false, false);
     } else if(comboA) {
         // printf("SC ->  COMBO_A\n");
-        fetch_state -> op = pipe_cntl("PC", true, false);
-        decode_state -> op = pipe_cntl("ID", false, true);
-        execute_state -> op = pipe_cntl("EX", false, true);
-        memory_state -> op = pipe_cntl("MEM", false, mBubble);
-        writeback_state -> op = pipe_cntl("WB", false, false);
+        sim.fetch_state -> op = pipe_cntl("PC", true, false);
+        sim.decode_state -> op = pipe_cntl("ID", false, true);
+        sim.execute_state -> op = pipe_cntl("EX", false, true);
+        sim.memory_state -> op = pipe_cntl("MEM", false, mBubble);
+        sim.writeback_state -> op = pipe_cntl("WB", false, false);
     } else if(returnHazard) {
         // printf("SC -> RETURN\n");
-        fetch_state -> op = pipe_cntl("PC", true, false);
-        decode_state -> op = pipe_cntl("ID", false, true);
-        execute_state -> op = pipe_cntl("EX", false, false);
-        memory_state -> op = pipe_cntl("MEM", false, mBubble);
-        writeback_state -> op = pipe_cntl("WB", false, false);
+        sim.fetch_state -> op = pipe_cntl("PC", true, false);
+        sim.decode_state -> op = pipe_cntl("ID", false, true);
+        sim.execute_state -> op = pipe_cntl("EX", false, false);
+        sim.memory_state -> op = pipe_cntl("MEM", false, mBubble);
+        sim.writeback_state -> op = pipe_cntl("WB", false, false);
     } else if(loadUseHazard) {
         // printf("SC -> LOAD_USE\n");
-        fetch_state -> op = pipe_cntl("PC", true, false);
-        decode_state -> op = pipe_cntl("ID", true, false);
-        execute_state -> op = pipe_cntl("EX", false, true);
-        memory_state -> op = pipe_cntl("MEM", false, mBubble);
-        writeback_state -> op = pipe_cntl("WB", false, false);
+        sim.fetch_state -> op = pipe_cntl("PC", true, false);
+        sim.decode_state -> op = pipe_cntl("ID", true, false);
+        sim.execute_state -> op = pipe_cntl("EX", false, true);
+        sim.memory_state -> op = pipe_cntl("MEM", false, mBubble);
+        sim.writeback_state -> op = pipe_cntl("WB", false, false);
     } else if(mispredictedBranchHazard) {
         // printf("SC -> MISPREDICTED_BRANCH\n");
-        fetch_state -> op = pipe_cntl("PC", false, false);
-        decode_state -> op = pipe_cntl("ID", false, true);
-        execute_state -> op = pipe_cntl("EX", false, true);
-        memory_state -> op = pipe_cntl("MEM", false, mBubble);
-        writeback_state -> op = pipe_cntl("WB", false, false);
+        sim.fetch_state -> op = pipe_cntl("PC", false, false);
+        sim.decode_state -> op = pipe_cntl("ID", false, true);
+        sim.execute_state -> op = pipe_cntl("EX", false, true);
+        sim.memory_state -> op = pipe_cntl("MEM", false, mBubble);
+        sim.writeback_state -> op = pipe_cntl("WB", false, false);
     } else {
         // printf("SC -> ELSE\n");
-        fetch_state -> op = pipe_cntl("PC", false, false);
-        decode_state -> op = pipe_cntl("ID", false, false);
-        execute_state -> op = pipe_cntl("EX", false, false);
-        memory_state -> op = pipe_cntl("MEM", false, mBubble);
-        writeback_state -> op = pipe_cntl("WB", false, false);
+        sim.fetch_state -> op = pipe_cntl("PC", false, false);
+        sim.decode_state -> op = pipe_cntl("ID", false, false);
+        sim.execute_state -> op = pipe_cntl("EX", false, false);
+        sim.memory_state -> op = pipe_cntl("MEM", false, mBubble);
+        sim.writeback_state -> op = pipe_cntl("WB", false, false);
     }
         // fetch_state -> op = pipe_cntl("PC", false, false);
         // decode_state -> op = pipe_cntl("ID", false, false);
@@ -1377,7 +3177,8 @@ word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *c
     word_t icount     = 0;
     word_t ccount     = 0;
     byte_t run_status = STAT_AOK;
-    while (icount < max_instr && ccount < max_cycle) {
+    while (icount < max_instr && ccount < max_cycle
+           && !atomic_load_explicit(&check_diverged, memory_order_relaxed)) {
         run_status = sim_step_pipe(ccount);
         if (run_status != STAT_BUB)
             icount++;
@@ -1388,7 +3189,7 @@ word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *c
     if (statusp)
 	    *statusp = run_status;
     if (ccp)
-	    *ccp = cc;
+	    *ccp = sim.cc;
     return icount;
 }
 
@@ -1405,7 +3206,7 @@ void sim_run_cycle(word_t *icount, word_t* ccount, byte_t *statusp, cc_t *ccp)
     if (statusp)
 	    *statusp = run_status;
     if (ccp)
-	    *ccp = cc;
+	    *ccp = sim.cc;
 }
 
 /*
@@ -1431,27 +3232,57 @@ void sim_log( const char *format, ... ) {
  ******************************************************************************/
 
 #define MAX_STAGE 10
+#define PIPE_ALIGN 64           /* cache line */
+#define PIPE_ARENA 4096
 
 /******************************************************************************
  *	static variables
  ******************************************************************************/
 
-static pipe_ptr pipes[MAX_STAGE];
-static int pipe_count = 0;
+/*
+ * Each pipe has three slots in one cache-aligned arena: two that input and
+ * output take turns in, and a private copy of its bubble value. P_LOAD
+ * hands the input slot over as the new output and P_BUBBLE points output
+ * at the bubble slot, so neither copies register contents. The stage
+ * aliases (fetch_input, decode_output, ...) follow through connect_pipes().
+ */
+static SIM_LOCAL pipe_ele pipe_eles[MAX_STAGE];
+static SIM_LOCAL pipe_ptr pipes[MAX_STAGE];
+static SIM_LOCAL int pipe_count = 0;
+static SIM_LOCAL byte_t pipe_arena[PIPE_ARENA] __attribute__((aligned(PIPE_ALIGN)));
+static SIM_LOCAL size_t pipe_arena_used = 0;
+static SIM_LOCAL byte_t *pipe_slots[MAX_STAGE];   /* first of the three slots */
+static SIM_LOCAL size_t pipe_stride[MAX_STAGE];
 
 /******************************************************************************
  *	function definitions
  ******************************************************************************/
 
+/* The one of the two register slots of pipe s that slot is not */
+static inline void *other_slot(int s, void *slot)
+{
+    return slot == pipe_slots[s] ? pipe_slots[s] + pipe_stride[s] : pipe_slots[s];
+}
+
 /* Create new pipe with count bytes of state */
 /* bubble_val indicates state corresponding to pipeline bubble */
 pipe_ptr new_pipe(int count, void *bubble_val)
 {
-    pipe_ptr result = (pipe_ptr) malloc(sizeof(pipe_ele));
-    result->output = malloc(count);
-    result->input = malloc(count);
-    memcpy(result->output, bubble_val, count);
-    memcpy(result->input, bubble_val, count);
+    int s = pipe_count;
+    size_t stride = (count + PIPE_ALIGN - 1) & ~(size_t) (PIPE_ALIGN - 1);
+    pipe_ptr result = &pipe_eles[s];
+
+    if (pipe_arena_used + 3 * stride <= PIPE_ARENA) {
+        pipe_slots[s] = pipe_arena + pipe_arena_used;
+        pipe_arena_used += 3 * stride;
+    } else {
+        pipe_slots[s] = aligned_alloc(PIPE_ALIGN, 3 * stride);
+    }
+    pipe_stride[s] = stride;
+    for (int i = 0; i < 3; i++)
+        memcpy(pipe_slots[s] + i * stride, bubble_val, count);
+    result->output = pipe_slots[s];
+    result->input = pipe_slots[s] + stride;
     result->count = count;
     result->op = P_LOAD;
     result->bubble_val = bubble_val;
@@ -1464,40 +3295,51 @@ void update_pipes()
 {
     int s;
     for (s = 0; s < pipe_count; s++) {
-    pipe_ptr p = pipes[s];
-    switch (p->op)
-    {
-    case P_BUBBLE:
-        /* insert a bubble into the next stage */
-        memcpy(p->output, p->bubble_val, p->count);
-        break;
-
-    case P_LOAD:
-        /* copy calculated state from previous stage */
-        memcpy(p->output, p->input, p->count);
-        break;
-    case P_ERROR:
-        /* Like a bubble, but insert error condition */
-        memcpy(p->output, p->bubble_val, p->count);
-        break;
-    case P_STALL:
-    default:
-        /* do nothing: next stage gets same instr again */
-        ;
-    }
-    if (p->op != P_ERROR)
-        p->op = P_LOAD;
+        pipe_ptr p = pipes[s];
+        switch (p->op)
+        {
+        case P_BUBBLE:
+            /* insert a bubble into the next stage */
+            p->output = pipe_slots[s] + 2 * pipe_stride[s];
+            break;
+
+        case P_LOAD:
+            /* calculated state from previous stage becomes the output */
+            p->output = p->input;
+            p->input = other_slot(s, p->output);
+            break;
+        case P_ERROR:
+            /* Like a bubble, but the error status gets written into it */
+            p->output = other_slot(s, p->input);
+            memcpy(p->output, p->bubble_val, p->count);
+            break;
+        case P_STALL:
+        default:
+            /* do nothing: next stage gets same instr again */
+            ;
+        }
+        if (p->op != P_ERROR)
+            p->op = P_LOAD;
     }
 }
 
+/* Put saved input and output contents back into pipe p */
+void load_pipe(pipe_ptr p, void *input, void *output)
+{
+    int s = p - pipe_eles;
+    p->output = pipe_slots[s];
+    p->input = pipe_slots[s] + pipe_stride[s];
+    memcpy(p->input, input, p->count);
+    memcpy(p->output, output, p->count);
+}
+
 /* Set all pipes to bubble values */
 void clear_pipes()
 {
-  int s;
+    int s;
     for (s = 0; s < pipe_count; s++) {
         pipe_ptr p = pipes[s];
-        memcpy(p->output, p->bubble_val, p->count);
-        memcpy(p->input, p->bubble_val, p->count);
+        load_pipe(p, p->bubble_val, p->bubble_val);
         p->op = P_LOAD;
     }
 }
@@ -1520,7 +3362,8 @@ writeback_ele bubble_writeback = { I_NOP, 0, 0, 0, REG_NONE, REG_NONE,
 typedef struct pipe_restore_struct {
     processor_state_t state;
     word_t cycles;
-    pipe_ptr pipes[5];
+    pipe_ptr pipes[MAX_STAGE];
+    bp_saved_t bp;
     struct pipe_restore_struct *next;
 } pipe_restore_t;
 
@@ -1537,10 +3380,17 @@ void help() {
     printf("arch              -  display processor state\n");
     printf("undo n            -  steps back n instructions\n");
     printf("back n            -  steps back n cycles\n");
+    printf("break pc|cycle n  -  stops run when the fetch PC or cycle count reaches n\n");
+    printf("watch addr        -  stops run when the word at addr changes\n");
+    printf("delete n          -  removes breakpoint n\n");
+    printf("breakpoints       -  lists breakpoints\n");
+    printf("run               -  runs without history until a breakpoint or halt\n");
     printf("pipe X            -  displays pipeline info for stage X (f, d, e, m , w) \n");
     printf("quit              -  exit the program\n\n");
 }
 
+static void free_restore_point(pipe_restore_t *pipe_restore_point);
+
 static pipe_restore_t *create_pipe_restore_point(word_t *icount, word_t* ccount, byte_t *statusp, cc_t *ccp) {
     pipe_restore_t *pipe_restore_point = malloc(sizeof(pipe_restore_t));
     pipe_restore_point->state.cc = *ccp;
@@ -1558,11 +3408,13 @@ static pipe_restore_t *create_pipe_restore_point(word_t *icount, word_t* ccount,
         memcpy(pipe_restore_point->pipes[s]->input, p->input, p->count);
         memcpy(pipe_restore_point->pipes[s]->output, p->output, p->count);
     }
-    mem_t previous_memory = copy_mem(mem);
-    mem_t previous_registers = copy_mem(reg);
+    mem_undo = pipe_restore_point->state.memory = calloc(1, sizeof(memory_restore_t));
+    reg_undo = pipe_restore_point->state.registers = calloc(1, sizeof(memory_restore_t));
+    bp_save(&pipe_restore_point->bp, false);
+    bp_log = &pipe_restore_point->bp;
     sim_run_cycle(icount, ccount, statusp, ccp);
-    pipe_restore_point->state.memory = create_memory_restore(previous_memory, mem);
-    pipe_restore_point->state.registers = create_memory_restore(previous_registers, reg);
+    mem_undo = reg_undo = NULL;
+    bp_log = NULL;
     return pipe_restore_point;
 }
 
@@ -1572,12 +3424,21 @@ static void restore_pipes_and_free(pipe_restore_t *pipe_restore_point) {
         p->bubble_val = pipe_restore_point->pipes[s]->bubble_val;
         p->op = pipe_restore_point->pipes[s]->op;
         p->count = pipe_restore_point->pipes[s]->count;
-        memcpy(p->input, pipe_restore_point->pipes[s]->input, p->count);
-        memcpy(p->output, pipe_restore_point->pipes[s]->output, p->count);
+        load_pipe(p, pipe_restore_point->pipes[s]->input, pipe_restore_point->pipes[s]->output);
+    }
+    connect_pipes();
+    bp_load(&pipe_restore_point->bp);
+    free_restore_point(pipe_restore_point);
+}
+
+/* Free a restore point without applying it */
+static void free_restore_point(pipe_restore_t *pipe_restore_point) {
+    for (int s = 0; s < pipe_count; s++) {
         free(pipe_restore_point->pipes[s]->output);
         free(pipe_restore_point->pipes[s]->input);
         free(pipe_restore_point->pipes[s]);
     }
+    bp_saved_free(&pipe_restore_point->bp);
 
     if (pipe_restore_point->state.memory->positions != NULL)
         free(pipe_restore_point->state.memory->positions);
@@ -1594,10 +3455,374 @@ static void restore_pipes_and_free(pipe_restore_t *pipe_restore_point) {
     free(pipe_restore_point);
 }
 
+/*
+ * Time travel for the interactive mode. Every snapshot_interval cycles the
+ * whole simulator state goes into a snapshot, with memory and registers
+ * kept as diffs against the loaded image. Per-cycle restore points are only
+ * kept back to the latest snapshot, so a short step back just pops them.
+ * Going back further restores the nearest earlier snapshot and re-simulates
+ * forward, which gives the same state because the simulator is
+ * deterministic. Once the snapshots outgrow history_budget, every other one
+ * is dropped and the rest are simply further apart.
+ */
+typedef struct {
+    word_t cycles;              /* ccount when it was taken */
+    processor_state_t state;    /* memory and registers as diffs from mem0/reg0 */
+    byte_t *pipe_state;
+    word_t sim_cycles;
+    word_t sim_instructions;
+    int starting_up;
+    bp_saved_t bp;
+    size_t bytes;
+} snapshot_t;
+
+static snapshot_t *snapshots = NULL;    /* in cycle order */
+static int snapshot_count = 0;
+static size_t snapshot_bytes = 0;
+static pipe_restore_t *restore_head = NULL;
+static word_t restore_base = 0;         /* cycle the oldest restore point goes back to */
+static mem_t history_mem0, history_reg0;
+
+/* Return the positions and values where m differs from base */
+static memory_restore_t *diff_image(mem_t base, mem_t m)
+{
+    memory_restore_t *d = calloc(1, sizeof(memory_restore_t));
+    for (word_t i = 0; i < m->len; i++) {
+        if (m->contents[i] != base->contents[i])
+            d->count++;
+    }
+    d->positions = malloc(d->count * sizeof(word_t));
+    d->values = malloc(d->count);
+    for (word_t i = 0, k = 0; i < m->len; i++) {
+        if (m->contents[i] != base->contents[i]) {
+            d->positions[k] = i;
+            d->values[k++] = m->contents[i];
+        }
+    }
+    return d;
+}
+
+static void free_diff(memory_restore_t *d)
+{
+    free(d->positions);
+    free(d->values);
+    free(d);
+}
+
+/* Index of the latest snapshot taken at or before cycle, -1 if there is none */
+static int find_snapshot(word_t cycle)
+{
+    int i = snapshot_count - 1;
+    while (i >= 0 && snapshots[i].cycles > cycle)
+        i--;
+    return i;
+}
+
+static size_t pipe_state_bytes()
+{
+    size_t bytes = 0;
+    for (int s = 0; s < pipe_count; s++)
+        bytes += 2 * pipes[s]->count + sizeof(pipes[s]->op);
+    return bytes;
+}
+
+/* Drop every other snapshot, keeping the first and last, until within budget */
+static void thin_snapshots()
+{
+    while (snapshot_bytes > history_budget && snapshot_count > 2) {
+        int kept = 1;
+        for (int i = 1; i < snapshot_count; i++) {
+            if (i % 2 == 1 && i != snapshot_count - 1) {
+                snapshot_bytes -= snapshots[i].bytes;
+                free_diff(snapshots[i].state.memory);
+                free_diff(snapshots[i].state.registers);
+                free(snapshots[i].pipe_state);
+                bp_saved_free(&snapshots[i].bp);
+            } else {
+                snapshots[kept++] = snapshots[i];
+            }
+        }
+        snapshot_count = kept;
+    }
+}
+
+static void take_snapshot(word_t icount, word_t ccount, byte_t run_status)
+{
+    snapshot_t snap;
+    snap.cycles = ccount;
+    snap.state.cc = sim.cc;
+    snap.state.status = run_status;
+    snap.state.icount = icount;
+    snap.state.memory = diff_image(history_mem0, sim.mem);
+    snap.state.registers = diff_image(history_reg0, sim.reg);
+    snap.pipe_state = malloc(pipe_state_bytes());
+    byte_t *buf = snap.pipe_state;
+    for (int s = 0; s < pipe_count; s++) {
+        pipe_ptr p = pipes[s];
+        memcpy(buf, p->input, p->count);
+        memcpy(buf + p->count, p->output, p->count);
+        memcpy(buf + 2 * p->count, &p->op, sizeof(p->op));
+        buf += 2 * p->count + sizeof(p->op);
+    }
+    snap.sim_cycles = sim.cycles;
+    snap.sim_instructions = sim.instructions;
+    snap.starting_up = starting_up;
+    bp_save(&snap.bp, true);
+    snap.bytes = sizeof(snapshot_t) + pipe_state_bytes() + bp_tables_bytes()
+        + (snap.state.memory->count + snap.state.registers->count) * (sizeof(word_t) + 1);
+
+    int i = find_snapshot(ccount) + 1;
+    snapshots = realloc(snapshots, (snapshot_count + 1) * sizeof(snapshot_t));
+    memmove(&snapshots[i + 1], &snapshots[i], (snapshot_count - i) * sizeof(snapshot_t));
+    snapshots[i] = snap;
+    snapshot_count++;
+    snapshot_bytes += snap.bytes;
+    thin_snapshots();
+}
+
+static void free_restore_points()
+{
+    while (restore_head != NULL) {
+        pipe_restore_t *temp = restore_head;
+        restore_head = restore_head->next;
+        free_restore_point(temp);
+    }
+}
+
+static void load_snapshot(snapshot_t *snap, word_t *icount, word_t *ccount, byte_t *run_status, cc_t *ccp)
+{
+    memcpy(sim.mem->contents, history_mem0->contents, sim.mem->len);
+    apply_restore(sim.mem, snap->state.memory);
+    predecode_flush();
+    memcpy(sim.reg->contents, history_reg0->contents, sim.reg->len);
+    apply_restore(sim.reg, snap->state.registers);
+    byte_t *buf = snap->pipe_state;
+    for (int s = 0; s < pipe_count; s++) {
+        pipe_ptr p = pipes[s];
+        load_pipe(p, buf, buf + p->count);
+        memcpy(&p->op, buf + 2 * p->count, sizeof(p->op));
+        buf += 2 * p->count + sizeof(p->op);
+    }
+    connect_pipes();
+    sim.cc = *ccp = snap->state.cc;
+    sim.status = snap->state.status;
+    *run_status = sim.status;
+    *icount = snap->state.icount;
+    *ccount = snap->cycles;
+    sim.cycles = snap->sim_cycles;
+    sim.instructions = snap->sim_instructions;
+    starting_up = snap->starting_up;
+    bp_load(&snap->bp);
+
+    free_restore_points();
+    restore_base = *ccount;
+}
+
+/* Simulate one cycle, keeping what is needed to come back to it */
+static void history_step(word_t *icount, word_t *ccount, byte_t *statusp, cc_t *ccp)
+{
+    if (snapshot_count == 0 || *ccount - restore_base >= snapshot_interval) {
+        int i = find_snapshot(*ccount);
+        if (i < 0 || snapshots[i].cycles != *ccount)
+            take_snapshot(*icount, *ccount, *statusp);
+        free_restore_points();
+        restore_base = *ccount;
+    }
+    pipe_restore_t *new_restore_point = create_pipe_restore_point(icount, ccount, statusp, ccp);
+    new_restore_point->next = restore_head;
+    restore_head = new_restore_point;
+}
+
+/* Undo the most recent cycle that still has a restore point */
+static bool history_pop(word_t *icount, word_t *ccount, byte_t *run_status)
+{
+    if (restore_head == NULL)
+        return false;
+    sim.cc = restore_head->state.cc;
+    *icount = restore_head->state.icount;
+    *ccount = restore_head->cycles;
+    apply_restore(sim.mem, restore_head->state.memory);
+    predecode_flush();
+    apply_restore(sim.reg, restore_head->state.registers);
+    sim.status = restore_head->state.status;
+    *run_status = sim.status;
+    pipe_restore_t *temp = restore_head;
+    restore_head = restore_head->next;
+    restore_pipes_and_free(temp);
+    return true;
+}
+
+/* Go back to the given cycle, re-simulating from a snapshot if needed */
+static void history_rewind(word_t target, word_t *icount, word_t *ccount, byte_t *run_status, cc_t *ccp)
+{
+    if (target < restore_base) {
+        int i = find_snapshot(target);
+        if (i < 0)
+            return;
+        load_snapshot(&snapshots[i], icount, ccount, run_status, ccp);
+        FILE *saved_dumpfile = dumpfile;
+        dumpfile = NULL;
+        while (*ccount < target)
+            history_step(icount, ccount, run_status, ccp);
+        dumpfile = saved_dumpfile;
+    }
+    while (*ccount > target && history_pop(icount, ccount, run_status))
+        ;
+}
+
+/*
+ * Breakpoints for the interactive mode. run executes plain sim_run_cycle()
+ * calls with no restore points and no trace output until a breakpoint
+ * fires or the program stops, then takes a snapshot there so back and undo
+ * still work from that point.
+ */
+#define MAX_BREAKPOINTS 16
+
+typedef enum { BREAK_PC, BREAK_CYCLE, BREAK_WATCH } break_kind_t;
+
+typedef struct {
+    break_kind_t kind;
+    word_t value;           /* PC, cycle or watched address */
+    word_t old;             /* last value seen at a watched address */
+} breakpoint_t;
+
+static breakpoint_t breakpoints[MAX_BREAKPOINTS];
+static int breakpoint_count = 0;
+
+static void add_breakpoint(break_kind_t kind, word_t value)
+{
+    if (breakpoint_count == MAX_BREAKPOINTS) {
+        printf("Too many breakpoints (at most %d)\n", MAX_BREAKPOINTS);
+        return;
+    }
+    breakpoints[breakpoint_count].kind = kind;
+    breakpoints[breakpoint_count].value = value;
+    breakpoint_count++;
+    printf("Breakpoint %d set\n", breakpoint_count);
+}
+
+static void list_breakpoints()
+{
+    static const char *kinds[] = { "pc", "cycle", "watch" };
+    if (breakpoint_count == 0)
+        printf("No breakpoints\n");
+    for (int i = 0; i < breakpoint_count; i++) {
+        if (breakpoints[i].kind == BREAK_CYCLE)
+            printf("%d: cycle %lld\n", i + 1, breakpoints[i].value);
+        else
+            printf("%d: %s 0x%llx\n", i + 1, kinds[breakpoints[i].kind], breakpoints[i].value);
+    }
+}
+
+/* Run until a breakpoint fires or the program stops */
+static void run_to_breakpoint(word_t *icount, word_t *ccount, byte_t *run_status, cc_t *ccp)
+{
+    word_t icount_stored = *icount, ccount_stored = *ccount;
+    word_t last_pc = sim.f_pc;
+    int hit = -1;
+
+    if (*run_status != STAT_AOK && *run_status != STAT_BUB) {
+        printf("Simulator is in a non AOK state\n");
+        return;
+    }
+    /* back needs somewhere to re-simulate from if nothing ran before */
+    if (snapshot_count == 0)
+        take_snapshot(*icount, *ccount, *run_status);
+    for (int i = 0; i < breakpoint_count; i++) {
+        if (breakpoints[i].kind == BREAK_WATCH)
+            get_word_val(sim.mem, breakpoints[i].value, &breakpoints[i].old);
+    }
+
+    FILE *saved_dumpfile = dumpfile;
+    dumpfile = NULL;
+    while (hit < 0 && (*run_status == STAT_AOK || *run_status == STAT_BUB)) {
+        sim_run_cycle(icount, ccount, run_status, ccp);
+        for (int i = 0; i < breakpoint_count && hit < 0; i++) {
+            breakpoint_t *b = &breakpoints[i];
+            word_t val;
+            switch (b->kind) {
+            case BREAK_PC:
+                if (sim.f_pc == b->value && last_pc != b->value)
+                    hit = i;
+                break;
+            case BREAK_CYCLE:
+                if (*ccount == b->value)
+                    hit = i;
+                break;
+            case BREAK_WATCH:
+                if (get_word_val(sim.mem, b->value, &val) && val != b->old) {
+                    printf("Watched 0x%llx changed from 0x%llx to 0x%llx\n", b->value, b->old, val);
+                    b->old = val;
+                    hit = i;
+                }
+                break;
+            }
+        }
+        last_pc = sim.f_pc;
+    }
+    dumpfile = saved_dumpfile;
+
+    /* History restarts here; older cycles come back through the snapshots */
+    free_restore_points();
+    int i = find_snapshot(*ccount);
+    if (i < 0 || snapshots[i].cycles != *ccount)
+        take_snapshot(*icount, *ccount, *run_status);
+    restore_base = *ccount;
+
+    printf("Simulator ran %lld instructions in %lld cycles\n", *icount - icount_stored, *ccount - ccount_stored);
+    if (hit >= 0)
+        printf("Stopped at breakpoint %d\n", hit + 1);
+    else
+        printf("Simulator ran to completion\n");
+    print_state(*ccount);
+}
+
+/*
+ * Handle the breakpoint commands: break pc|cycle n, watch addr, delete n,
+ * breakpoints and run. Returns false if command is not one of them.
+ */
+static bool breakpoint_command(char *command, word_t *icount, word_t *ccount, byte_t *run_status, cc_t *ccp)
+{
+    char kind[20];
+    word_t value;
+    int n;
+
+    if (!strcmp(command, "break")) {
+        if (scanf("%19s %lli", kind, &value) != 2)
+            printf("Usage: break pc|cycle n\n");
+        else if (!strcmp(kind, "pc"))
+            add_breakpoint(BREAK_PC, value);
+        else if (!strcmp(kind, "cycle"))
+            add_breakpoint(BREAK_CYCLE, value);
+        else
+            printf("Unknown breakpoint type '%s'\n", kind);
+    } else if (!strcmp(command, "watch")) {
+        word_t val;
+        if (scanf("%lli", &value) != 1 || !get_word_val(sim.mem, value, &val))
+            printf("Usage: watch addr\n");
+        else
+            add_breakpoint(BREAK_WATCH, value);
+    } else if (!strcmp(command, "delete")) {
+        if (scanf("%d", &n) != 1 || n < 1 || n > breakpoint_count) {
+            printf("No such breakpoint\n");
+        } else {
+            memmove(&breakpoints[n - 1], &breakpoints[n], (breakpoint_count - n) * sizeof(breakpoint_t));
+            breakpoint_count--;
+        }
+    } else if (!strcmp(command, "breakpoints")) {
+        list_breakpoints();
+    } else if (!strcmp(command, "run")) {
+        run_to_breakpoint(icount, ccount, run_status, ccp);
+    } else {
+        return false;
+    }
+    return true;
+}
+
 void sim_interactive()
 {
     word_t ccount = 0, icount = 0, ucount = 0;
-    status = STAT_AOK;
+    sim.status = STAT_AOK;
     word_t byte_cnt = 0;
     int instructions_to_run, cycles_to_run;
     int instructions_to_undo, cycles_to_undo;
@@ -1610,7 +3835,7 @@ void sim_interactive()
     /* Emit simulator name */
     printf("%s\n", simname);
 
-    byte_cnt = load_mem(mem, object_file, 1);
+    byte_cnt = load_object(sim.mem, object_file);
     if (byte_cnt == 0) {
 	    fprintf(stderr, "No lines of code found\n");
 	    exit(1);
@@ -1618,12 +3843,13 @@ void sim_interactive()
 	    printf("%lld bytes of code read\n", byte_cnt);
     }
     fclose(object_file);
+    sim.fetch_input->predPC = sim.fetch_output->predPC = entry_pc;
 
     mem_t mem0, reg0;
-    mem0 = copy_mem(mem);
-    reg0 = copy_mem(reg);
-
-    pipe_restore_t *restore_head = NULL;
+    mem0 = copy_mem(sim.mem);
+    reg0 = copy_mem(sim.reg);
+    history_mem0 = mem0;
+    history_reg0 = reg0;
 
     char buffer[20];
     char stage_buffer[20];
@@ -1637,6 +3863,8 @@ void sim_interactive()
             buffer[0] = 'x';
         }
         printf("\n");
+        if (breakpoint_command(buffer, &icount, &ccount, &run_status, &curr_cc))
+            continue;
 
         switch(buffer[0]) {
         case 'G':
@@ -1645,9 +3873,7 @@ void sim_interactive()
                 ccount_stored = ccount;
                 icount_stored = icount;
                 while ((run_status == STAT_AOK || run_status == STAT_BUB)) {
-                    pipe_restore_t *new_restore_point = create_pipe_restore_point(&icount, &ccount, &run_status, &curr_cc);
-                    new_restore_point->next = restore_head;
-                    restore_head = new_restore_point;
+                    history_step(&icount, &ccount, &run_status, &curr_cc);
                 }
 
                 printf("Simulator ran %lld instructions in %lld cycles\n", icount - icount_stored, ccount - ccount_stored);
@@ -1679,9 +3905,7 @@ void sim_interactive()
                 icount_stored = icount;
                 ccount_stored = ccount;
                 while ((run_status == STAT_AOK || run_status == STAT_BUB) && icount - icount_stored < instructions_to_run) {
-                    pipe_restore_t *new_restore_point = create_pipe_restore_point(&icount, &ccount, &run_status, &curr_cc);
-                    new_restore_point->next = restore_head;
-                    restore_head = new_restore_point;
+                    history_step(&icount, &ccount, &run_status, &curr_cc);
                 }
 
                 printf("Simulator ran %lld instructions in %lld cycles\n", icount - icount_stored, ccount - ccount_stored);
@@ -1706,9 +3930,7 @@ void sim_interactive()
                 icount_stored = icount;
                 ccount_stored = ccount;
                 while ((run_status == STAT_AOK || run_status == STAT_BUB) && ccount - ccount_stored < cycles_to_run) {
-                    pipe_restore_t *new_restore_point = create_pipe_restore_point(&icount, &ccount, &run_status, &curr_cc);
-                    new_restore_point->next = restore_head;
-                    restore_head = new_restore_point;
+                    history_step(&icount, &ccount, &run_status, &curr_cc);
                 }
 
                 printf("Simulator ran %lld instructions in %lld cycles\n", icount - icount_stored, ccount - ccount_stored);
@@ -1724,12 +3946,12 @@ void sim_interactive()
 
         case 'M':
         case 'm':
-            diff_mem(mem0, mem, stdout);
+            diff_mem(mem0, sim.mem, stdout);
             break;
 
         case 'R':
         case 'r':
-            diff_reg(reg0, reg, stdout);
+            diff_reg(reg0, sim.reg, stdout);
             break;
 
         case 'U':
@@ -1741,17 +3963,15 @@ void sim_interactive()
             ucount = 0;
             icount_stored = icount;
             ccount_stored = ccount;
-            while (restore_head != NULL && (icount_stored - icount) < instructions_to_undo) {
-                cc = restore_head->state.cc;
-                icount = restore_head->state.icount;
-                ccount = restore_head->cycles;
-                apply_restore(mem, restore_head->state.memory);
-                apply_restore(reg, restore_head->state.registers);
-                status = restore_head->state.status;
-                run_status = status;
-                pipe_restore_t *temp = restore_head;
-                restore_head = restore_head->next;
-                restore_pipes_and_free(temp);
+            while ((icount_stored - icount) < instructions_to_undo) {
+                /* Out of restore points: rebuild them from the previous snapshot */
+                if (restore_head == NULL) {
+                    if (ccount == 0)
+                        break;
+                    history_rewind(ccount - 1, &icount, &ccount, &run_status, &curr_cc);
+                } else {
+                    history_pop(&icount, &ccount, &run_status);
+                }
                 ucount++;
             }
             printf("Instructions undone: %lld Cycles undone: %lld\n", icount_stored - icount, ccount_stored - ccount);
@@ -1760,7 +3980,7 @@ void sim_interactive()
         case 'A':
         case 'a':
             print_state(ccount);
-            dump_reg_display(stdout, reg);
+            dump_reg_display(stdout, sim.reg);
             break;
 
         case 'B':
@@ -1772,22 +3992,11 @@ void sim_interactive()
             ucount = 0;
             ccount_stored = ccount;
             icount_stored = icount;
-            while (restore_head != NULL && (ccount_stored - ccount) < cycles_to_undo) {
-                cc = restore_head->state.cc;
-                icount = restore_head->state.icount;
-                ccount = restore_head->cycles;
-                apply_restore(mem, restore_head->state.memory);
-                apply_restore(reg, restore_head->state.registers);
-                status = restore_head->state.status;
-                run_status = status;
-                pipe_restore_t *temp = restore_head;
-                restore_head = restore_head->next;
-                restore_pipes_and_free(temp);
-                ucount++;
-            }
+            history_rewind(cycles_to_undo < ccount ? ccount - cycles_to_undo : 0,
+                           &icount, &ccount, &run_status, &curr_cc);
             printf("Instructions undone: %lld Cycles undone: %lld\n", icount_stored - icount, ccount_stored - ccount);
             print_state(ccount);
-            dump_reg_display(stdout, reg);
+            dump_reg_display(stdout, sim.reg);
             break;
 
         case 'P':
@@ -1829,4 +4038,686 @@ void sim_interactive()
             break;
         }
     }
-}
\ No newline at end of file
+}
+/*****************************************************************************
+ * Library interface (libpsim.h). A context owns the simulation state of
+ * the thread that created it.
+ *****************************************************************************/
+
+struct sim_ctx {
+    byte_t run_status;
+};
+
+static SIM_LOCAL sim_ctx *sim_owner = NULL;
+
+static bool ctx_ok(sim_ctx *ctx)
+{
+    if (ctx != NULL && ctx == sim_owner)
+        return true;
+    fprintf(stderr, "sim_ctx used on a thread that does not own it\n");
+    return false;
+}
+
+/* Release what sim_init allocated, so the next sim_init starts over */
+static void sim_free()
+{
+    free_mem(sim.mem);
+    free_mem(sim.reg);
+    for (int s = 0; s < pipe_count; s++) {
+        if (pipe_slots[s] < pipe_arena || pipe_slots[s] >= pipe_arena + PIPE_ARENA)
+            free(pipe_slots[s]);
+    }
+    pipe_count = 0;
+    pipe_arena_used = 0;
+    free(predecode);
+    free(predecode_pages);
+    predecode = NULL;
+    predecode_pages = NULL;
+    bp_free();
+    initialized = 0;
+}
+
+sim_ctx *sim_ctx_create()
+{
+    if (sim_owner != NULL)
+        return NULL;
+    sim_owner = calloc(1, sizeof(sim_ctx));
+    sim_owner->run_status = STAT_AOK;
+    sim_init();
+    return sim_owner;
+}
+
+word_t sim_ctx_load(sim_ctx *ctx, const char *filename)
+{
+    if (!ctx_ok(ctx))
+        return 0;
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Couldn't open object file %s\n", filename);
+        return 0;
+    }
+    sim_reset();
+    clear_mem(sim.mem);
+    entry_pc = 0;
+    word_t byte_cnt = load_object(sim.mem, f);
+    fclose(f);
+    sim.fetch_input->predPC = sim.fetch_output->predPC = entry_pc;
+    ctx->run_status = STAT_AOK;
+    return byte_cnt;
+}
+
+word_t sim_ctx_load_buffer(sim_ctx *ctx, const void *buf, size_t len)
+{
+    word_t byte_cnt = 0;
+
+    if (!ctx_ok(ctx))
+        return 0;
+    sim_reset();
+    clear_mem(sim.mem);
+    entry_pc = 0;
+    if (is_object_image(buf, len)) {
+        byte_cnt = load_object_image(sim.mem, buf, len);
+    } else if (len > 0) {
+        FILE *f = fmemopen((void *) buf, len, "r");
+        if (f) {
+            byte_cnt = load_mem(sim.mem, f, 1);
+            fclose(f);
+        }
+    }
+    sim.fetch_input->predPC = sim.fetch_output->predPC = entry_pc;
+    ctx->run_status = STAT_AOK;
+    return byte_cnt;
+}
+
+stat_t sim_ctx_run(sim_ctx *ctx, word_t max_cycles)
+{
+    if (!ctx_ok(ctx))
+        return STAT_INS;
+    if (ctx->run_status == STAT_AOK || ctx->run_status == STAT_BUB)
+        sim_run_pipe(max_cycles, max_cycles, &ctx->run_status, NULL);
+    return ctx->run_status;
+}
+
+void sim_ctx_stats(sim_ctx *ctx, sim_stats_t *stats)
+{
+    if (!ctx_ok(ctx))
+        return;
+    stats->cycles = sim.cycles;
+    stats->instructions = sim.instructions;
+    stats->status = ctx->run_status == STAT_BUB ? STAT_AOK : ctx->run_status;
+    stats->cc = sim.cc;
+}
+
+word_t sim_ctx_reg(sim_ctx *ctx, reg_id_t id)
+{
+    return ctx_ok(ctx) ? get_reg_val(sim.reg, id) : 0;
+}
+
+bool sim_ctx_mem(sim_ctx *ctx, word_t addr, word_t *val)
+{
+    return ctx_ok(ctx) && get_word_val(sim.mem, addr, val);
+}
+
+void sim_ctx_destroy(sim_ctx *ctx)
+{
+    if (!ctx_ok(ctx))
+        return;
+    sim_free();
+    free(ctx);
+    sim_owner = NULL;
+}
+
+/*****************************************************************************
+ * Batch mode (-M). A manifest lists one program per line, optionally
+ * followed by "-l n" for its instruction limit; blank lines and lines
+ * starting with # are skipped. The programs run on a work-stealing pool
+ * with one thread per core, each on a simulator context of its own, and
+ * are checked against the ISA model like in TTY mode.
+ *****************************************************************************/
+
+typedef struct {
+    char *file;
+    word_t instr_limit;
+    /* results */
+    bool loaded;
+    bool isa_match;
+    stat_t status;
+    word_t cycles, instructions;
+} batch_job_t;
+
+/* Jobs [lo, hi) of a worker not started yet. The owner takes from hi, thieves from lo */
+typedef struct {
+    pthread_mutex_t lock;
+    int lo, hi;
+} batch_queue_t;
+
+static batch_job_t *batch_jobs;
+static batch_queue_t *batch_queues;
+static int batch_workers;
+
+/* Run the program just loaded into this thread's context and check it against the ISA model */
+static void check_job(batch_job_t *job)
+{
+    state_ptr isa_state = new_state(0);
+    free_mem(isa_state->r);
+    free_mem(isa_state->m);
+    isa_state->m = copy_mem(sim.mem);
+    isa_state->r = copy_mem(sim.reg);
+    isa_state->cc = sim.cc;
+    isa_state->pc = entry_pc;
+
+    byte_t run_status;
+    cc_t result_cc;
+    sim_run_pipe(job->instr_limit, 5 * job->instr_limit, &run_status, &result_cc);
+
+    stat_t e = STAT_AOK;
+    for (word_t step = 0; step < job->instr_limit && e == STAT_AOK; step++)
+        e = step_state(isa_state, NULL);
+    job->isa_match = !diff_reg(isa_state->r, sim.reg, NULL) && !diff_mem(isa_state->m, sim.mem, NULL)
+        && isa_state->cc == result_cc;
+    job->status = run_status;
+    job->cycles = sim.cycles;
+    job->instructions = sim.instructions;
+
+    free_state(isa_state);
+}
+
+static void run_batch_job(batch_job_t *job)
+{
+    sim_ctx *ctx = sim_ctx_create();
+
+    job->loaded = sim_ctx_load(ctx, job->file) > 0;
+    if (job->loaded)
+        check_job(job);
+    sim_ctx_destroy(ctx);
+}
+
+/* Next job for worker w: its own newest, or the oldest of another worker */
+static batch_job_t *batch_next(int w)
+{
+    batch_job_t *job = NULL;
+
+    for (int i = 0; i < batch_workers && job == NULL; i++) {
+        batch_queue_t *q = &batch_queues[(w + i) % batch_workers];
+        pthread_mutex_lock(&q->lock);
+        if (q->lo < q->hi)
+            job = &batch_jobs[i == 0 ? --q->hi : q->lo++];
+        pthread_mutex_unlock(&q->lock);
+    }
+    return job;
+}
+
+static void *batch_worker(void *arg)
+{
+    int w = (int) (long) arg;
+    batch_job_t *job;
+
+    while ((job = batch_next(w)) != NULL)
+        run_batch_job(job);
+    return NULL;
+}
+
+/* Parse the options after a program name. Returns the bad option, NULL if all are fine */
+static char *parse_job_flags(batch_job_t *job, char **save)
+{
+    char *tok;
+
+    job->instr_limit = instr_limit;
+    while ((tok = strtok_r(NULL, " \t\r\n", save)) != NULL) {
+        char *arg = strtok_r(NULL, " \t\r\n", save);
+        if (strcmp(tok, "-l") || arg == NULL)
+            return tok;
+        job->instr_limit = atoll(arg);
+    }
+    return NULL;
+}
+
+/* Read the manifest into batch_jobs. Returns the number of jobs, -1 on error */
+static int read_manifest(char *manifest)
+{
+    FILE *f = fopen(manifest, "r");
+    char line[1024];
+    int count = 0, lineno = 0;
+
+    if (!f) {
+        fprintf(stderr, "Couldn't open manifest %s\n", manifest);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *save;
+        char *tok = strtok_r(line, " \t\r\n", &save);
+        lineno++;
+        if (tok == NULL || tok[0] == '#')
+            continue;
+        batch_jobs = realloc(batch_jobs, (count + 1) * sizeof(batch_job_t));
+        batch_job_t *job = &batch_jobs[count++];
+        memset(job, 0, sizeof(*job));
+        job->file = strdup(tok);
+        if ((tok = parse_job_flags(job, &save)) != NULL) {
+            fprintf(stderr, "%s:%d: expected -l n, not '%s'\n", manifest, lineno, tok);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+static void print_json_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', out);
+        if (iscntrl((unsigned char) *str))
+            fprintf(out, "\\u%04x", *str);
+        else
+            fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+static const char *job_status(batch_job_t *job)
+{
+    return job->loaded ? stat_name(job->status) : "LOAD";
+}
+
+static const char *job_check(batch_job_t *job)
+{
+    return !job->loaded ? "none" : job->isa_match ? "pass" : "fail";
+}
+
+static double job_cpi(batch_job_t *job)
+{
+    return job->instructions > 0 ? (double) job->cycles/job->instructions : 1.0;
+}
+
+static void print_job_json(FILE *out, batch_job_t *job)
+{
+    fprintf(out, "{\"program\": ");
+    print_json_string(out, job->file);
+    fprintf(out, ", \"status\": \"%s\", \"isa_check\": \"%s\", \"cycles\": %lld, \"instructions\": %lld, \"cpi\": %.2f}",
+            job_status(job), job_check(job), job->cycles, job->instructions, job_cpi(job));
+}
+
+static void print_batch_report(int count)
+{
+    if (batch_json)
+        printf("[\n");
+    else
+        printf("program,status,isa_check,cycles,instructions,cpi\n");
+    for (int i = 0; i < count; i++) {
+        batch_job_t *job = &batch_jobs[i];
+        if (batch_json) {
+            printf("  ");
+            print_job_json(stdout, job);
+            printf("%s\n", i + 1 < count ? "," : "");
+        } else {
+            /* quote the name if it has CSV special characters */
+            if (strpbrk(job->file, ",\"\n")) {
+                putchar('"');
+                for (char *p = job->file; *p; p++) {
+                    if (*p == '"')
+                        putchar('"');
+                    putchar(*p);
+                }
+                putchar('"');
+            } else {
+                printf("%s", job->file);
+            }
+            printf(",%s,%s,%lld,%lld,%.2f\n", job_status(job), job_check(job),
+                   job->cycles, job->instructions, job_cpi(job));
+        }
+    }
+    if (batch_json)
+        printf("]\n");
+}
+
+static bool run_batch(char *manifest)
+{
+    int count = read_manifest(manifest);
+    bool ok = true;
+
+    if (count < 0)
+        return false;
+
+    batch_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (batch_workers < 1)
+        batch_workers = 1;
+    if (batch_workers > count)
+        batch_workers = count > 0 ? count : 1;
+
+    /* Deal the jobs out in contiguous ranges; stealing evens out the rest */
+    batch_queues = calloc(batch_workers, sizeof(batch_queue_t));
+    for (int w = 0; w < batch_workers; w++) {
+        pthread_mutex_init(&batch_queues[w].lock, NULL);
+        batch_queues[w].lo = (long) count * w / batch_workers;
+        batch_queues[w].hi = (long) count * (w + 1) / batch_workers;
+    }
+
+    pthread_t *threads = malloc(batch_workers * sizeof(pthread_t));
+    for (int w = 0; w < batch_workers; w++)
+        pthread_create(&threads[w], NULL, batch_worker, (void *) (long) w);
+    for (int w = 0; w < batch_workers; w++)
+        pthread_join(threads[w], NULL);
+
+    print_batch_report(count);
+    for (int i = 0; i < count; i++) {
+        ok = ok && batch_jobs[i].loaded && batch_jobs[i].isa_match;
+        free(batch_jobs[i].file);
+    }
+    free(batch_jobs);
+    free(batch_queues);
+    free(threads);
+    return ok;
+}
+
+/*****************************************************************************
+ * Server mode (-S). Listens on a Unix domain socket; every connection
+ * sends one request per line and gets one JSON line back per request:
+ *   run file [-l n]      simulate the listing or binary object in file
+ *   load len [-l n]      simulate the len bytes that follow the line
+ *   quit                 close the connection
+ * The main thread polls the connections and queues each complete request
+ * as a job. One worker thread per core keeps a simulator context for its
+ * whole life, only resets it between jobs, and writes the answer. A
+ * connection has at most one job queued or running, so its answers come
+ * back in order, and idle connections tie up no worker.
+ *****************************************************************************/
+
+#define SERVER_MAX_LOAD (16 << 20)
+#define SERVER_MAX_LINE 1024
+
+typedef struct {
+    int fd;
+    bool busy;              /* a job of it is queued or running [server_lock] */
+    bool closing;           /* close once busy is clear */
+    bool eof;
+    char *buf;              /* bytes received and not yet parsed */
+    size_t len, cap;
+} server_conn_t;
+
+typedef struct server_req {
+    server_conn_t *conn;
+    batch_job_t job;
+    const char *error;      /* answer with this instead of simulating */
+    byte_t *data;           /* the bytes of a load */
+    size_t data_len;
+    struct server_req *next;
+} server_req_t;
+
+static server_req_t *server_head = NULL, *server_tail = NULL;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t server_cond = PTHREAD_COND_INITIALIZER;
+static int server_wake[2];  /* workers write a byte here when a connection is free again */
+
+static void server_error(FILE *out, const char *msg)
+{
+    fprintf(out, "{\"error\": ");
+    print_json_string(out, msg);
+    fprintf(out, "}\n");
+}
+
+/* Simulate one request on the worker's context and send the answer */
+static void serve_request(sim_ctx *ctx, server_req_t *req)
+{
+    char *answer = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&answer, &size);
+    batch_job_t *job = &req->job;
+
+    if (req->error) {
+        server_error(out, req->error);
+    } else {
+        if (req->data)
+            job->loaded = sim_ctx_load_buffer(ctx, req->data, req->data_len) > 0;
+        else
+            job->loaded = sim_ctx_load(ctx, job->file) > 0;
+        if (job->loaded)
+            check_job(job);
+        print_job_json(out, job);
+        fputc('\n', out);
+    }
+    fclose(out);
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = write(req->conn->fd, answer + done, size - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    free(answer);
+}
+
+static void *server_worker(void *arg)
+{
+    sim_ctx *ctx = sim_ctx_create();
+
+    while (1) {
+        pthread_mutex_lock(&server_lock);
+        while (server_head == NULL)
+            pthread_cond_wait(&server_cond, &server_lock);
+        server_req_t *req = server_head;
+        server_head = req->next;
+        if (server_head == NULL)
+            server_tail = NULL;
+        pthread_mutex_unlock(&server_lock);
+
+        serve_request(ctx, req);
+
+        pthread_mutex_lock(&server_lock);
+        req->conn->busy = false;
+        pthread_mutex_unlock(&server_lock);
+        /* If the pipe is full the main thread is woken up already */
+        if (write(server_wake[1], "", 1) < 0 && errno != EAGAIN)
+            perror("server wake");
+        if (req->job.file != NULL && strcmp(req->job.file, "-"))
+            free(req->job.file);
+        free(req->data);
+        free(req);
+    }
+    return NULL;
+}
+
+static void server_queue(server_conn_t *conn, server_req_t *req)
+{
+    req->conn = conn;
+    req->next = NULL;
+    pthread_mutex_lock(&server_lock);
+    conn->busy = true;
+    if (server_tail)
+        server_tail->next = req;
+    else
+        server_head = req;
+    server_tail = req;
+    pthread_cond_signal(&server_cond);
+    pthread_mutex_unlock(&server_lock);
+}
+
+/* Drop the first n bytes of what conn received */
+static void server_consume(server_conn_t *conn, size_t n)
+{
+    memmove(conn->buf, conn->buf + n, conn->len - n);
+    conn->len -= n;
+}
+
+/*
+ * Take the next complete request off the buffer of conn. Returns NULL
+ * when there is none yet, or when the connection asked to be closed.
+ */
+static server_req_t *server_parse(server_conn_t *conn)
+{
+    while (!conn->closing) {
+        char line[SERVER_MAX_LINE];
+        char *nl = memchr(conn->buf, '\n', conn->len);
+        server_req_t *req;
+
+        if (nl == NULL && conn->len < SERVER_MAX_LINE)
+            return NULL;
+        req = calloc(1, sizeof(server_req_t));
+        if (nl == NULL || nl - conn->buf >= SERVER_MAX_LINE) {
+            req->error = "request too long";
+            conn->closing = true;
+            return req;
+        }
+
+        size_t line_len = nl - conn->buf + 1;
+        memcpy(line, conn->buf, line_len - 1);
+        line[line_len - 1] = '\0';
+
+        char *save;
+        char *cmd = strtok_r(line, " \t\r", &save);
+        char *arg = strtok_r(NULL, " \t\r", &save);
+
+        if (cmd == NULL) {
+            free(req);
+            server_consume(conn, line_len);
+            continue;
+        }
+        if (!strcmp(cmd, "quit")) {
+            free(req);
+            conn->closing = true;
+            return NULL;
+        }
+        if (!strcmp(cmd, "load") && arg) {
+            long len = atol(arg);
+            if (len <= 0 || len > SERVER_MAX_LOAD) {
+                req->error = "bad load length";
+                conn->closing = true;
+                return req;
+            }
+            if (conn->len < line_len + len) {
+                free(req);
+                return NULL;
+            }
+            /* The payload goes with the line even if the flags are bad */
+            if (parse_job_flags(&req->job, &save) != NULL) {
+                req->error = "expected -l n";
+            } else {
+                req->job.file = "-";
+                req->data = malloc(len);
+                req->data_len = len;
+                memcpy(req->data, conn->buf + line_len, len);
+            }
+            line_len += len;
+        } else if (!strcmp(cmd, "run") && arg) {
+            if (parse_job_flags(&req->job, &save) != NULL)
+                req->error = "expected -l n";
+            else
+                req->job.file = strdup(arg);
+        } else {
+            req->error = "expected run file or load len";
+        }
+        server_consume(conn, line_len);
+        return req;
+    }
+    return NULL;
+}
+
+/* Read what is waiting on conn; false once the client is gone */
+static bool server_read(server_conn_t *conn)
+{
+    if (conn->cap - conn->len < 4096) {
+        conn->cap = conn->cap ? 2 * conn->cap : 8192;
+        conn->buf = realloc(conn->buf, conn->cap);
+    }
+    ssize_t n = read(conn->fd, conn->buf + conn->len, conn->cap - conn->len);
+    if (n <= 0)
+        return false;
+    conn->len += n;
+    return true;
+}
+
+static void run_server(char *path)
+{
+    struct sockaddr_un addr;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    server_conn_t **conns = NULL;
+    struct pollfd *fds = NULL;
+    int nconns = 0, max_conns = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sock < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Couldn't create socket %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 64) < 0
+            || pipe(server_wake) < 0) {
+        fprintf(stderr, "Couldn't listen on %s\n", path);
+        exit(1);
+    }
+    fcntl(server_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(server_wake[1], F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (workers < 1)
+        workers = 1;
+    for (int w = 0; w < workers; w++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, server_worker, NULL);
+        pthread_detach(thread);
+    }
+
+    while (1) {
+        /* Queue what idle connections have complete, close finished ones */
+        for (int i = 0; i < nconns; i++) {
+            server_conn_t *conn = conns[i];
+            pthread_mutex_lock(&server_lock);
+            bool busy = conn->busy;
+            pthread_mutex_unlock(&server_lock);
+            if (busy)
+                continue;
+            server_req_t *req = server_parse(conn);
+            if (req != NULL) {
+                server_queue(conn, req);
+            } else if (conn->closing || conn->eof) {
+                close(conn->fd);
+                free(conn->buf);
+                free(conn);
+                conns[i--] = conns[--nconns];
+            }
+        }
+
+        /* Only idle connections are polled, the others wait for their answer */
+        if (max_conns < nconns + 1) {
+            max_conns = 2 * (nconns + 1);
+            conns = realloc(conns, max_conns * sizeof(server_conn_t *));
+            fds = realloc(fds, (max_conns + 2) * sizeof(struct pollfd));
+        }
+        int nfds = 2;
+        fds[0].fd = server_wake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = sock;
+        fds[1].events = POLLIN;
+        for (int i = 0; i < nconns; i++) {
+            pthread_mutex_lock(&server_lock);
+            bool busy = conns[i]->busy;
+            pthread_mutex_unlock(&server_lock);
+            fds[nfds].fd = busy ? -1 : conns[i]->fd;
+            fds[nfds++].events = POLLIN;
+        }
+        if (poll(fds, nfds, -1) < 0)
+            continue;
+
+        if (fds[0].revents) {
+            char drain[64];
+            while (read(server_wake[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        for (int i = 0; i < nconns; i++) {
+            if (fds[i + 2].revents && !server_read(conns[i]))
+                conns[i]->eof = true;
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(sock, NULL, NULL);
+            if (fd >= 0) {
+                server_conn_t *conn = calloc(1, sizeof(server_conn_t));
+                conn->fd = fd;
+                conns[nconns++] = conn;
+            }
+        }
+    }
+}
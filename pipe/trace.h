@@ -0,0 +1,54 @@
+/**************************************************************************
+ * trace.h - Binary per-cycle event trace shared by psim (-B) and tracedump
+ *
+ * A trace file is a trace_header_t followed by one trace_rec_t per cycle,
+ * both in host byte order.
+ **************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TR_MAGIC   "Y86TRC1"
+#define TR_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;      /* sizeof(trace_rec_t) of the writer */
+} trace_header_t;
+
+/* Where decode took valA/valB from */
+typedef enum {
+    FWD_REG, FWD_VALP, FWD_E_DSTE, FWD_M_DSTM, FWD_M_DSTE, FWD_W_DSTM, FWD_W_DSTE
+} trace_fwd_t;
+
+/* mem_op bits */
+#define TR_MEM_WRITE 0x1
+#define TR_MEM_ERROR 0x2
+
+/*
+ * The pipeline registers as tty_report shows them at the start of a cycle,
+ * followed by what the stages decided during it.
+ */
+typedef struct {
+    uint64_t cycle;
+    uint64_t f_predpc;
+    uint64_t d_valc, d_valp, d_pc;
+    uint64_t e_valc, e_vala, e_valb, e_pc;
+    uint64_t m_vale, m_vala, m_pc;
+    uint64_t w_vale, w_valm, w_pc;
+    uint64_t f_pc;              /* PC fetched this cycle */
+    uint64_t mem_addr, mem_data;
+    uint8_t cc, status;
+    uint8_t d_instr, d_ra, d_rb, d_status;
+    uint8_t e_instr, e_srca, e_srcb, e_deste, e_destm, e_status;
+    uint8_t m_instr, m_cnd, m_deste, m_destm, m_status;
+    uint8_t w_instr, w_deste, w_destm, w_status;
+    uint8_t ops[5];             /* p_stat_t of F, D, E, M, W for the next update */
+    uint8_t fwd_a, fwd_b;       /* trace_fwd_t */
+    uint8_t mem_op;             /* TR_MEM_* bits, 0 if no write */
+} trace_rec_t;
+
+#endif /* TRACE_H */
@@ -0,0 +1,194 @@
+/**************************************************************************
+ * tracedump.c - Render a binary event trace written by psim -B
+ *
+ * Prints each cycle in the same format psim -v 2 uses for the pipeline
+ * registers, optionally with the stall/bubble, forwarding and memory
+ * events of the cycle, or only a summary of those events.
+ **************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "isa.h"
+#include "pipeline.h"
+#include "trace.h"
+
+#define REC_BUFFER 4096
+
+/* Same type as the trace_rec_t fields they are compared with */
+static uint64_t first_cycle = 0;
+static uint64_t last_cycle = UINT64_MAX;
+static uint64_t pc_filter = UINT64_MAX; /* UINT64_MAX shows every cycle */
+static int show_events = 0;
+static int summary = 0;
+
+static const char *stage_names[] = { "F", "D", "E", "M", "W" };
+
+static const char *fwd_names[] = {
+    "register file", "valP", "e_dstE", "M_dstM", "M_dstE", "W_dstM", "W_dstE"
+};
+
+/* Counters for -s */
+static word_t op_counts[5][4];
+static word_t fwd_counts[2][7];
+static word_t cycle_count;
+
+static void usage(char *name)
+{
+    printf("Usage: %s [-hes] [-c first[,last]] [-p pc] file.trc\n", name);
+    printf("   -h     Print this message\n");
+    printf("   -c n,m Only show cycles n through m\n");
+    printf("   -p pc  Only show cycles where some stage holds the instruction at pc\n");
+    printf("   -e     Also show stalls, bubbles, forwarding and memory writes\n");
+    printf("   -s     Only print how often each of those events happened\n");
+    exit(0);
+}
+
+static const char *op_name_of(int op)
+{
+    switch (op) {
+    case P_LOAD:   return "load";
+    case P_STALL:  return "stall";
+    case P_BUBBLE: return "bubble";
+    default:       return "error";
+    }
+}
+
+static int holds_pc(trace_rec_t *r, uint64_t pc)
+{
+    return r->f_pc == pc || r->d_pc == pc || r->e_pc == pc
+        || r->m_pc == pc || r->w_pc == pc;
+}
+
+static void print_record(trace_rec_t *r)
+{
+    printf("\nCycle = %lld. CC = %s, Stat = %s\n", (word_t) r->cycle, cc_name(r->cc), stat_name(r->status));
+    printf("F: predPC = 0x%llx\n", (word_t) r->f_predpc);
+    printf("D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s, Stage PC = 0x%llx\n",
+           iname(r->d_instr), reg_name(r->d_ra), reg_name(r->d_rb),
+           (word_t) r->d_valc, (word_t) r->d_valp, stat_name(r->d_status), (word_t) r->d_pc);
+    printf("E: instr = %s, valC = 0x%llx, valA = 0x%llx, valB = 0x%llx\n   srcA = %s, srcB = %s, dstE = %s, dstM = %s, Stat = %s, Stage PC = 0x%llx\n",
+           iname(r->e_instr), (word_t) r->e_valc, (word_t) r->e_vala, (word_t) r->e_valb,
+           reg_name(r->e_srca), reg_name(r->e_srcb), reg_name(r->e_deste), reg_name(r->e_destm),
+           stat_name(r->e_status), (word_t) r->e_pc);
+    printf("M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s, Stage PC = 0x%llx\n",
+           iname(r->m_instr), r->m_cnd, (word_t) r->m_vale, (word_t) r->m_vala,
+           reg_name(r->m_deste), reg_name(r->m_destm), stat_name(r->m_status), (word_t) r->m_pc);
+    printf("W: instr = %s, valE = 0x%llx, valM = 0x%llx, dstE = %s, dstM = %s, Stat = %s, Stage PC = 0x%llx\n",
+           iname(r->w_instr), (word_t) r->w_vale, (word_t) r->w_valm,
+           reg_name(r->w_deste), reg_name(r->w_destm), stat_name(r->w_status), (word_t) r->w_pc);
+
+    if (!show_events)
+        return;
+    printf("\tFetch: f_pc = 0x%llx\n", (word_t) r->f_pc);
+    if (r->fwd_a != FWD_REG)
+        printf("\tDecode: valA from %s\n", fwd_names[r->fwd_a]);
+    if (r->fwd_b != FWD_REG)
+        printf("\tDecode: valB from %s\n", fwd_names[r->fwd_b]);
+    if (r->mem_op & TR_MEM_WRITE) {
+        if (r->mem_op & TR_MEM_ERROR)
+            printf("\tMemory: Couldn't write to address 0x%llx\n", (word_t) r->mem_addr);
+        else
+            printf("\tMemory: Wrote 0x%llx to address 0x%llx\n", (word_t) r->mem_data, (word_t) r->mem_addr);
+    }
+    for (int s = 0; s < 5; s++) {
+        if (r->ops[s] != P_LOAD)
+            printf("\tControl: %s %s\n", stage_names[s], op_name_of(r->ops[s]));
+    }
+}
+
+static void count_record(trace_rec_t *r)
+{
+    cycle_count++;
+    for (int s = 0; s < 5; s++)
+        op_counts[s][r->ops[s] & 3]++;
+    fwd_counts[0][r->fwd_a]++;
+    fwd_counts[1][r->fwd_b]++;
+}
+
+static void print_summary()
+{
+    printf("%lld cycles\n", cycle_count);
+    for (int s = 0; s < 5; s++) {
+        printf("%s: %lld stall, %lld bubble, %lld error\n", stage_names[s],
+               op_counts[s][P_STALL], op_counts[s][P_BUBBLE], op_counts[s][P_ERROR]);
+    }
+    for (int f = 0; f < 7; f++) {
+        printf("valA/valB from %-13s: %lld / %lld\n", fwd_names[f], fwd_counts[0][f], fwd_counts[1][f]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    trace_header_t header;
+    FILE *file;
+
+    while ((c = getopt(argc, argv, "hc:p:es")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'c': {
+            unsigned long long first, last = UINT64_MAX;
+            if (sscanf(optarg, "%llu,%llu", &first, &last) < 1) {
+                printf("Invalid cycle range '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            first_cycle = first;
+            last_cycle = last;
+            break;
+        }
+        case 'p':
+            pc_filter = strtoull(optarg, NULL, 0);
+            break;
+        case 'e':
+            show_events = 1;
+            break;
+        case 's':
+            summary = 1;
+            break;
+        default:
+            printf("Invalid option '%c'\n", c);
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    file = fopen(argv[optind], "rb");
+    if (!file) {
+        fprintf(stderr, "Couldn't open trace file %s\n", argv[optind]);
+        exit(1);
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, TR_MAGIC, sizeof(TR_MAGIC))
+            || header.version != TR_VERSION || header.rec_size != sizeof(trace_rec_t)) {
+        fprintf(stderr, "%s is not a trace this tracedump can read\n", argv[optind]);
+        exit(1);
+    }
+
+    trace_rec_t *recs = malloc(REC_BUFFER * sizeof(trace_rec_t));
+    size_t n;
+    while ((n = fread(recs, sizeof(trace_rec_t), REC_BUFFER, file)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            trace_rec_t *r = &recs[i];
+            if (r->cycle < first_cycle || r->cycle > last_cycle)
+                continue;
+            if (pc_filter != UINT64_MAX && !holds_pc(r, pc_filter))
+                continue;
+            if (summary)
+                count_record(r);
+            else
+                print_record(r);
+        }
+    }
+    if (summary)
+        print_summary();
+    free(recs);
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/**************************************************************************
+ * yo2bin.c - Convert a .yo listing into the binary object format of yobj.h
+ *
+ * Every run of bytes at consecutive addresses becomes one segment, so a
+ * typical listing turns into a handful of segments that psim copies into
+ * memory without parsing any text.
+ **************************************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "yobj.h"
+
+#define LINELEN 4096
+
+static yobj_segment_t *segs = NULL;
+static int nsegs = 0;
+static unsigned char *data = NULL;
+static size_t data_len = 0, data_cap = 0;
+
+static void usage(char *name)
+{
+    printf("Usage: %s [-h] [-e entry] file.yo file.ybo\n", name);
+    printf("   -h     Print this message\n");
+    printf("   -e pc  Start execution at pc (default 0)\n");
+    exit(0);
+}
+
+/* Append one byte at addr, extending the last segment when it is contiguous */
+static void add_byte(unsigned long long addr, unsigned char b)
+{
+    if (nsegs == 0 || segs[nsegs - 1].addr + segs[nsegs - 1].size != addr) {
+        segs = realloc(segs, (nsegs + 1) * sizeof(yobj_segment_t));
+        segs[nsegs].addr = addr;
+        segs[nsegs].offset = data_len;
+        segs[nsegs].size = 0;
+        nsegs++;
+    }
+    if (data_len == data_cap) {
+        data_cap = data_cap ? 2 * data_cap : 4096;
+        data = realloc(data, data_cap);
+    }
+    data[data_len++] = b;
+    segs[nsegs - 1].size++;
+}
+
+/* Same lines as load_mem() accepts: "0xaddr: hexbytes | comment" */
+static int read_listing(FILE *in)
+{
+    char line[LINELEN];
+    int lineno = 0;
+
+    while (fgets(line, LINELEN, in)) {
+        char *p = line, *end;
+        unsigned long long addr;
+
+        lineno++;
+        while (isspace((unsigned char) *p))
+            p++;
+        if (strncmp(p, "0x", 2))
+            continue;
+        addr = strtoull(p, &end, 16);
+        if (*end != ':')
+            continue;
+        p = end + 1;
+        while (*p == ' ')
+            p++;
+        while (isxdigit((unsigned char) p[0])) {
+            unsigned b;
+            if (!isxdigit((unsigned char) p[1]) || sscanf(p, "%2x", &b) != 1) {
+                fprintf(stderr, "Line %d: odd number of hex digits\n", lineno);
+                return -1;
+            }
+            add_byte(addr++, b);
+            p += 2;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    unsigned long long entry = 0;
+    yobj_header_t header;
+    FILE *in, *out;
+
+    while ((c = getopt(argc, argv, "he:")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'e':
+            entry = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            printf("Invalid option '%c'\n", c);
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (optind != argc - 2)
+        usage(argv[0]);
+
+    in = fopen(argv[optind], "r");
+    if (!in) {
+        fprintf(stderr, "Couldn't open object file %s\n", argv[optind]);
+        exit(1);
+    }
+    if (read_listing(in) < 0)
+        exit(1);
+    fclose(in);
+    if (data_len == 0) {
+        fprintf(stderr, "No lines of code found\n");
+        exit(1);
+    }
+
+    /* Contents follow the segment table */
+    size_t base = sizeof(header) + nsegs * sizeof(yobj_segment_t);
+    for (int i = 0; i < nsegs; i++)
+        segs[i].offset += base;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, YOBJ_MAGIC, sizeof(YOBJ_MAGIC));
+    header.version = YOBJ_VERSION;
+    header.nsegs = nsegs;
+    header.entry = entry;
+
+    out = fopen(argv[optind + 1], "wb");
+    if (!out) {
+        fprintf(stderr, "Couldn't open %s for writing\n", argv[optind + 1]);
+        exit(1);
+    }
+    if (fwrite(&header, sizeof(header), 1, out) != 1
+            || fwrite(segs, sizeof(yobj_segment_t), nsegs, out) != (size_t) nsegs
+            || fwrite(data, 1, data_len, out) != data_len
+            || fclose(out)) {
+        fprintf(stderr, "Couldn't write %s\n", argv[optind + 1]);
+        exit(1);
+    }
+    free(segs);
+    free(data);
+    return 0;
+}
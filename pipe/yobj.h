@@ -0,0 +1,31 @@
+/**************************************************************************
+ * yobj.h - Binary Y86 object format written by yo2bin and loaded by psim
+ *
+ * An object file is a yobj_header_t, then nsegs yobj_segment_t, then the
+ * segment contents, all in host byte order. Segments are copied into
+ * memory in file order, so a later segment overwrites an earlier one
+ * just like a later line of a .yo listing does.
+ **************************************************************************/
+
+#ifndef YOBJ_H
+#define YOBJ_H
+
+#include <stdint.h>
+
+#define YOBJ_MAGIC   "Y86OBJ1"
+#define YOBJ_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nsegs;
+    uint64_t entry;         /* initial PC */
+} yobj_header_t;
+
+typedef struct {
+    uint64_t addr;          /* where the segment goes in Y86 memory */
+    uint64_t offset;        /* where its bytes start in the file */
+    uint64_t size;
+} yobj_segment_t;
+
+#endif /* YOBJ_H */